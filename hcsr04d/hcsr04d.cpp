@@ -0,0 +1,156 @@
+/*
+ * Shared memory broker of the HC-SR04 Linux device driver
+ * Copyright (C) 2016  Jeune Prime M. Origines <primeyo2004@yahoo.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * */
+
+/* Reads every given sensor and publishes its samples in a POSIX shared
+ * memory segment, see hcsr04/shm.hpp, so that any number of local
+ * processes get the current distances without a system call */
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "hcsr04/client.hpp"
+#include "hcsr04/shm.hpp"
+
+namespace {
+
+volatile std::sig_atomic_t stop_requested = 0;
+
+void handle_stop(int) {
+   stop_requested = 1;
+}
+
+void usage(const char* prog) {
+   std::fprintf(stderr,
+                "usage: %s [-n name] [-r rate_hz] [-b batch] [-u usec_budget] [device...]\n"
+                "   -n  shared memory segment, default %s\n"
+                "   -r  sampling rate of the devices, default 10\n"
+                "   -b  samples per wakeup, default 1\n"
+                "   -u  latency budget of a wakeup batch in usec, default 0\n"
+                "   the devices default to /dev/hcsr04_driver\n",
+                prog, hcsr04::shm::default_name);
+}
+
+/* one per device, the samples are published as soon as they are read */
+hcsr04::task pump(hcsr04::device& dev, hcsr04::reactor& loop,
+                  hcsr04::shm::publisher& pub, std::size_t index) {
+   hcsr04::sample samples[64];
+
+   while (!stop_requested) {
+      std::size_t count = co_await dev.async_read(loop, samples);
+
+      if (count == 0) {
+         /* a spurious wake up, unless no sample is coming at all */
+         std::optional<std::size_t> more = dev.try_read(samples);
+         if (!more) {
+            continue;
+         }
+         if (*more == 0) {
+            std::fprintf(stderr, "hcsr04d: no more samples from sensor %zu\n", index);
+            co_return;
+         }
+         count = *more;
+      }
+
+      pub.publish(index, std::span<const hcsr04::sample>(samples, count));
+   }
+}
+
+}
+
+int main(int argc, char* argv[]) {
+   std::string name = hcsr04::shm::default_name;
+   unsigned int rate_hz = 10;
+   unsigned int batch = 1;
+   unsigned int usec_budget = 0;
+   int opt;
+
+   while ((opt = ::getopt(argc, argv, "n:r:b:u:h")) != -1) {
+      switch (opt) {
+      case 'n':
+         name = optarg;
+         break;
+      case 'r':
+         rate_hz = std::strtoul(optarg, nullptr, 0);
+         break;
+      case 'b':
+         batch = std::strtoul(optarg, nullptr, 0);
+         break;
+      case 'u':
+         usec_budget = std::strtoul(optarg, nullptr, 0);
+         break;
+      default:
+         usage(argv[0]);
+         return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+      }
+   }
+
+   std::vector<std::string> paths(argv + optind, argv + argc);
+   if (paths.empty()) {
+      paths.emplace_back("/dev/hcsr04_driver");
+   }
+   if (rate_hz == 0 || paths.size() > hcsr04::shm::max_sensors) {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+   }
+
+   struct sigaction sa{};
+   sa.sa_handler = handle_stop;
+   ::sigaction(SIGINT, &sa, nullptr);
+   ::sigaction(SIGTERM, &sa, nullptr);
+
+   try {
+      std::vector<hcsr04::device> devices;
+      hcsr04::shm::publisher pub(name);
+      hcsr04::epoll_reactor loop;
+
+      devices.reserve(paths.size());
+      for (const std::string& path : paths) {
+         hcsr04::device& dev = devices.emplace_back(path, true);
+
+         if (batch > 1 || usec_budget > 0) {
+            dev.set_wakeup(batch, usec_budget);
+         }
+         dev.set_rate(rate_hz);
+         pub.add_sensor(path, dev.config().echo_count);
+      }
+
+      for (std::size_t i = 0; i < devices.size(); ++i) {
+         pump(devices[i], loop, pub, i);
+      }
+
+      /* the heartbeat tells the readers a stalled daemon from an idle sensor */
+      while (!stop_requested) {
+         loop.run_once(1000);
+         pub.heartbeat();
+      }
+   }
+   catch (const std::exception& e) {
+      std::fprintf(stderr, "%s\n", e.what());
+      return EXIT_FAILURE;
+   }
+
+   return EXIT_SUCCESS;
+}
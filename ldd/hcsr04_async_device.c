@@ -26,11 +26,56 @@
 #include <linux/timer.h>
 #include <linux/spinlock.h>
 #include <linux/slab.h>
-#include <linux/semaphore.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/kfifo.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
+#include <linux/poll.h>
+#include <linux/fs.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/kthread.h>
 #include "hcsr04_async_device.h"
+#include "hcsr04_history.h"
 
 #define INVALID_GPIO_NUM 0xFFFFFFFF
 #define INVALID_IRQ_NUM  -1
+#define INVALID_EXT_GPIO_NUM -1
+
+/* number of samples buffered per client, must be a power of 2,
+ * room for 16 cycles of every echo */
+#define SAMPLE_FIFO_SIZE (16 * HCSR04_MAX_ECHOES)
+
+/* number of raw edges buffered for the edge capture, must be a power of 2 */
+#define EDGE_FIFO_SIZE 512
+
+/* consecutive failed cycles until the device is considered failed and
+ * its triggers are backed off, starting from the minimum cycle time and
+ * doubling with every further failure up to the maximum back-off */
+#define HEALTH_FAILED_THRESHOLD  4
+#define MAX_BACKOFF_USEC         2000000
+
+/* handler timing, compiled in with make HCSR04_PROFILE=1 */
+#ifdef HCSR04_PROFILE
+#define PROFILE_START(start)              ktime_t start = ktime_get()
+#define PROFILE_STOP(pdev,handler,start)  profile_handler(pdev,&(pdev)->profile.handler,start)
+#else
+#define PROFILE_START(start)
+#define PROFILE_STOP(pdev,handler,start)
+#endif
+
+/* the pins, the timers and the clock of the controller, a test build
+ * (HCSR04_TEST) supplies fakes instead, see test/ */
+#ifndef HCSR04_TEST
+#define hw_gpio_get(gpio)                gpio_get_value(gpio)
+#define hw_gpio_set(gpio,value)          gpio_set_value(gpio,value)
+#define hw_timer_start(timer,time,mode)  hrtimer_start(timer,time,mode)
+#define hw_timer_cancel(timer)           hrtimer_cancel(timer)
+#define hw_timer_try_to_cancel(timer)    hrtimer_try_to_cancel(timer)
+#define hw_clock()                       ktime_get()
+#define hw_timestamp(ts)                 getnstimeofday(ts)
+#endif
 
 /* controller status enumeration */
 typedef enum {
@@ -45,6 +90,14 @@ typedef enum {
 } controller_status_t;
 
 
+/* what has started the cycle in progress */
+typedef enum {
+  CYCLE_SRC_USER = 0,    /* start_async_ranging() */
+  CYCLE_SRC_SLOT,        /* a periodic slot */
+  CYCLE_SRC_EXTERNAL     /* an external trigger */
+} cycle_source_t;
+
+
 /* Event source flags */
 typedef enum {
   EVENT_SRC_USR_WR       = 0x01,
@@ -52,8 +105,9 @@ typedef enum {
   EVENT_SRC_TRG_HI       = 0x04,
   EVENT_SRC_TRG_LO       = 0x08,
   EVENT_SRC_TIMEOUT      = 0x10,
-  EVENT_SRC_INTERRUPT_RISE    = 0x20,
-  EVENT_SRC_INTERRUPT_FALL    = 0x40
+  EVENT_SRC_INTERRUPT_RISE    = 0x20,  /* the first echo has risen */
+  EVENT_SRC_INTERRUPT_FALL    = 0x40,  /* every echo has fallen */
+  EVENT_SRC_ECHO_STUCK        = 0x80
 } event_src_flags_t;
 
 
@@ -63,34 +117,168 @@ struct range_data {
     struct timespec  delta_time;
 };
 
+struct device_data;
+
+/* an echo line sharing the trigger line of the device */
+struct echo_channel {
+  struct device_data* pdev_data;
+  unsigned int        gpio;
+  int                 irq_num;
+  u8                  evt_src_flags;  /* EVENT_SRC_INTERRUPT_* of this echo */
+  struct range_data   range;
+
+  /* the last echo widths for the filter */
+  u32                 filter_hist[3];
+  unsigned int        filter_count;   /* valid entries of filter_hist */
+};
+
+/* an open file of the device with its own rate and sample queue */
+struct ranging_client {
+  struct list_head      node;
+  struct device_data*   pdev_data;
+  ktime_t               period;     /* zero for on demand sampling */
+  ktime_t               next_due;   /* the time the next periodic sample is due */
+  bool                  pending;    /* an on demand sample has been requested */
+  DECLARE_KFIFO(samples, struct ranging_sample, SAMPLE_FIFO_SIZE);
+  wait_queue_head_t     wq;
+  struct fasync_struct* async_queue;
+
+  /* wakeup moderation, the reader is woken once wake_batch samples are
+   * queued or wake_budget after the first one, whichever comes first */
+  unsigned int          wake_batch;
+  ktime_t               wake_budget;   /* zero for no budget */
+  struct hrtimer        wake_timer;
+  bool                  wake_ready;    /* woken, until the queue runs empty */
+  struct hcsr04_wakeup_stats wakeup;
+};
+
 struct gpio_config{
   unsigned int trigger_gpio;
-  unsigned int echo_gpio; 
-  int irq_num;
   unsigned int usec_pulse_width;
   unsigned int usec_timeout;
+  int ext_trigger_gpio;
+  int ext_trigger_irq_num;
 };
 
 
 struct device_data {
-   bool                  blocking;
    spinlock_t            lock;
-   struct semaphore      ready_sem;
 
 
    controller_status_t   ctl_stat;                                                                                   
    u8                    evt_src_flags;
 
-   struct range_data     range;
    struct gpio_config    gpio; 
+   struct echo_channel   echo[HCSR04_MAX_ECHOES];
+   unsigned int          echo_count;
+
+   /* the pins are being changed, no cycle may start meanwhile */
+   bool                  reconfiguring;
 
+   /* the device is being released, the controller is no longer run
+    * nor its timer armed */
+   bool                  stopping;
+
+   /* the controller runs in the exec.context, see set_execution_context() */
    struct tasklet_struct controller_tasklet;
-   struct timer_list     operation_timer;
+   struct work_struct    controller_work;
+   struct task_struct*   controller_thread;
+   wait_queue_head_t     controller_thread_wq;
+   bool                  controller_thread_kick;
+   struct mutex          exec_lock;
+   struct hcsr04_exec    exec;
+
+   /* the controller run has been requested at dispatch_time */
+   bool                  dispatch_pending;
+   ktime_t               dispatch_time;
+   struct hcsr04_dispatch_stats dispatch;
+
+   struct hrtimer        operation_timer;
+
+   /* the end of the last trigger pulse, used to enforce the minimum cycle time */
+   ktime_t               last_trigger_time;
+
+   /* periodic sampling, merged from the rates of the clients */
+   struct hrtimer        period_timer;
+   ktime_t               period;          /* zero when periodic sampling is off */
+   struct mutex          schedule_lock;
+
+   /* the source and the request time of the cycle in progress */
+   cycle_source_t        cycle_source;
+   ktime_t               request_time;
+
+   u32                   next_seq;
+   struct list_head      clients;
+
+   /* the readers of the edges */
+   wait_queue_head_t     edge_wq;
+
+   /* raw edge capture, on while it has users */
+   unsigned int          edge_capture_users;
+   bool                  cycle_capture;   /* the cycle in progress only records edges */
+   DECLARE_KFIFO_PTR(edges, struct hcsr04_edge);
+
+   struct hcsr04_stats   stats;
+
+   /* the long term history of the published samples, may be NULL */
+   void*                 history;
+
+   /* the settings applied at the start of the next cycle */
+   struct {
+      unsigned int usec_pulse_width;
+      unsigned int usec_timeout;
+      u32          filter;
+   } pending;
+
+   /* HCSR04_FILTER_* of the published samples */
+   u32                   filter;
+
+   /* sensor health, the triggers are held back until backoff_until */
+   struct hcsr04_health  health;
+   ktime_t               backoff_until;
+
+#ifdef HCSR04_PROFILE
+   struct hcsr04_profile profile;
+#endif
 };
 
+static void run_controller(struct device_data* pdev_data);
+static void dispatch_controller(struct device_data* pdev_data);
 static void async_controller_tasklet_func(unsigned long arg);
-static void async_operation_timer_func(unsigned long arg);
+static void async_controller_work_func(struct work_struct* work);
+static int async_controller_thread_func(void* arg);
+static enum hrtimer_restart async_operation_timer_func(struct hrtimer* timer);
+static void start_operation_timer(struct device_data* pdev_data,unsigned long usec_delay);
 static irqreturn_t irq_handler(int irq,void* dev_id);
+static enum hrtimer_restart periodic_slot_timer_func(struct hrtimer* timer);
+static unsigned long next_trigger_delay(struct device_data* pdev_data);
+static void stop_controller_thread(struct device_data* pdev_data);
+static irqreturn_t ext_trigger_irq_handler(int irq,void* dev_id);
+static bool sample_queue_active(struct device_data* pdev_data);
+static int request_triggered_cycle(struct device_data* pdev_data,ktime_t request_time,cycle_source_t source);
+static void update_health(struct device_data* pdev_data,controller_status_t ctl_stat);
+static void update_trigger_latency(struct device_data* pdev_data);
+static void publish_ranging_samples(struct device_data* pdev_data);
+static void update_schedule(struct device_data* pdev_data);
+static int request_client_sample(struct ranging_client* client);
+static void serve_pending_clients(struct device_data* pdev_data);
+static bool ranging_pins_missing(struct device_data* pdev_data);
+static bool client_wants_cycle(struct device_data* pdev_data,struct ranging_client* client,ktime_t now);
+static void wake_up_clients(struct device_data* pdev_data);
+static void wake_up_client(struct ranging_client* client,bool budget);
+static bool client_expects_more(struct ranging_client* client);
+static enum hrtimer_restart client_wake_timer_func(struct hrtimer* timer);
+static void release_external_trigger(struct device_data* pdev_data);
+static int acquire_ranging_gpio(struct device_data* pdev_data,unsigned int trigger_gpio,const unsigned int* echo_gpio,unsigned int echo_count);
+static void release_ranging_irq(struct device_data* pdev_data);
+static void release_ranging_gpio(struct device_data* pdev_data);
+static void apply_filter(struct device_data* pdev_data,struct echo_channel* echo,struct ranging_sample* sample);
+static bool echo_line_high(struct device_data* pdev_data);
+static bool ranging_pins_changed(struct device_data* pdev_data, const struct hcsr04_config* config);
+static void capture_edge(struct device_data* pdev_data,u8 source,int level);
+#ifdef HCSR04_PROFILE
+static void profile_handler(struct device_data* pdev_data,struct hcsr04_handler_profile* profile,ktime_t start);
+#endif
 
 char   DEVICE_NAME[] = "hcsr04_driver";
 
@@ -101,13 +289,13 @@ char   DEVICE_NAME[] = "hcsr04_driver";
 /* Initialize the ranging device */
 int init_ranging_device(
       unsigned int trigger_gpio,
-      unsigned int echo_gpio,
+      const unsigned int* echo_gpio,
+      unsigned int echo_count,
       unsigned int usec_pulse_width,
       unsigned int usec_timeout,
-      bool blocking,
       void** pprivate_data){
    int retval = SUCCESS;
-   int temp_irq_num;
+   unsigned int i;
 
    struct device_data* pdev_data = (struct device_data*)(*pprivate_data);
 
@@ -119,7 +307,7 @@ int init_ranging_device(
    }
 
 
-   if ((pdev_data = kmalloc(sizeof(struct device_data),GFP_ATOMIC)) == NULL){
+   if ((pdev_data = kmalloc(sizeof(struct device_data),GFP_KERNEL)) == NULL){
       printk (KERN_ALERT "%s: Unable to allocate memory.\n", DEVICE_NAME);
       retval = -ENOMEM;
       goto exit_func;
@@ -127,23 +315,152 @@ int init_ranging_device(
 
    memset(pdev_data,0x00,sizeof(struct device_data));
 
-   pdev_data->blocking = blocking;
-
    spin_lock_init(&pdev_data->lock);
-   sema_init (&pdev_data->ready_sem,1);
 
    pdev_data->ctl_stat = CONTROLLER_NONE;
    pdev_data->evt_src_flags = 0;
 
    
    pdev_data->gpio.trigger_gpio = INVALID_GPIO_NUM;
-   pdev_data->gpio.echo_gpio    = INVALID_GPIO_NUM;
-   pdev_data->gpio.irq_num      = INVALID_IRQ_NUM;
    pdev_data->gpio.usec_pulse_width = usec_pulse_width;
    pdev_data->gpio.usec_timeout     = usec_timeout;
+   pdev_data->gpio.ext_trigger_gpio    = INVALID_EXT_GPIO_NUM;
+   pdev_data->gpio.ext_trigger_irq_num = INVALID_IRQ_NUM;
+
+   pdev_data->filter = HCSR04_FILTER_NONE;
+   pdev_data->pending.usec_pulse_width = usec_pulse_width;
+   pdev_data->pending.usec_timeout     = usec_timeout;
+   pdev_data->pending.filter           = HCSR04_FILTER_NONE;
+
+
+   for (i = 0; i < HCSR04_MAX_ECHOES; i++){
+      pdev_data->echo[i].pdev_data = pdev_data;
+      pdev_data->echo[i].gpio = INVALID_GPIO_NUM;
+      pdev_data->echo[i].irq_num = INVALID_IRQ_NUM;
+   }
+   pdev_data->echo_count = 0;
+   pdev_data->reconfiguring = false;
+   pdev_data->stopping = false;
+
+   pdev_data->last_trigger_time = ktime_set(0,0);
+   pdev_data->period = ktime_set(0,0);
+   pdev_data->cycle_source = CYCLE_SRC_USER;
+   pdev_data->request_time = ktime_set(0,0);
+
+   pdev_data->next_seq = 0;
+   pdev_data->health.state = HCSR04_HEALTH_OK;
+   pdev_data->backoff_until = ktime_set(0,0);
+   INIT_LIST_HEAD(&pdev_data->clients);
+   init_waitqueue_head(&pdev_data->edge_wq);
+   mutex_init(&pdev_data->schedule_lock);
+
+   pdev_data->edge_capture_users = 0;
+   pdev_data->cycle_capture = false;
+
+   hrtimer_init(&pdev_data->period_timer,CLOCK_MONOTONIC,HRTIMER_MODE_ABS);
+   pdev_data->period_timer.function = periodic_slot_timer_func;
+
+   tasklet_init (
+         &pdev_data->controller_tasklet,
+         async_controller_tasklet_func,
+         (unsigned long)pdev_data);
+
+   INIT_WORK(&pdev_data->controller_work,async_controller_work_func);
+   init_waitqueue_head(&pdev_data->controller_thread_wq);
+   mutex_init(&pdev_data->exec_lock);
+   pdev_data->controller_thread = NULL;
+   pdev_data->exec.context = HCSR04_EXEC_TASKLET;
+   pdev_data->exec.priority = 0;
+   pdev_data->dispatch_pending = false;
+
+   hrtimer_init(&pdev_data->operation_timer,CLOCK_MONOTONIC,HRTIMER_MODE_REL);
+   pdev_data->operation_timer.function = async_operation_timer_func;
+
+   *pprivate_data = pdev_data;
+
+   if ((retval = kfifo_alloc(&pdev_data->edges,EDGE_FIFO_SIZE,GFP_KERNEL)) != SUCCESS){
+      printk (KERN_ALERT "%s: Unable to allocate memory.\n", DEVICE_NAME);
+      goto exit_func;
+   }
+
+   retval = acquire_ranging_gpio(pdev_data,trigger_gpio,echo_gpio,echo_count);
+
+
+exit_func:
+   if (retval != SUCCESS ){
+      release_ranging_device(*pprivate_data);
+      *pprivate_data = NULL;
+   }
+
+   return retval;
+}
+
+/* releases (uninitialize) the ranging device */
+int release_ranging_device(void* private_data){
+
+   struct device_data* pdev_data = (struct device_data*)private_data;
+   unsigned long flags;
+
+   if (pdev_data == NULL){
+      printk (KERN_ALERT "%s: Device might have not yet been initialized! \n",DEVICE_NAME);
+      goto exit_func;
+   }
+
+   /* stop the trigger sources first so that no new cycle gets started */
+   hw_timer_cancel(&pdev_data->period_timer);
+   release_external_trigger(pdev_data);
+
+   /* uninstall the interrupts, then stop the controller, a run already
+    * dispatched neither arms the timer nor dispatches another one */
+   release_ranging_irq(pdev_data);
+
+   local_irq_save(flags);
+   spin_lock(&pdev_data->lock);
+
+   pdev_data->stopping = true;
+
+   spin_unlock(&pdev_data->lock);
+   local_irq_restore(flags);
+
+   hw_timer_cancel (&pdev_data->operation_timer);
+   tasklet_kill (&pdev_data->controller_tasklet);
+   cancel_work_sync (&pdev_data->controller_work);
+
+   if (pdev_data->controller_thread != NULL){
+      kthread_stop (pdev_data->controller_thread);
+   }
+
+   /* nothing drives the pins any more, a pulse cut short is ended */
+   if (pdev_data->gpio.trigger_gpio != INVALID_GPIO_NUM){
+      hw_gpio_set(pdev_data->gpio.trigger_gpio,0);
+   }
+   release_ranging_gpio(pdev_data);
+
+   kfifo_free (&pdev_data->edges);
+
+   kfree (pdev_data);
+   pdev_data = NULL;
+
+   printk (KERN_INFO "%s: Device released.\n",DEVICE_NAME);
+
+exit_func:
+
+   return SUCCESS;
+}
 
+/* requests the trigger gpio and the echo gpios along with their interrupts,
+ * nothing is kept on failure */
+static int acquire_ranging_gpio(struct device_data* pdev_data,unsigned int trigger_gpio,const unsigned int* echo_gpio,unsigned int echo_count){
+   int retval = SUCCESS;
+   int temp_irq_num;
+   unsigned int i;
+   struct echo_channel* echo;
 
-   memset(&pdev_data->range,0x00,sizeof(pdev_data->range));
+   if (echo_count == 0 || echo_count > HCSR04_MAX_ECHOES){
+      printk (KERN_ALERT "%s: Invalid number of echo gpios %u.\n",DEVICE_NAME,echo_count);
+      retval = -EINVAL;
+      goto exit_func;
+   }
 
    if ((retval = gpio_request_one(
          trigger_gpio,
@@ -159,337 +476,1719 @@ int init_ranging_device(
 
    pdev_data->gpio.trigger_gpio = trigger_gpio;
 
+   for (i = 0; i < echo_count; i++){
+      echo = &pdev_data->echo[i];
 
-   if ((retval = gpio_request_one(
-         echo_gpio,
-         GPIOF_IN, 
-         "hcsr04 echo gpio")) != SUCCESS){
+      if ((retval = gpio_request_one(
+            echo_gpio[i],
+            GPIOF_IN, 
+            "hcsr04 echo gpio")) != SUCCESS){
 
-      printk (KERN_ALERT "%s: Failed to request echo  gpio %d.\n",DEVICE_NAME,echo_gpio);
+         printk (KERN_ALERT "%s: Failed to request echo  gpio %d.\n",DEVICE_NAME,echo_gpio[i]);
 
-      goto exit_func;
-   }
+         goto exit_func;
+      }
 
-   pdev_data->gpio.echo_gpio = echo_gpio;
+      echo->gpio = echo_gpio[i];
+      pdev_data->echo_count = i + 1;
 
-   temp_irq_num  = gpio_to_irq(echo_gpio);
+      temp_irq_num  = gpio_to_irq(echo_gpio[i]);
 
-   if ((retval = request_irq (
+      if ((retval = request_irq (
+                  temp_irq_num,
+                  irq_handler,
+                  IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING ,
+                  "hcsr04 gpio echo interrupt-handler",
+                  echo
+                  )) != SUCCESS){
+
+         printk (KERN_ALERT "%s: Failed to request irq handler for irq num  %d,  gpio %d.\n",
+               DEVICE_NAME,
                temp_irq_num,
-               irq_handler,
-               IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING ,
-               "hcsr04 gpio echo interrupt-handler",
-               pdev_data
-               )) != SUCCESS){
+               echo_gpio[i]);
 
-      printk (KERN_ALERT "%s: Failed to request irq handler for irq num  %d,  gpio %d.\n",
-            DEVICE_NAME,
-            temp_irq_num,
-            echo_gpio);
+         goto exit_func;
+      }
+      echo->irq_num = temp_irq_num;
+   }
 
-      goto exit_func;
+exit_func:
+   if (retval != SUCCESS){
+      release_ranging_gpio(pdev_data);
    }
-   pdev_data->gpio.irq_num = temp_irq_num;
 
+   return retval;
+}
 
-   tasklet_init (
-         &pdev_data->controller_tasklet,
-         async_controller_tasklet_func,
-         (unsigned long)pdev_data);
+/* the echo interrupts, the pins are kept */
+static void release_ranging_irq(struct device_data* pdev_data){
+   unsigned int i;
+   struct echo_channel* echo;
 
-   setup_timer (
-         &pdev_data->operation_timer,
-         async_operation_timer_func,
-         (unsigned long)pdev_data);
+   for (i = 0; i < pdev_data->echo_count; i++){
+      echo = &pdev_data->echo[i];
 
+      if (echo->irq_num != INVALID_IRQ_NUM){
+         free_irq(echo->irq_num,echo);
+         echo->irq_num = INVALID_IRQ_NUM;
+      }
+   }
+}
 
-   pdev_data->gpio.irq_num = temp_irq_num;
+/* the interrupts first, then the pins */
+static void release_ranging_gpio(struct device_data* pdev_data){
+   unsigned int i;
+   struct echo_channel* echo;
 
-   *pprivate_data = pdev_data;
+   release_ranging_irq(pdev_data);
 
+   for (i = 0; i < pdev_data->echo_count; i++){
+      echo = &pdev_data->echo[i];
 
-exit_func:
-   if (retval != SUCCESS ){
-      release_ranging_device(*pprivate_data);
-      *pprivate_data = NULL;
+      if ( echo->gpio != INVALID_GPIO_NUM ){
+         gpio_free (echo->gpio);
+         echo->gpio = INVALID_GPIO_NUM;
+      }
    }
+   pdev_data->echo_count = 0;
 
-   return retval;
+   if ( pdev_data->gpio.trigger_gpio != INVALID_GPIO_NUM ){
+      gpio_free (pdev_data->gpio.trigger_gpio);
+      pdev_data->gpio.trigger_gpio = INVALID_GPIO_NUM;
+   }
 }
 
-/* releases (uninitialize) the ranging device */
-int release_ranging_device(void* private_data){
+/* true when the pins of the config differ from the ones in use */
+static bool ranging_pins_changed(struct device_data* pdev_data, const struct hcsr04_config* config){
+   unsigned int i;
 
-   struct device_data* pdev_data = (struct device_data*)private_data;
+   if (config->trigger_gpio != pdev_data->gpio.trigger_gpio ||
+         config->echo_count != pdev_data->echo_count){
+      return true;
+   }
+
+   for (i = 0; i < pdev_data->echo_count; i++){
+      if (config->echo_gpio[i] != pdev_data->echo[i].gpio){
+         return true;
+      }
+   }
+
+   return false;
+}
+
+int check_ranging_config(const struct hcsr04_config* config){
+   if (config->usec_pulse_width == 0 ||
+         config->usec_timeout == 0 ||
+         config->echo_count == 0 ||
+         config->echo_count > HCSR04_MAX_ECHOES ||
+         config->filter > HCSR04_FILTER_MEDIAN3){
+
+      printk (KERN_ALERT "%s: Invalid device configuration!\n",DEVICE_NAME);
+      return -EINVAL;
+   }
+
+   return SUCCESS;
+}
+
+/* Applies a new configuration. The pulse width, timeout and filter take
+ * effect from the next cycle, the cycle in progress is left untouched.
+ * The pins can only be changed while the device is idle */
+int set_ranging_config(void* private_data, const struct hcsr04_config* config){
+   int retval = SUCCESS;
    unsigned long flags;
+   unsigned int i;
+   unsigned int old_trigger_gpio;
+   unsigned int old_echo_gpio[HCSR04_MAX_ECHOES];
+   unsigned int old_echo_count;
+   struct device_data* pdev_data = (struct device_data*)private_data;
 
-   if (pdev_data == NULL){
-      printk (KERN_ALERT "%s: Device might have not yet been initialized! \n",DEVICE_NAME);
+   if (!pdev_data){
+      retval = -ENOMEM;
+      printk (KERN_ALERT "%s: Invalid device data!\n",DEVICE_NAME);
       goto exit_func;
    }
 
-   spin_lock(&pdev_data->lock);
-   local_irq_save(flags);
+   if ((retval = check_ranging_config(config)) != SUCCESS){
+      goto exit_func;
+   }
+
+   if (ranging_pins_changed(pdev_data,config)){
+
+      local_irq_save(flags);
+      spin_lock(&pdev_data->lock);
+
+      if (pdev_data->ctl_stat != CONTROLLER_NONE || sample_queue_active(pdev_data)){
+         retval = -EBUSY;
+      }
+      else{
+         /* keeps the new cycles out until the pins are usable again */
+         pdev_data->reconfiguring = true;
+      }
+
+      spin_unlock(&pdev_data->lock);
+      local_irq_restore(flags);
+
+      if (retval != SUCCESS){
+         printk (KERN_ALERT "%s: The pins can only be changed while the device is idle!\n",DEVICE_NAME);
+         goto exit_func;
+      }
+
+      old_trigger_gpio = pdev_data->gpio.trigger_gpio;
+      old_echo_count = pdev_data->echo_count;
+      for (i = 0; i < old_echo_count; i++){
+         old_echo_gpio[i] = pdev_data->echo[i].gpio;
+      }
+
+      release_ranging_gpio(pdev_data);
+
+      if ((retval = acquire_ranging_gpio(pdev_data,config->trigger_gpio,config->echo_gpio,config->echo_count)) != SUCCESS &&
+            /* stay on the previous pins */
+            acquire_ranging_gpio(pdev_data,old_trigger_gpio,old_echo_gpio,old_echo_count) != SUCCESS){
+
+         printk (KERN_ALERT "%s: Unable to restore the previous pins, the device is left without pins!\n",DEVICE_NAME);
+      }
+
+      local_irq_save(flags);
+      spin_lock(&pdev_data->lock);
+
+      pdev_data->reconfiguring = false;
+
+      /* the on demand requests made meanwhile */
+      serve_pending_clients(pdev_data);
 
-   /* uninstall the interrupts, kill any timers and tasklets */
-   if (pdev_data->gpio.irq_num != INVALID_IRQ_NUM){
-      free_irq(pdev_data->gpio.irq_num,pdev_data);
-      pdev_data->gpio.irq_num = INVALID_IRQ_NUM;
+      spin_unlock(&pdev_data->lock);
+      local_irq_restore(flags);
+
+      if (retval != SUCCESS){
+         goto exit_func;
+      }
    }
 
-   del_timer (&pdev_data->operation_timer);
-   tasklet_kill (&pdev_data->controller_tasklet);
+   local_irq_save(flags);
+   spin_lock(&pdev_data->lock);
+
+   pdev_data->pending.usec_pulse_width = config->usec_pulse_width;
+   pdev_data->pending.usec_timeout = config->usec_timeout;
+   pdev_data->pending.filter = config->filter;
 
-   local_irq_restore(flags);
    spin_unlock(&pdev_data->lock);
+   local_irq_restore(flags);
+
+exit_func:
+   return retval;
+}
 
+/* the configuration of the device, rate_hz is the merged rate of the
+ * clients and the format is left to the caller */
+int get_ranging_config(void* private_data, struct hcsr04_config* config){
+   unsigned long flags;
+   unsigned int i;
+   unsigned int usec_period;
+   struct device_data* pdev_data = (struct device_data*)private_data;
 
+   memset(config,0x00,sizeof(*config));
 
-   if ( pdev_data->gpio.echo_gpio != INVALID_GPIO_NUM ){
-      gpio_free (pdev_data->gpio.echo_gpio);
-      pdev_data->gpio.echo_gpio = INVALID_GPIO_NUM;
+   if (!pdev_data){
+      printk (KERN_ALERT "%s: Invalid device data!\n",DEVICE_NAME);
+      return -ENOMEM;
    }
 
-   if ( pdev_data->gpio.trigger_gpio != INVALID_GPIO_NUM ){
-      gpio_free (pdev_data->gpio.trigger_gpio);
-      pdev_data->gpio.trigger_gpio = INVALID_GPIO_NUM;
+   local_irq_save(flags);
+   spin_lock(&pdev_data->lock);
+
+   config->trigger_gpio = pdev_data->gpio.trigger_gpio;
+   config->echo_count = pdev_data->echo_count;
+   for (i = 0; i < pdev_data->echo_count; i++){
+      config->echo_gpio[i] = pdev_data->echo[i].gpio;
+   }
+   config->usec_pulse_width = pdev_data->pending.usec_pulse_width;
+   config->usec_timeout = pdev_data->pending.usec_timeout;
+   config->filter = pdev_data->pending.filter;
+   usec_period = (unsigned int)ktime_to_us(pdev_data->period);
+
+   spin_unlock(&pdev_data->lock);
+   local_irq_restore(flags);
+
+   config->rate_hz = (usec_period == 0 ? 0 : USEC_PER_SEC / usec_period);
+
+   return SUCCESS;
+}
+
+/* Opens a client of the device, every client has its own sample queue
+ * and a rate (usec_period) or zero for on demand sampling. The device
+ * is triggered on a merged schedule at the rate of the strictest client */
+int open_ranging_client(void* private_data, unsigned int usec_period, void** pclient){
+   int retval = SUCCESS;
+   unsigned long flags;
+   struct ranging_client* client = NULL;
+   struct device_data* pdev_data = (struct device_data*)private_data;
+
+   *pclient = NULL;
+
+   if (!pdev_data){
+      retval = -ENOMEM;
+      printk (KERN_ALERT "%s: Invalid device data!\n",DEVICE_NAME);
+      goto exit_func;
    }
 
+   if (usec_period != 0 && usec_period < HCSR04_MIN_CYCLE_USEC){
+      retval = -EINVAL;
+      printk (KERN_ALERT "%s: Sampling period %u us is below the minimum cycle time of %d us!\n",
+            DEVICE_NAME,
+            usec_period,
+            HCSR04_MIN_CYCLE_USEC);
+      goto exit_func;
+   }
 
-   /* make sure that the semaphore is back to 1 */
-   if (down_trylock (&pdev_data->ready_sem)){
-      up(&pdev_data->ready_sem);
+   if ((client = kmalloc(sizeof(struct ranging_client),GFP_KERNEL)) == NULL){
+      printk (KERN_ALERT "%s: Unable to allocate memory.\n", DEVICE_NAME);
+      retval = -ENOMEM;
+      goto exit_func;
    }
 
+   memset(client,0x00,sizeof(struct ranging_client));
 
-   kfree (pdev_data);
-   pdev_data = NULL;
+   client->pdev_data = pdev_data;
+   client->period = ns_to_ktime((u64)usec_period * NSEC_PER_USEC);
+   client->next_due = hw_clock();
+   client->pending = false;
+   INIT_KFIFO(client->samples);
+   init_waitqueue_head(&client->wq);
+   client->async_queue = NULL;
 
-   printk (KERN_INFO "%s: Device released.\n",DEVICE_NAME);
+   client->wake_batch = 1;
+   client->wake_budget = ktime_set(0,0);
+   client->wake_ready = false;
+   hrtimer_init(&client->wake_timer,CLOCK_MONOTONIC,HRTIMER_MODE_REL);
+   client->wake_timer.function = client_wake_timer_func;
 
-exit_func:
+   local_irq_save(flags);
+   spin_lock(&pdev_data->lock);
 
-   return SUCCESS;
+   list_add_tail(&client->node,&pdev_data->clients);
+
+   spin_unlock(&pdev_data->lock);
+   local_irq_restore(flags);
+
+   update_schedule(pdev_data);
+
+   *pclient = client;
+
+exit_func:
+   return retval;
 }
 
-int start_async_ranging(void* private_data){
-   int retval = SUCCESS;
-   unsigned long flags;
-   struct device_data* pdev_data = (struct device_data*)private_data;
+int close_ranging_client(void* client_data){
+   unsigned long flags;
+   struct ranging_client* client = (struct ranging_client*)client_data;
+   struct device_data* pdev_data;
+
+   if (client == NULL){
+      printk (KERN_ALERT "%s: Invalid client data!\n",DEVICE_NAME);
+      return -ENOMEM;
+   }
+
+   pdev_data = client->pdev_data;
+
+   local_irq_save(flags);
+   spin_lock(&pdev_data->lock);
+
+   list_del(&client->node);
+
+   spin_unlock(&pdev_data->lock);
+   local_irq_restore(flags);
+
+   hw_timer_cancel(&client->wake_timer);
+
+   /* the schedule may slow down without this client */
+   update_schedule(pdev_data);
+
+   kfree(client);
+
+   return SUCCESS;
+}
+
+/* Sets the wakeup moderation of the client, a batch of 1 wakes the
+ * reader for every cycle */
+int set_client_wakeup(void* client_data, const struct hcsr04_wakeup* wakeup){
+   unsigned long flags;
+   struct ranging_client* client = (struct ranging_client*)client_data;
+   struct device_data* pdev_data;
+
+   if (client == NULL){
+      printk (KERN_ALERT "%s: Invalid client data!\n",DEVICE_NAME);
+      return -ENOMEM;
+   }
+
+   /* a batch beyond the queue would never be reached */
+   if (wakeup->batch < 1 || wakeup->batch > SAMPLE_FIFO_SIZE){
+      return -EINVAL;
+   }
+
+   pdev_data = client->pdev_data;
+
+   local_irq_save(flags);
+   spin_lock(&pdev_data->lock);
+
+   client->wake_batch = wakeup->batch;
+   client->wake_budget = ns_to_ktime((u64)wakeup->usec_budget * NSEC_PER_USEC);
+
+   if (!client->wake_ready && kfifo_len(&client->samples) >= client->wake_batch){
+      wake_up_client(client,false);
+   }
+
+   spin_unlock(&pdev_data->lock);
+   local_irq_restore(flags);
+
+   return SUCCESS;
+}
+
+int get_client_wakeup_stats(void* client_data, struct hcsr04_wakeup_stats* stats){
+   unsigned long flags;
+   struct ranging_client* client = (struct ranging_client*)client_data;
+   struct device_data* pdev_data;
+
+   memset(stats,0x00,sizeof(*stats));
+
+   if (client == NULL){
+      printk (KERN_ALERT "%s: Invalid client data!\n",DEVICE_NAME);
+      return -ENOMEM;
+   }
+
+   pdev_data = client->pdev_data;
+
+   local_irq_save(flags);
+   spin_lock(&pdev_data->lock);
+
+   *stats = client->wakeup;
+   stats->batch = client->wake_batch;
+   stats->usec_budget = (u32)ktime_to_us(client->wake_budget);
+
+   spin_unlock(&pdev_data->lock);
+   local_irq_restore(flags);
+
+   return SUCCESS;
+}
+
+/* Requests an on demand sample for the client. The request is coalesced
+ * with the cycle in progress or with a periodic slot due before a new
+ * cycle could complete, otherwise a cycle is started */
+int start_async_ranging(void* client_data){
+   int retval;
+   unsigned long flags;
+   struct ranging_client* client = (struct ranging_client*)client_data;
+   struct device_data* pdev_data;
+
+   if (client == NULL){
+      printk (KERN_ALERT "%s: Invalid client data!\n",DEVICE_NAME);
+      return -ENOMEM;
+   }
+
+   pdev_data = client->pdev_data;
+
+   local_irq_save(flags);
+   spin_lock (&pdev_data->lock);
+
+   retval = request_client_sample(client);
+
+   spin_unlock (&pdev_data->lock);
+   local_irq_restore (flags);
+
+   return retval;
+}
+
+/* Requests an on demand sample unless the client already has one queued
+ * or requested, or gets its samples periodically anyway */
+int start_async_ranging_if_idle(void* client_data){
+   int retval = SUCCESS;
+   unsigned long flags;
+   struct ranging_client* client = (struct ranging_client*)client_data;
+   struct device_data* pdev_data;
+
+   if (client == NULL){
+      printk (KERN_ALERT "%s: Invalid client data!\n",DEVICE_NAME);
+      return -ENOMEM;
+   }
+
+   pdev_data = client->pdev_data;
+
+   local_irq_save(flags);
+   spin_lock (&pdev_data->lock);
+
+   if (kfifo_is_empty(&client->samples) && !client->pending &&
+         ktime_to_ns(client->period) == 0){
+      retval = request_client_sample(client);
+   }
+
+   spin_unlock (&pdev_data->lock);
+   local_irq_restore (flags);
+
+   return retval;
+}
+
+/* returns -ENODEV when the device has no pins to range with, a request
+ * made while the pins are being changed is served afterwards
+ * must be called with the lock held */
+static int request_client_sample(struct ranging_client* client){
+   struct device_data* pdev_data = client->pdev_data;
+
+   if (!pdev_data->reconfiguring && ranging_pins_missing(pdev_data)){
+      return -ENODEV;
+   }
+
+   client->pending = true;
+
+   if (pdev_data->ctl_stat == CONTROLLER_NONE && !pdev_data->reconfiguring &&
+         !(ktime_to_ns(pdev_data->period) != 0 &&
+            ktime_us_delta(hrtimer_get_expires(&pdev_data->period_timer),hw_clock()) <= HCSR04_MIN_CYCLE_USEC)){
+
+      pdev_data->cycle_source = CYCLE_SRC_USER;
+      pdev_data->ctl_stat = CONTROLLER_REQUESTED;
+      dispatch_controller(pdev_data);
+   }
+
+   return SUCCESS;
+}
+
+/* Starts a cycle for the on demand requests left waiting, e.g. for a
+ * periodic slot that is no longer coming. The requests are dropped when
+ * the device has no pins left
+ * must be called with the lock held */
+static void serve_pending_clients(struct device_data* pdev_data){
+   struct ranging_client* client;
+   bool pending = false;
+
+   if (pdev_data->reconfiguring || pdev_data->ctl_stat != CONTROLLER_NONE){
+      return;
+   }
+
+   list_for_each_entry(client,&pdev_data->clients,node){
+      if (client->pending){
+         pending = true;
+      }
+   }
+
+   if (!pending){
+      return;
+   }
+
+   if (ranging_pins_missing(pdev_data)){
+      list_for_each_entry(client,&pdev_data->clients,node){
+         client->pending = false;
+      }
+
+      /* let the blocked readers know that nothing is coming */
+      wake_up_clients(pdev_data);
+      return;
+   }
+
+   pdev_data->cycle_source = CYCLE_SRC_USER;
+   pdev_data->ctl_stat = CONTROLLER_REQUESTED;
+   dispatch_controller(pdev_data);
+}
+
+/* Changes the rate of the client (or to on demand with a zero usec_period)
+ * and merges it into the schedule of the device */
+int set_client_period(void* client_data, unsigned int usec_period){
+   unsigned long flags;
+   struct ranging_client* client = (struct ranging_client*)client_data;
+   struct device_data* pdev_data;
+
+   if (client == NULL){
+      printk (KERN_ALERT "%s: Invalid client data!\n",DEVICE_NAME);
+      return -ENOMEM;
+   }
+
+   if (usec_period != 0 && usec_period < HCSR04_MIN_CYCLE_USEC){
+      printk (KERN_ALERT "%s: Sampling period %u us is below the minimum cycle time of %d us!\n",
+            DEVICE_NAME,
+            usec_period,
+            HCSR04_MIN_CYCLE_USEC);
+      return -EINVAL;
+   }
+
+   pdev_data = client->pdev_data;
+
+   local_irq_save(flags);
+   spin_lock(&pdev_data->lock);
+
+   client->period = ns_to_ktime((u64)usec_period * NSEC_PER_USEC);
+   client->next_due = hw_clock();
+
+   spin_unlock(&pdev_data->lock);
+   local_irq_restore(flags);
+
+   update_schedule(pdev_data);
+
+   /* let the blocked reader know when there will be no more samples */
+   wake_up_interruptible(&client->wq);
+
+   return SUCCESS;
+}
+
+int get_client_period(void* client_data, unsigned int* usec_period){
+   unsigned long flags;
+   struct ranging_client* client = (struct ranging_client*)client_data;
+
+   *usec_period = 0;
+
+   if (client == NULL){
+      printk (KERN_ALERT "%s: Invalid client data!\n",DEVICE_NAME);
+      return -ENOMEM;
+   }
+
+   local_irq_save(flags);
+   spin_lock(&client->pdev_data->lock);
+
+   *usec_period = (unsigned int)ktime_to_us(client->period);
+
+   spin_unlock(&client->pdev_data->lock);
+   local_irq_restore(flags);
+
+   return SUCCESS;
+}
+
+/* Restarts the periodic slots at the period of the strictest client,
+ * the slots are stopped when every client samples on demand */
+static void update_schedule(struct device_data* pdev_data){
+   unsigned long flags;
+   ktime_t period = ktime_set(0,0);
+   struct ranging_client* client;
+
+   mutex_lock(&pdev_data->schedule_lock);
+
+   local_irq_save(flags);
+   spin_lock(&pdev_data->lock);
+
+   list_for_each_entry(client,&pdev_data->clients,node){
+      if (ktime_to_ns(client->period) != 0 &&
+            (ktime_to_ns(period) == 0 || ktime_compare(client->period,period) < 0)){
+         period = client->period;
+      }
+   }
+
+   spin_unlock(&pdev_data->lock);
+   local_irq_restore(flags);
+
+   if (ktime_compare(period,pdev_data->period) == 0){
+      goto exit_func;
+   }
+
+   /* stop the current schedule, waits for a running slot callback */
+   hw_timer_cancel(&pdev_data->period_timer);
+
+   local_irq_save(flags);
+   spin_lock(&pdev_data->lock);
+
+   pdev_data->period = period;
+
+   if (ktime_to_ns(period) == 0){
+      /* the on demand requests deferred to a slot that is not coming */
+      serve_pending_clients(pdev_data);
+   }
+
+   spin_unlock(&pdev_data->lock);
+   local_irq_restore(flags);
+
+   if (ktime_to_ns(period) != 0){
+      /* the first slot is due right away */
+      hw_timer_start(&pdev_data->period_timer,hw_clock(),HRTIMER_MODE_ABS);
+   }
+
+exit_func:
+   mutex_unlock(&pdev_data->schedule_lock);
+}
+
+/* Selects (or disables with a negative gpio) the GPIO whose edges
+ * start a ranging cycle, e.g. a camera frame strobe. It may sleep and
+ * is not reentrant, the caller serializes the calls */
+int set_external_trigger(void* private_data, int gpio, unsigned int edges){
+   int retval = SUCCESS;
+   int temp_irq_num;
+   unsigned long irq_flags = 0;
+   unsigned long flags;
+   struct device_data* pdev_data = (struct device_data*)private_data;
+
+   if (!pdev_data){
+      retval = -ENOMEM;
+      printk (KERN_ALERT "%s: Invalid device data!\n",DEVICE_NAME);
+      goto exit_func;
+   }
+
+   if (edges & HCSR04_EDGE_RISING){
+      irq_flags |= IRQF_TRIGGER_RISING;
+   }
+
+   if (edges & HCSR04_EDGE_FALLING){
+      irq_flags |= IRQF_TRIGGER_FALLING;
+   }
+
+   if (gpio >= 0 && irq_flags == 0){
+      retval = -EINVAL;
+      printk (KERN_ALERT "%s: No edge selected for the external trigger gpio %d!\n",DEVICE_NAME,gpio);
+      goto exit_func;
+   }
+
+   release_external_trigger(pdev_data);
+
+   if (gpio < 0){
+      goto exit_func;
+   }
+
+   if ((retval = gpio_request_one(
+         gpio,
+         GPIOF_IN,
+         "hcsr04 external trigger gpio")) != SUCCESS){
+
+      printk (KERN_ALERT "%s: Failed to request external trigger gpio %d.\n",DEVICE_NAME,gpio);
+      goto exit_func;
+   }
+
+   local_irq_save(flags);
+   spin_lock(&pdev_data->lock);
+
+   pdev_data->gpio.ext_trigger_gpio = gpio;
+
+   spin_unlock(&pdev_data->lock);
+   local_irq_restore(flags);
+
+   temp_irq_num = gpio_to_irq(gpio);
+
+   if ((retval = request_irq (
+               temp_irq_num,
+               ext_trigger_irq_handler,
+               irq_flags,
+               "hcsr04 gpio external trigger interrupt-handler",
+               pdev_data
+               )) != SUCCESS){
+
+      printk (KERN_ALERT "%s: Failed to request irq handler for irq num  %d,  gpio %d.\n",
+            DEVICE_NAME,
+            temp_irq_num,
+            gpio);
+
+      release_external_trigger(pdev_data);
+      goto exit_func;
+   }
+
+   local_irq_save(flags);
+   spin_lock(&pdev_data->lock);
+
+   pdev_data->gpio.ext_trigger_irq_num = temp_irq_num;
+
+   spin_unlock(&pdev_data->lock);
+   local_irq_restore(flags);
+
+exit_func:
+   return retval;
+}
+
+static void release_external_trigger(struct device_data* pdev_data){
+   unsigned long flags;
+
+   if (pdev_data->gpio.ext_trigger_irq_num != INVALID_IRQ_NUM){
+      free_irq(pdev_data->gpio.ext_trigger_irq_num,pdev_data);
+   }
+
+   if (pdev_data->gpio.ext_trigger_gpio != INVALID_EXT_GPIO_NUM){
+      gpio_free (pdev_data->gpio.ext_trigger_gpio);
+   }
+
+   local_irq_save(flags);
+   spin_lock(&pdev_data->lock);
+
+   pdev_data->gpio.ext_trigger_irq_num = INVALID_IRQ_NUM;
+   pdev_data->gpio.ext_trigger_gpio = INVALID_EXT_GPIO_NUM;
+
+   /* let the blocked readers know when there will be no more samples */
+   wake_up_clients(pdev_data);
+
+   spin_unlock(&pdev_data->lock);
+   local_irq_restore(flags);
+
+   wake_up_interruptible(&pdev_data->edge_wq);
+}
+
+/* Starts a ranging cycle on behalf of a trigger source other than the
+ * userspace application. May be called from any context, request_time
+ * is the time of the triggering event and is the reference of the
+ * reported trigger-to-pulse latency. Returns -EBUSY when a cycle is
+ * still in progress and -EAGAIN while an unhealthy device is backed off */
+int trigger_async_ranging(void* private_data, ktime_t request_time){
+   int retval = SUCCESS;
+   unsigned long flags;
+   struct device_data* pdev_data = (struct device_data*)private_data;
+
+   if (!pdev_data){
+      return -ENOMEM;
+   }
+
+   local_irq_save(flags);
+   spin_lock(&pdev_data->lock);
+
+   pdev_data->stats.ext_triggers++;
+
+   if ((retval = request_triggered_cycle(pdev_data,request_time,CYCLE_SRC_EXTERNAL)) == -EBUSY){
+      pdev_data->stats.missed_ext_triggers++;
+   }
+
+   spin_unlock(&pdev_data->lock);
+   local_irq_restore(flags);
+
+   return retval;
+}
+
+/* a sample is requested or about to be triggered for the client
+ * must be called with the lock held */
+static bool client_expects_more(struct ranging_client* client){
+   return client->pending ||
+      ktime_to_ns(client->period) != 0 ||
+      client->pdev_data->gpio.ext_trigger_gpio != INVALID_EXT_GPIO_NUM;
+}
+
+/* nothing is queued, requested or about to be triggered for the client
+ * must be called with the lock held */
+static bool sample_none_expected(struct ranging_client* client){
+   return kfifo_is_empty(&client->samples) && !client_expects_more(client);
+}
+
+/* the queued samples are handed out once the reader has been woken
+ * for them, or right away when no more are coming */
+static bool sample_ready(struct ranging_client* client){
+   return (!kfifo_is_empty(&client->samples) &&
+         (client->wake_ready || !client_expects_more(client))) ||
+      sample_none_expected(client);
+}
+
+int wait_ranging_sample(void* client_data, unsigned long timeout){
+   long remaining;
+   struct ranging_client* client = (struct ranging_client*)client_data;
+
+   if (!client){
+      printk (KERN_ALERT "%s: Invalid client data!\n",DEVICE_NAME);
+      return -ENOMEM;
+   }
+
+   if ((remaining = wait_event_interruptible_timeout(client->wq,sample_ready(client),timeout)) < 0){
+      return remaining;
+   }
+
+   return (remaining == 0 ? -ETIMEDOUT : SUCCESS);
+}
+
+/* Fetches the oldest unread sample of the client, returns -ENODATA when
+ * no ranging has been requested and -EAGAIN for a non-blocking call while
+ * the ranging is in progress. A blocking call leaves the queue alone until
+ * the reader is woken for it, see set_client_wakeup() */
+int read_ranging_sample(
+      void* client_data,
+      struct ranging_sample* sample,
+      bool blocking){
+
+   int retval = SUCCESS;
+   unsigned long flags;
+   bool none_expected;
+   struct ranging_client* client = (struct ranging_client*)client_data;
+   struct device_data* pdev_data;
+
+   memset(sample,0x00,sizeof(*sample));
+   sample->result_code = RRESULT_UNKNOWN;
+
+   if (!client){
+      retval = -ENOMEM;
+      printk (KERN_ALERT "%s: Invalid client data!\n",DEVICE_NAME);
+      goto exit_func;
+   }
+
+   pdev_data = client->pdev_data;
+
+   while (true){
+
+      local_irq_save(flags);
+      spin_lock(&pdev_data->lock);
+
+      if ((!blocking || sample_ready(client)) &&
+            kfifo_get(&client->samples,sample)){
+         none_expected = false;
+         retval = SUCCESS;
+
+         if (kfifo_is_empty(&client->samples)){
+            client->wake_ready = false;
+         }
+      }
+      else{
+         none_expected = sample_none_expected(client);
+         retval = -EAGAIN;
+      }
+
+      spin_unlock(&pdev_data->lock);
+      local_irq_restore(flags);
+
+      if (retval == SUCCESS){
+         break;
+      }
+
+      if (none_expected){
+         retval = -ENODATA;
+         break;
+      }
+
+      if (!blocking){
+         break;
+      }
+
+      if ((retval = wait_event_interruptible(
+                  client->wq,
+                  sample_ready(client))) != SUCCESS){
+         break;
+      }
+   }
+
+exit_func:
+   return retval;
+}
+
+/* poll() support, the client is readable once a sample is queued */
+unsigned int poll_ranging_sample(void* client_data, struct file* filp, poll_table* wait){
+   unsigned int mask = 0;
+   unsigned long flags;
+   struct ranging_client* client = (struct ranging_client*)client_data;
+
+   if (!client){
+      return POLLERR;
+   }
+
+   poll_wait(filp,&client->wq,wait);
+
+   local_irq_save(flags);
+   spin_lock(&client->pdev_data->lock);
+
+   if (!kfifo_is_empty(&client->samples) &&
+         (client->wake_ready || !client_expects_more(client))){
+      mask |= POLLIN | POLLRDNORM;
+   }
+
+   spin_unlock(&client->pdev_data->lock);
+   local_irq_restore(flags);
+
+   return mask;
+}
+
+/* fasync() support, SIGIO is sent once a sample is queued */
+int fasync_ranging_sample(void* client_data, int fd, struct file* filp, int on){
+   struct ranging_client* client = (struct ranging_client*)client_data;
+
+   if (!client){
+      return -ENOMEM;
+   }
+
+   return fasync_helper(fd,filp,on,&client->async_queue);
+}
+
+/* the published samples are also recorded to the history, NULL stops
+ * the recording */
+int set_ranging_history(void* private_data, void* history){
+   unsigned long flags;
+   struct device_data* pdev_data = (struct device_data*)private_data;
+
+   if (!pdev_data){
+      printk (KERN_ALERT "%s: Invalid device data!\n",DEVICE_NAME);
+      return -ENOMEM;
+   }
+
+   local_irq_save(flags);
+   spin_lock(&pdev_data->lock);
+
+   pdev_data->history = history;
+
+   spin_unlock(&pdev_data->lock);
+   local_irq_restore(flags);
+
+   return SUCCESS;
+}
+
+/* Switches the context the controller runs in. The contexts change
+ * hands under the lock, a run already requested from the old one is
+ * still served by it. The statistics restart with
+ * every call so that the contexts can be compared one after another */
+int set_execution_context(void* private_data, const struct hcsr04_exec* exec){
+   int retval = SUCCESS;
+   unsigned long flags;
+   struct device_data* pdev_data = (struct device_data*)private_data;
+   struct task_struct* thread = NULL;
+   struct sched_param param;
+
+   if (!pdev_data){
+      printk (KERN_ALERT "%s: Invalid device data!\n",DEVICE_NAME);
+      return -ENOMEM;
+   }
+
+   if (exec->context > HCSR04_EXEC_THREAD ||
+         (exec->context == HCSR04_EXEC_THREAD &&
+          (exec->priority < 1 || exec->priority > MAX_USER_RT_PRIO - 1))){
+      return -EINVAL;
+   }
+
+   mutex_lock(&pdev_data->exec_lock);
+
+   if (exec->context == HCSR04_EXEC_THREAD){
+
+      if ((thread = pdev_data->controller_thread) == NULL){
+         thread = kthread_run(async_controller_thread_func,pdev_data,"%s",DEVICE_NAME);
+
+         if (IS_ERR(thread)){
+            printk (KERN_ALERT "%s: Unable to start the controller thread\n",DEVICE_NAME);
+            retval = PTR_ERR(thread);
+            goto unlock_func;
+         }
+      }
+
+      param.sched_priority = exec->priority;
+      if ((retval = sched_setscheduler(thread,SCHED_FIFO,&param)) != SUCCESS){
+         printk (KERN_ALERT "%s: Unable to set the priority %u of the controller thread\n",DEVICE_NAME,exec->priority);
+
+         if (pdev_data->controller_thread == NULL){
+            kthread_stop(thread);
+         }
+         goto unlock_func;
+      }
+   }
+
+   local_irq_save(flags);
+   spin_lock(&pdev_data->lock);
+
+   pdev_data->exec.context = exec->context;
+   pdev_data->exec.priority = (exec->context == HCSR04_EXEC_THREAD ? exec->priority : 0);
+
+   /* the thread left behind is stopped below */
+   if (exec->context == HCSR04_EXEC_THREAD){
+      pdev_data->controller_thread = thread;
+   }
+
+   memset(&pdev_data->dispatch,0x00,sizeof(pdev_data->dispatch));
+
+   spin_unlock(&pdev_data->lock);
+   local_irq_restore(flags);
+
+   /* a run requested from the old context still takes place there,
+    * only the thread is torn down */
+   if (exec->context != HCSR04_EXEC_THREAD){
+      stop_controller_thread(pdev_data);
+   }
+
+unlock_func:
+   mutex_unlock(&pdev_data->exec_lock);
+
+   return retval;
+}
+
+int get_dispatch_stats(void* private_data, struct hcsr04_dispatch_stats* stats){
+   unsigned long flags;
+   struct device_data* pdev_data = (struct device_data*)private_data;
+
+   memset(stats,0x00,sizeof(*stats));
+
+   if (!pdev_data){
+      printk (KERN_ALERT "%s: Invalid device data!\n",DEVICE_NAME);
+      return -ENOMEM;
+   }
+
+   local_irq_save(flags);
+   spin_lock(&pdev_data->lock);
+
+   *stats = pdev_data->dispatch;
+   stats->context = pdev_data->exec.context;
+   stats->priority = pdev_data->exec.priority;
+
+   spin_unlock(&pdev_data->lock);
+   local_irq_restore(flags);
+
+   return SUCCESS;
+}
+
+/* stops the thread of HCSR04_EXEC_THREAD unless it is in use,
+ * must be called with the exec_lock held */
+static void stop_controller_thread(struct device_data* pdev_data){
+   unsigned long flags;
+   struct task_struct* thread;
+
+   local_irq_save(flags);
+   spin_lock(&pdev_data->lock);
+
+   thread = pdev_data->controller_thread;
+
+   if (pdev_data->exec.context == HCSR04_EXEC_THREAD){
+      thread = NULL;
+   }
+   else{
+      pdev_data->controller_thread = NULL;
+   }
+
+   spin_unlock(&pdev_data->lock);
+   local_irq_restore(flags);
+
+   /* the last kick of the thread is served before it stops */
+   if (thread != NULL){
+      kthread_stop(thread);
+   }
+}
+
+/* Turns the raw edge capture on for one more user, or off for one user
+ * less. The ring starts empty with the first user */
+int set_edge_capture(void* private_data, bool on){
+   unsigned long flags;
+   struct device_data* pdev_data = (struct device_data*)private_data;
+
+   if (!pdev_data){
+      printk (KERN_ALERT "%s: Invalid device data!\n",DEVICE_NAME);
+      return -ENOMEM;
+   }
+
+   local_irq_save(flags);
+   spin_lock(&pdev_data->lock);
+
+   if (on){
+      if (pdev_data->edge_capture_users++ == 0){
+         kfifo_reset(&pdev_data->edges);
+      }
+   }
+   else if (pdev_data->edge_capture_users > 0){
+      pdev_data->edge_capture_users--;
+   }
+
+   spin_unlock(&pdev_data->lock);
+   local_irq_restore(flags);
+
+   /* let the blocked readers know when there will be no more edges */
+   wake_up_interruptible(&pdev_data->edge_wq);
+
+   return SUCCESS;
+}
+
+/* no cycle is in progress or about to be triggered
+ * must be called with the lock held */
+static bool edge_none_expected(struct device_data* pdev_data){
+   return !sample_queue_active(pdev_data) && pdev_data->ctl_stat == CONTROLLER_NONE;
+}
+
+static bool edge_ready(struct device_data* pdev_data){
+   return !kfifo_is_empty(&pdev_data->edges) || edge_none_expected(pdev_data);
+}
+
+/* Fetches up to count captured edges, returns the number of edges, 
+ * -ENODATA when no ranging has been started and -EAGAIN for a non-blocking
+ * call while the ranging is in progress */
+int read_ranging_edges(
+      void* private_data,
+      struct hcsr04_edge* edges,
+      unsigned int count,
+      bool blocking){
+
+   int retval = SUCCESS;
+   unsigned long flags;
+   bool none_expected;
+   struct device_data* pdev_data = (struct device_data*)private_data;
+
+   if (!pdev_data){
+      retval = -ENOMEM;
+      printk (KERN_ALERT "%s: Invalid device data!\n",DEVICE_NAME);
+      goto exit_func;
+   }
+
+   while (true){
+
+      local_irq_save(flags);
+      spin_lock(&pdev_data->lock);
+
+      retval = kfifo_out(&pdev_data->edges,edges,count);
+      none_expected = (retval == 0 && edge_none_expected(pdev_data));
+
+      spin_unlock(&pdev_data->lock);
+      local_irq_restore(flags);
+
+      if (retval > 0){
+         break;
+      }
+
+      if (none_expected){
+         retval = -ENODATA;
+         break;
+      }
+
+      if (!blocking){
+         retval = -EAGAIN;
+         break;
+      }
+
+      if ((retval = wait_event_interruptible(
+                  pdev_data->edge_wq,
+                  edge_ready(pdev_data))) != SUCCESS){
+         break;
+      }
+   }
+
+exit_func:
+   return retval;
+}
+
+/* poll() support of the edge readers */
+unsigned int poll_ranging_edges(void* private_data, struct file* filp, poll_table* wait){
+   unsigned int mask = 0;
+   unsigned long flags;
+   struct device_data* pdev_data = (struct device_data*)private_data;
+
+   if (!pdev_data){
+      return POLLERR;
+   }
+
+   poll_wait(filp,&pdev_data->edge_wq,wait);
+
+   local_irq_save(flags);
+   spin_lock(&pdev_data->lock);
+
+   if (!kfifo_is_empty(&pdev_data->edges)){
+      mask |= POLLIN | POLLRDNORM;
+   }
+
+   spin_unlock(&pdev_data->lock);
+   local_irq_restore(flags);
+
+   return mask;
+}
+
+int get_ranging_health(void* private_data, struct hcsr04_health* health){
+   unsigned long flags;
+   struct device_data* pdev_data = (struct device_data*)private_data;
+
+   memset(health,0x00,sizeof(*health));
+
+   if (!pdev_data){
+      printk (KERN_ALERT "%s: Invalid device data!\n",DEVICE_NAME);
+      return -ENOMEM;
+   }
+
+   local_irq_save(flags);
+   spin_lock(&pdev_data->lock);
+
+   *health = pdev_data->health;
+
+   spin_unlock(&pdev_data->lock);
+   local_irq_restore(flags);
+
+   return SUCCESS;
+}
+
+int check_ranging_backoff(void* private_data){
+   int retval = SUCCESS;
+   unsigned long flags;
+   struct device_data* pdev_data = (struct device_data*)private_data;
+
+   if (!pdev_data){
+      printk (KERN_ALERT "%s: Invalid device data!\n",DEVICE_NAME);
+      return -ENOMEM;
+   }
+
+   local_irq_save(flags);
+   spin_lock(&pdev_data->lock);
+
+   if (ktime_compare(hw_clock(),pdev_data->backoff_until) < 0){
+      retval = -EBUSY;
+   }
+
+   spin_unlock(&pdev_data->lock);
+   local_irq_restore(flags);
+
+   return retval;
+}
+
+/* the handler timing, -ENOTTY unless built with HCSR04_PROFILE */
+int get_ranging_profile(void* private_data, struct hcsr04_profile* profile, bool reset){
+#ifdef HCSR04_PROFILE
+   unsigned long flags;
+   struct device_data* pdev_data = (struct device_data*)private_data;
+
+   memset(profile,0x00,sizeof(*profile));
+
+   if (!pdev_data){
+      printk (KERN_ALERT "%s: Invalid device data!\n",DEVICE_NAME);
+      return -ENOMEM;
+   }
+
+   local_irq_save(flags);
+   spin_lock(&pdev_data->lock);
+
+   *profile = pdev_data->profile;
+
+   if (reset){
+      memset(&pdev_data->profile,0x00,sizeof(pdev_data->profile));
+   }
+
+   spin_unlock(&pdev_data->lock);
+   local_irq_restore(flags);
+
+   return SUCCESS;
+#else
+   return -ENOTTY;
+#endif
+}
+
+int get_ranging_stats(void* private_data, struct hcsr04_stats* stats){
+   unsigned long flags;
+   struct device_data* pdev_data = (struct device_data*)private_data;
+
+   memset(stats,0x00,sizeof(*stats));
+
+   if (!pdev_data){
+      printk (KERN_ALERT "%s: Invalid device data!\n",DEVICE_NAME);
+      return -ENOMEM;
+   }
+
+   local_irq_save(flags);
+   spin_lock(&pdev_data->lock);
+
+   *stats = pdev_data->stats;
+
+   spin_unlock(&pdev_data->lock);
+   local_irq_restore(flags);
+
+   return SUCCESS;
+}
+
+/* usec to wait so that the next trigger respects the minimum cycle time
+ * and the back-off of an unhealthy device
+ * must be called with the lock held */
+static unsigned long next_trigger_delay(struct device_data* pdev_data){
+   ktime_t now = hw_clock();
+   s64 usec_delay = 0;
+   s64 usec_elapsed;
+
+   if (ktime_to_ns(pdev_data->last_trigger_time) != 0){
+      usec_elapsed = ktime_us_delta(now,pdev_data->last_trigger_time);
+
+      if (usec_elapsed < HCSR04_MIN_CYCLE_USEC){
+         usec_delay = HCSR04_MIN_CYCLE_USEC - usec_elapsed;
+      }
+   }
+
+   if (ktime_us_delta(pdev_data->backoff_until,now) > usec_delay){
+      usec_delay = ktime_us_delta(pdev_data->backoff_until,now);
+   }
+
+   return usec_delay;
+}
+
+/* starts a cycle if the controller is idle, the pins are not being
+ * changed and the device is not backed off, the periodic and external triggers arriving during the
+ * back-off are dropped rather than delayed
+ * must be called with the lock held */
+static int request_triggered_cycle(struct device_data* pdev_data,ktime_t request_time,cycle_source_t source){
+
+   if (pdev_data->ctl_stat != CONTROLLER_NONE || pdev_data->reconfiguring){
+      return -EBUSY;
+   }
+
+   if (ranging_pins_missing(pdev_data)){
+      return -ENODEV;
+   }
+
+   if (ktime_compare(hw_clock(),pdev_data->backoff_until) < 0){
+      pdev_data->health.backoff_skips++;
+      return -EAGAIN;
+   }
+
+   pdev_data->request_time = request_time;
+   pdev_data->cycle_source = source;
+   pdev_data->ctl_stat = CONTROLLER_REQUESTED;
+   dispatch_controller(pdev_data);
+
+   return SUCCESS;
+}
+
+/* tracks the consecutive failures of the device and backs off its triggers
+ * once it is considered failed, a single successful cycle recovers it
+ * must be called with the lock held */
+static void update_health(struct device_data* pdev_data,controller_status_t ctl_stat){
+   u32 usec_backoff;
+   unsigned int shift;
+
+   switch (ctl_stat){
+      case CONTROLLER_COMPLETED:
+         pdev_data->health.consecutive_failures = 0;
+         pdev_data->health.state = HCSR04_HEALTH_OK;
+         pdev_data->health.backoff_usec = 0;
+         pdev_data->backoff_until = ktime_set(0,0);
+         return;
+      case CONTROLLER_TIMEDOUT:
+         pdev_data->health.timeouts++;
+         break;
+      default:
+         if (pdev_data->evt_src_flags & EVENT_SRC_ECHO_STUCK){
+            pdev_data->health.stuck_echoes++;
+         }
+         else{
+            pdev_data->health.invalid_states++;
+         }
+         break;
+   }
+
+   pdev_data->health.consecutive_failures++;
+
+   if (pdev_data->health.consecutive_failures < HEALTH_FAILED_THRESHOLD){
+      pdev_data->health.state = HCSR04_HEALTH_DEGRADED;
+      return;
+   }
+
+   pdev_data->health.state = HCSR04_HEALTH_FAILED;
+
+   shift = pdev_data->health.consecutive_failures - HEALTH_FAILED_THRESHOLD;
+   usec_backoff = MAX_BACKOFF_USEC;
+
+   if (shift < 16 && (HCSR04_MIN_CYCLE_USEC << shift) < MAX_BACKOFF_USEC){
+      usec_backoff = HCSR04_MIN_CYCLE_USEC << shift;
+   }
+
+   pdev_data->health.backoff_usec = usec_backoff;
+   pdev_data->backoff_until = ktime_add_us(hw_clock(),usec_backoff);
+}
+
+/* accounts how far the trigger was sent from the time it was requested,
+ * for the periodic slots this is the slot jitter
+ * must be called with the lock held */
+static void update_trigger_latency(struct device_data* pdev_data){
+   s64 latency_ns = ktime_to_ns(ktime_sub(pdev_data->last_trigger_time,pdev_data->request_time));
+
+   if (latency_ns < 0){
+      latency_ns = -latency_ns;
+   }
+
+   switch (pdev_data->cycle_source){
+      case CYCLE_SRC_SLOT:
+         pdev_data->stats.jitter_sum_ns += latency_ns;
+
+         if (latency_ns > pdev_data->stats.jitter_max_ns){
+            pdev_data->stats.jitter_max_ns = latency_ns;
+         }
+         break;
+      case CYCLE_SRC_EXTERNAL:
+         pdev_data->stats.latency_sum_ns += latency_ns;
+
+         if (latency_ns > pdev_data->stats.latency_max_ns){
+            pdev_data->stats.latency_max_ns = latency_ns;
+         }
+         break;
+      default:
+         break;
+   }
+}
+
+#ifdef HCSR04_PROFILE
+/* accounts a handler run that began at start, the time spent waiting
+ * for the lock in here is not part of the measurement */
+static void profile_handler(struct device_data* pdev_data,struct hcsr04_handler_profile* profile,ktime_t start){
+   unsigned long flags;
+   u64 elapsed_ns = ktime_to_ns(ktime_sub(ktime_get(),start));
+
+   local_irq_save(flags);
+   spin_lock(&pdev_data->lock);
+
+   profile->count++;
+   profile->ns_sum += elapsed_ns;
+   if (elapsed_ns > profile->ns_max){
+      profile->ns_max = elapsed_ns;
+   }
+
+   spin_unlock(&pdev_data->lock);
+   local_irq_restore(flags);
+}
+#endif
+
+/* replaces the echo width of a successful sample with the median of the
+ * last three successful ones of the same echo, which drops the odd
+ * multi-path echo
+ * must be called with the lock held */
+static void apply_filter(struct device_data* pdev_data,struct echo_channel* echo,struct ranging_sample* sample){
+   u32 a, b, c, median;
+
+   if (pdev_data->filter != HCSR04_FILTER_MEDIAN3 || sample->result_code != RRESULT_SUCCESS){
+      return;
+   }
+
+   echo->filter_hist[0] = echo->filter_hist[1];
+   echo->filter_hist[1] = echo->filter_hist[2];
+   echo->filter_hist[2] = (u32)timespec_to_ns(&sample->delta_time);
+
+   if (echo->filter_count < 3 && ++echo->filter_count < 3){
+      return;
+   }
+
+   a = echo->filter_hist[0];
+   b = echo->filter_hist[1];
+   c = echo->filter_hist[2];
+
+   median = max(min(a,b),min(max(a,b),c));
+
+   sample->delta_time = ns_to_timespec(median);
+}
+
+/* hands the results of the cycle over to the clients, one sample per
+ * echo, and makes the controller available for the next one */
+static void publish_ranging_samples(struct device_data* pdev_data){
+   struct ranging_sample samples[HCSR04_MAX_ECHOES];
+   struct ranging_sample* sample;
+   struct echo_channel* echo;
+   struct ranging_client* client;
+   controller_status_t outcome;
+   unsigned long flags;
+   unsigned int i;
+   unsigned int count = 0;
+   void* history;
+   ktime_t trigger_time;
+   ktime_t now = hw_clock();
+
+   local_irq_save(flags);
+   spin_lock(&pdev_data->lock);
+
+   if (pdev_data->cycle_capture){
+      /* the edges are left uninterpreted, nothing to report but the
+       * end of the cycle to the edge readers, the on demand requests
+       * can not be served */
+      pdev_data->cycle_capture = false;
 
-   ranging_result_t result_code;
-   
-   if ((retval = read_async_ranging_result (
-               private_data,
-               &result_code,
-               NULL,
-               NULL,
-               NULL)) != SUCCESS){
-      printk (KERN_ALERT "%s: Failed to read async ranging result\n",DEVICE_NAME);
-      goto exit_func;
+      list_for_each_entry(client,&pdev_data->clients,node){
+         client->pending = false;
+      }
+      wake_up_clients(pdev_data);
+      goto done_func;
    }
 
+   /* the sensors are considered alive as long as any echo came back */
+   outcome = pdev_data->ctl_stat;
 
-   switch (result_code){
-      case RRESULT_NOT_STARTED:
-         // All is well so far
-         break;
-      case RRESULT_IN_PROGRESS:
-         retval = -EAGAIN;
-         goto exit_func;
-         break;
-      case RRESULT_SUCCESS:
-      case RRESULT_TIMEDOUT:
-      case RRESULT_UNKNOWN:
-      default:
-         /* invalid file descriptor state */
-         /* client must call reset_async_ranging() function to reset
-          * success,timed_out,unknown state */
-         retval = -EBADFD;
-         goto exit_func;
-         break;
+   if (outcome == CONTROLLER_TIMEDOUT){
+      for (i = 0; i < pdev_data->echo_count; i++){
+         if (pdev_data->echo[i].evt_src_flags & EVENT_SRC_INTERRUPT_FALL){
+            outcome = CONTROLLER_COMPLETED;
+         }
+      }
    }
 
-   local_irq_save(flags);
-   spin_lock (&pdev_data->lock);
-
-   pdev_data->ctl_stat = CONTROLLER_REQUESTED;
-   tasklet_schedule (&pdev_data->controller_tasklet);
+   update_health(pdev_data,outcome);
 
-   spin_unlock (&pdev_data->lock);
-   local_irq_restore (flags);
+   /* a cycle aborted before its trigger pulse, e.g. for a stuck echo,
+    * is stamped with the abort time rather than the previous trigger */
+   trigger_time = (pdev_data->evt_src_flags & EVENT_SRC_TRG_HI) ? pdev_data->last_trigger_time : now;
 
-   /* ensure that we have acquire the semaphore once 
-    * the async ranging has already started*/
-   if (down_trylock(&pdev_data->ready_sem)){
-      retval = -EBADFD;
-      printk (KERN_ALERT "%s: Failed acquire the semaphore lock\n",DEVICE_NAME);
-      goto exit_func;
-   }
-   
+   for (i = 0; i < pdev_data->echo_count; i++){
+      echo = &pdev_data->echo[i];
+      sample = &samples[i];
 
-exit_func:
-   return retval;
-}
+      memset(sample,0x00,sizeof(*sample));
 
-int reset_async_ranging(void* private_data){
-   int retval = SUCCESS;
-   ranging_result_t result_code;
-   unsigned long flags;
-   struct device_data* pdev_data = (struct device_data*)private_data;
+      sample->seq = pdev_data->next_seq;
+      sample->trigger_time = trigger_time;
+      sample->health = pdev_data->health.state;
+      sample->channel = i;
+      sample->channels = pdev_data->echo_count;
 
-   
-   if ((retval = read_async_ranging_result (
-               private_data,
-               &result_code,
-               NULL,
-               NULL,
-               NULL)) != SUCCESS){
-      printk (KERN_ALERT "%s: Failed to read async ranging result\n",DEVICE_NAME);
-      goto exit_func;
-   }
+      if ((pdev_data->ctl_stat == CONTROLLER_COMPLETED || pdev_data->ctl_stat == CONTROLLER_TIMEDOUT) &&
+            (echo->evt_src_flags & EVENT_SRC_INTERRUPT_FALL)){
 
+         /* end_time is populated by the IRQ handler to have better precision
+          * hence we can only calculate the delta in here */
+         sample->result_code = RRESULT_SUCCESS;
+         sample->start_time = echo->range.start_time;
+         sample->end_time = echo->range.end_time;
+         sample->delta_time = timespec_sub(echo->range.end_time,echo->range.start_time);
 
-   switch (result_code){
-      case RRESULT_SUCCESS:
-      case RRESULT_TIMEDOUT:
-      case RRESULT_UNKNOWN:
-      case RRESULT_NOT_STARTED:
-        break;
-      case RRESULT_IN_PROGRESS:
-         retval = -EAGAIN;
-         goto exit_func;
-         break;
-      default:
-         /* invalid file descriptor state */
-         /* client must call reset_async_ranging() function to reset
-         * success,timed_out,unknown state */
-         retval = -EBADFD;
-         goto exit_func;
-         break;
+         apply_filter(pdev_data,echo,sample);
+      }
+      else if (pdev_data->ctl_stat == CONTROLLER_TIMEDOUT){
+         sample->result_code = RRESULT_TIMEDOUT;
+      }
+      else{
+         sample->result_code = RRESULT_UNKNOWN;
+      }
    }
 
-   local_irq_save(flags);
-   spin_lock (&pdev_data->lock);
+   count = pdev_data->echo_count;
 
-   pdev_data->ctl_stat = CONTROLLER_NONE;
+   /* every client only gets the cycles at its own rate */
+   list_for_each_entry(client,&pdev_data->clients,node){
 
-   spin_unlock (&pdev_data->lock);
-   local_irq_restore (flags);
+      if (!client_wants_cycle(pdev_data,client,now)){
+         continue;
+      }
 
-exit_func:
-   return retval;
-}
+      for (i = 0; i < pdev_data->echo_count; i++){
+         if (kfifo_is_full(&client->samples)){
+            /* the reader is lagging behind, keep the freshest samples */
+            kfifo_skip(&client->samples);
+            pdev_data->stats.dropped_samples++;
+         }
 
-int read_async_ranging_result(
-      void* private_data,
-      ranging_result_t* result_code,
-      struct timespec* start_time,
-      struct timespec* end_time,
-      struct timespec* delta_time){
+         kfifo_put(&client->samples,samples[i]);
+      }
 
-   int retval = SUCCESS; 
-   unsigned long flags;
-   struct device_data* pdev_data = (struct device_data*)private_data;
+      client->wakeup.samples += pdev_data->echo_count;
 
-   /* initialize the output parameters */
-   *result_code = RRESULT_UNKNOWN;
-   if (start_time){
-      memset(start_time,0x00,sizeof(*start_time));
+      if (kfifo_len(&client->samples) >= client->wake_batch || !client_expects_more(client)){
+         wake_up_client(client,false);
+      }
+      else if (ktime_to_ns(client->wake_budget) != 0 && !hrtimer_active(&client->wake_timer)){
+         /* the budget runs from the oldest sample the reader is not woken for */
+         hw_timer_start(&client->wake_timer,client->wake_budget,HRTIMER_MODE_REL);
+      }
    }
 
-   if (end_time){
-      memset(end_time,0x00,sizeof(*end_time));
+done_func:
+   pdev_data->next_seq++;
+   pdev_data->ctl_stat = CONTROLLER_NONE;
+   pdev_data->cycle_source = CYCLE_SRC_USER;
+   history = pdev_data->history;
+
+   spin_unlock(&pdev_data->lock);
+   local_irq_restore(flags);
+
+   /* the history has a lock of its own, kept out of the device lock */
+   for (i = 0; i < count; i++){
+      append_ranging_history(history,&samples[i]);
    }
 
-   if (delta_time){
-      memset(delta_time,0x00,sizeof(*delta_time));
+   wake_up_interruptible(&pdev_data->edge_wq);
+}
+
+/* Decides whether the cycle that just completed is delivered to the client:
+ * the on demand requests and the external triggers are always served, the
+ * periodic clients are served once their next sample is due, give or take
+ * half a slot of the merged schedule
+ * must be called with the lock held */
+static bool client_wants_cycle(struct device_data* pdev_data,struct ranging_client* client,ktime_t now){
+   bool deliver = false;
+   ktime_t slack = ns_to_ktime(ktime_to_ns(pdev_data->period) / 2);
+
+   if (client->pending){
+      client->pending = false;
+      deliver = true;
    }
 
-   if (!pdev_data){
-      retval = -ENOMEM;
-      printk (KERN_ALERT "%s: Invalid device data!\n",DEVICE_NAME);
-      goto exit_func;
+   if (ktime_to_ns(client->period) == 0){
+      return deliver || pdev_data->cycle_source == CYCLE_SRC_EXTERNAL;
    }
 
-   if ( pdev_data->blocking ){
-      if ((retval = down_interruptible(&pdev_data->ready_sem)) != SUCCESS){
+   if (ktime_compare(ktime_add(now,slack),client->next_due) >= 0){
+      deliver = true;
+      client->next_due = ktime_add(client->next_due,client->period);
 
-         *result_code = RRESULT_IN_PROGRESS;
-         printk (KERN_ALERT "%s: Blocking wait for semaphore lock failed!\n",DEVICE_NAME);
-         goto exit_func;
+      if (ktime_compare(client->next_due,now) <= 0){
+         /* the schedule could not keep up, restart from now */
+         client->next_due = ktime_add(now,client->period);
       }
    }
-   else{
 
-      if ( down_trylock(&pdev_data->ready_sem )){
-         retval = -EAGAIN;
-         *result_code = RRESULT_IN_PROGRESS;
-         goto exit_func;
-      }
+   return deliver;
+}
+
+/* wakes the reader for its queued samples, by the budget timer or else
+ * by the batch size
+ * must be called with the lock held */
+static void wake_up_client(struct ranging_client* client,bool budget){
+
+   client->wake_ready = true;
+   client->wakeup.wakeups++;
+
+   if (budget){
+      client->wakeup.budget_wakeups++;
+   }
+   else{
+      client->wakeup.batch_wakeups++;
+      hw_timer_try_to_cancel(&client->wake_timer);
    }
 
+   wake_up_interruptible(&client->wq);
+   kill_fasync(&client->async_queue,SIGIO,POLL_IN);
+}
 
-   up(&pdev_data->ready_sem);
+/* the latency budget of the queued samples has run out */
+static enum hrtimer_restart client_wake_timer_func(struct hrtimer* timer){
+   struct ranging_client* client = container_of(timer,struct ranging_client,wake_timer);
+   struct device_data* pdev_data = client->pdev_data;
+   unsigned long flags;
 
    local_irq_save(flags);
    spin_lock(&pdev_data->lock);
 
-   switch(pdev_data->ctl_stat){
-      case CONTROLLER_NONE: 
-         *result_code = RRESULT_NOT_STARTED;
-         break;
-      case CONTROLLER_REQUESTED:
-      case CONTROLLER_TRIGGER_HI:
-      case CONTROLLER_TRIGGER_LO:
-      case CONTROLLER_TRIGGERED:
-         *result_code = RRESULT_IN_PROGRESS;
-         break;
-      case CONTROLLER_COMPLETED:
-         *result_code = RRESULT_SUCCESS;
-         if (start_time){
-            *start_time = pdev_data->range.start_time;
-         }
+   if (!kfifo_is_empty(&client->samples) && !client->wake_ready){
+      wake_up_client(client,true);
+   }
 
-         if (end_time){
-            *end_time = pdev_data->range.end_time;
-         }
+   spin_unlock(&pdev_data->lock);
+   local_irq_restore(flags);
 
-         if (delta_time){
-            *delta_time = pdev_data->range.delta_time;
-         }
+   return HRTIMER_NORESTART;
+}
 
-        break;
-      case CONTROLLER_TIMEDOUT:
-        *result_code = RRESULT_TIMEDOUT;
-        break;
-      case CONTROLLER_INVALID:
-      default:
-         *result_code = RRESULT_UNKNOWN;
-         break;
+/* wakes up the readers of every client, e.g. when no more samples will come
+ * must be called with the lock held */
+static void wake_up_clients(struct device_data* pdev_data){
+   struct ranging_client* client;
+
+   list_for_each_entry(client,&pdev_data->clients,node){
+      wake_up_interruptible(&client->wq);
    }
+}
 
+/* appends a raw edge to the capture ring, the newest edges are the ones
+ * dropped once the reader falls behind
+ * must be called with the lock held */
+static void capture_edge(struct device_data* pdev_data,u8 source,int level){
+   struct hcsr04_edge edge;
 
-   spin_unlock(&pdev_data->lock);
-   local_irq_restore(flags);
+   if (pdev_data->edge_capture_users == 0){
+      return;
+   }
 
-exit_func:
-      
-   return retval;
+   edge.timestamp_ns = ktime_to_ns(hw_clock());
+   edge.seq = pdev_data->next_seq;
+   edge.source = source;
+   edge.level = (level ? 1 : 0);
+   edge.reserved = 0;
+
+   if (!kfifo_put(&pdev_data->edges,edge)){
+      pdev_data->stats.dropped_edges++;
+   }
 }
 
+/* true when any echo line is still high, e.g. a hung or miswired sensor */
+static bool echo_line_high(struct device_data* pdev_data){
+   unsigned int i;
 
+   for (i = 0; i < pdev_data->echo_count; i++){
+      if (hw_gpio_get(pdev_data->echo[i].gpio)){
+         return true;
+      }
+   }
 
-/* The asynchronous controller function */
-static void async_controller_tasklet_func(unsigned long arg){
+   return false;
+}
 
-   struct device_data* pdev_data = (struct device_data*)arg;
-   unsigned long flags;
 
-   local_irq_save(flags);
+/* The asynchronous controller function, runs in the execution context
+ * of the device, must be called with the lock held */
+static void run_controller(struct device_data* pdev_data){
 
-   spin_lock(&pdev_data->lock);
+   unsigned int i;
+   u64 latency_ns;
+
+   if (pdev_data->dispatch_pending){
+      latency_ns = ktime_to_ns(ktime_sub(hw_clock(),pdev_data->dispatch_time));
 
+      pdev_data->dispatch_pending = false;
+      pdev_data->dispatch.dispatches++;
+      pdev_data->dispatch.latency_ns_sum += latency_ns;
+      if (latency_ns > pdev_data->dispatch.latency_ns_max){
+         pdev_data->dispatch.latency_ns_max = latency_ns;
+      }
+   }
 
    switch (pdev_data->ctl_stat){
     case CONTROLLER_REQUESTED:
@@ -497,14 +2196,32 @@ static void async_controller_tasklet_func(unsigned long arg){
        /* init the event source and set the controller stat to the
         * next state */
       pdev_data->evt_src_flags = 0;
+      pdev_data->cycle_capture = (pdev_data->edge_capture_users != 0);
+
+      for (i = 0; i < pdev_data->echo_count; i++){
+         pdev_data->echo[i].evt_src_flags = 0;
+         memset(&pdev_data->echo[i].range,0x00,sizeof(pdev_data->echo[i].range));
+      }
+
+      /* the configuration changes are picked up between the cycles only */
+      pdev_data->gpio.usec_pulse_width = pdev_data->pending.usec_pulse_width;
+      pdev_data->gpio.usec_timeout = pdev_data->pending.usec_timeout;
+
+      if (pdev_data->filter != pdev_data->pending.filter){
+         pdev_data->filter = pdev_data->pending.filter;
 
-      memset(&pdev_data->range,0x00,sizeof(pdev_data->range));
+         for (i = 0; i < pdev_data->echo_count; i++){
+            pdev_data->echo[i].filter_count = 0;
+         }
+      }
 
 
       pdev_data->ctl_stat = CONTROLLER_TRIGGER_HI;
       /* dispatch to the async timer the soonest for excution 
-       * we need to send a trigger_gpio hi */
-      mod_timer(&pdev_data->operation_timer,jiffies );
+       * we need to send a trigger_gpio hi, but never sooner than
+       * the minimum cycle time after the previous trigger nor
+       * while an unhealthy device is backed off */
+      start_operation_timer(pdev_data,next_trigger_delay(pdev_data));
 
      break;
 
@@ -515,12 +2232,12 @@ static void async_controller_tasklet_func(unsigned long arg){
          /* we need to send trigger_gpio lo 10us after the trigger_gpio hi
           * thus a 10us pulse, pdev_data->gpio.usec_pulse_width is typically 10us configurable */
          pdev_data->ctl_stat = CONTROLLER_TRIGGER_LO;
-         mod_timer(&pdev_data->operation_timer,jiffies + usecs_to_jiffies (pdev_data->gpio.usec_pulse_width));
+         start_operation_timer(pdev_data,pdev_data->gpio.usec_pulse_width);
       }
       else{
          /* unexpected state */
          pdev_data->ctl_stat = CONTROLLER_INVALID;
-         mod_timer(&pdev_data->operation_timer,jiffies);
+         start_operation_timer(pdev_data,0);
       }
 
       break;
@@ -533,12 +2250,12 @@ static void async_controller_tasklet_func(unsigned long arg){
           * the reflected waves (echo_gpio)
           */
          pdev_data->ctl_stat = CONTROLLER_TRIGGERED;
-         mod_timer(&pdev_data->operation_timer,jiffies + usecs_to_jiffies (pdev_data->gpio.usec_timeout));
+         start_operation_timer(pdev_data,pdev_data->gpio.usec_timeout);
       }
       else{
          /* invalid state again */
          pdev_data->ctl_stat = CONTROLLER_INVALID;
-         mod_timer(&pdev_data->operation_timer,jiffies);
+         start_operation_timer(pdev_data,0);
      }
 
       break;
@@ -547,31 +2264,31 @@ static void async_controller_tasklet_func(unsigned long arg){
       if (pdev_data->evt_src_flags & EVENT_SRC_TIMEOUT){
          /* The timeout watcher has kicked off */
          pdev_data->ctl_stat = CONTROLLER_TIMEDOUT;
-         mod_timer(&pdev_data->operation_timer,jiffies);
+         start_operation_timer(pdev_data,0);
       }
       else if (pdev_data->evt_src_flags & EVENT_SRC_INTERRUPT_RISE ){
-         /* deactivate the async timer (e.g. timeout watcher)*/
-         del_timer ( &pdev_data->operation_timer );
 
+         /* the timeout watcher keeps running until every echo is back */
          if (pdev_data->evt_src_flags & EVENT_SRC_INTERRUPT_FALL ){
             
-            /* our system has received the echo_gpio thru hardware interrupt */
+            /* deactivate the async timer (e.g. timeout watcher), a
+             * callback already running waits for the lock and finds
+             * the cycle completed */
+            hw_timer_try_to_cancel ( &pdev_data->operation_timer );
+
+            /* our system has received the echo_gpio thru hardware interrupt
+             * the deltas of the echoes are calculated when publishing */
             pdev_data->ctl_stat = CONTROLLER_COMPLETED;
-            /* end_time will be populated by the IRQ handler to have better precision
-             * hence we can only calculate the delta in here
-             */
-            pdev_data->range.delta_time = 
-               timespec_sub(pdev_data->range.end_time,pdev_data->range.start_time);
 
             /* trigger the timer to finalize the result */
-            mod_timer(&pdev_data->operation_timer,jiffies);
+            start_operation_timer(pdev_data,0);
          }
 
       }
       else{
          /* invalid state */
          pdev_data->ctl_stat = CONTROLLER_INVALID;
-         mod_timer(&pdev_data->operation_timer,jiffies);
+         start_operation_timer(pdev_data,0);
       }
 
       break;
@@ -579,29 +2296,151 @@ static void async_controller_tasklet_func(unsigned long arg){
     default:
       /* invalid state */
       pdev_data->ctl_stat = CONTROLLER_INVALID;
-      mod_timer(&pdev_data->operation_timer,jiffies);
+      start_operation_timer(pdev_data,0);
 
       break;
    }
+}
+
+/* Requests a run of the controller in the execution context of the
+ * device, the inline one runs it right away
+ * must be called with the lock held */
+static void dispatch_controller(struct device_data* pdev_data){
+
+   if (pdev_data->stopping){
+      return;
+   }
+
+   if (!pdev_data->dispatch_pending){
+      pdev_data->dispatch_pending = true;
+      pdev_data->dispatch_time = hw_clock();
+   }
+
+   switch (pdev_data->exec.context){
+      case HCSR04_EXEC_HARDIRQ:
+         run_controller(pdev_data);
+         break;
+      case HCSR04_EXEC_WORKQUEUE:
+         queue_work(system_highpri_wq,&pdev_data->controller_work);
+         break;
+      case HCSR04_EXEC_THREAD:
+         if (pdev_data->controller_thread != NULL){
+            pdev_data->controller_thread_kick = true;
+            wake_up(&pdev_data->controller_thread_wq);
+            break;
+         }
+         /* fall through */
+      default:
+         tasklet_schedule (&pdev_data->controller_tasklet);
+         break;
+   }
+}
+
+static void async_controller_tasklet_func(unsigned long arg){
+
+   struct device_data* pdev_data = (struct device_data*)arg;
+   unsigned long flags;
+   PROFILE_START(start_time);
+
+   local_irq_save(flags);
+   spin_lock(&pdev_data->lock);
+
+   run_controller(pdev_data);
+
+   spin_unlock(&pdev_data->lock);
+   local_irq_restore(flags);
+
+   PROFILE_STOP(pdev_data,tasklet,start_time);
+}
+
+static void async_controller_work_func(struct work_struct* work){
+
+   struct device_data* pdev_data = container_of(work,struct device_data,controller_work);
+   unsigned long flags;
+   PROFILE_START(start_time);
+
+   local_irq_save(flags);
+   spin_lock(&pdev_data->lock);
+
+   run_controller(pdev_data);
 
    spin_unlock(&pdev_data->lock);
    local_irq_restore(flags);
 
+   PROFILE_STOP(pdev_data,tasklet,start_time);
+}
+
+/* the kernel thread of HCSR04_EXEC_THREAD, runs the controller whenever
+ * it gets kicked */
+static int async_controller_thread_func(void* arg){
+
+   struct device_data* pdev_data = (struct device_data*)arg;
+   unsigned long flags;
+
+   while (!kthread_should_stop()){
+
+      if (wait_event_interruptible(pdev_data->controller_thread_wq,
+               pdev_data->controller_thread_kick || kthread_should_stop())){
+         continue;
+      }
+
+      {
+         PROFILE_START(start_time);
+
+         local_irq_save(flags);
+         spin_lock(&pdev_data->lock);
+
+         if (pdev_data->controller_thread_kick){
+            pdev_data->controller_thread_kick = false;
+            run_controller(pdev_data);
+         }
+
+         spin_unlock(&pdev_data->lock);
+         local_irq_restore(flags);
+
+         PROFILE_STOP(pdev_data,tasklet,start_time);
+      }
+   }
+
+   return SUCCESS;
+}
+
+/* arms the operation timer usec_delay from now, 0 for the soonest,
+ * must be called with the lock held */
+static void start_operation_timer(struct device_data* pdev_data,unsigned long usec_delay){
+   if (pdev_data->stopping){
+      return;
+   }
+
+   hw_timer_start(&pdev_data->operation_timer,
+         ns_to_ktime((u64)usec_delay * NSEC_PER_USEC),
+         HRTIMER_MODE_REL);
 }
 
-/* handles time triggered operations.
- * This function may handle calls that my sleep */  
-static void async_operation_timer_func(unsigned long arg){
+/* handles time triggered operations. */  
+static enum hrtimer_restart async_operation_timer_func(struct hrtimer* timer){
 
-   struct device_data* pdev_data = (struct device_data*) arg;
+   struct device_data* pdev_data = container_of(timer,struct device_data,operation_timer);
    controller_status_t ctl_stat;
+   cycle_source_t cycle_source;
    unsigned long flags;
+   u64 late_ns;
+   PROFILE_START(start_time);
+
+   late_ns = ktime_to_ns(ktime_sub(hw_clock(),hrtimer_get_expires(timer)));
 
    /* ======================== */
    local_irq_save(flags);
    spin_lock(&pdev_data->lock);
 
+   pdev_data->dispatch.timer_fires++;
+   pdev_data->dispatch.timer_late_ns_sum += late_ns;
+   if (late_ns > pdev_data->dispatch.timer_late_ns_max){
+      pdev_data->dispatch.timer_late_ns_max = late_ns;
+   }
+
    ctl_stat = pdev_data->ctl_stat;
+   cycle_source = pdev_data->cycle_source;
 
    spin_unlock(&pdev_data->lock);
    local_irq_restore(flags);
@@ -610,16 +2449,38 @@ static void async_operation_timer_func(unsigned long arg){
    switch (ctl_stat){
       case CONTROLLER_TRIGGER_HI:
 
+         if (echo_line_high(pdev_data)){
+            /* the echo line is still high, the sensor is hung or miswired
+             * hence no point in waiting for the timeout */
+            local_irq_save(flags);
+            spin_lock(&pdev_data->lock);
+
+            pdev_data->evt_src_flags |= EVENT_SRC_ECHO_STUCK;
+            pdev_data->ctl_stat = CONTROLLER_INVALID;
+            start_operation_timer(pdev_data,0);
+
+            spin_unlock(&pdev_data->lock);
+            local_irq_restore(flags);
+            break;
+         }
+
          /* Send the signal to IO */
-         gpio_set_value(pdev_data->gpio.trigger_gpio,1);
+         hw_gpio_set(pdev_data->gpio.trigger_gpio,1);
 
          local_irq_save(flags);
          spin_lock(&pdev_data->lock);
 
+         pdev_data->last_trigger_time = hw_clock();
+         capture_edge(pdev_data,HCSR04_EDGE_SRC_TRIGGER,1);
+
+         if (cycle_source != CYCLE_SRC_USER){
+            update_trigger_latency(pdev_data);
+         }
+
          /* kickoff the controller with the trigger_gpio hi flag set 
           * the controller should handle what's next */
          pdev_data->evt_src_flags |= EVENT_SRC_TRG_HI;
-         tasklet_schedule (&pdev_data->controller_tasklet);
+         dispatch_controller(pdev_data);
 
          spin_unlock(&pdev_data->lock);
 
@@ -629,16 +2490,18 @@ static void async_operation_timer_func(unsigned long arg){
       case CONTROLLER_TRIGGER_LO:
 
         /* Send the signal to IO */
-         gpio_set_value(pdev_data->gpio.trigger_gpio,0);
+         hw_gpio_set(pdev_data->gpio.trigger_gpio,0);
 
          local_irq_save(flags);
          spin_lock(&pdev_data->lock);
 
+         capture_edge(pdev_data,HCSR04_EDGE_SRC_TRIGGER,0);
+
           /* we are done sending the trigger_gpio pulse to the gpio 
            * kickoff the controller with the trigger_gpio lo flag set 
           * the controller should handle what's next */
          pdev_data->evt_src_flags |= EVENT_SRC_TRG_LO;
-         tasklet_schedule (&pdev_data->controller_tasklet);
+         dispatch_controller(pdev_data);
 
          spin_unlock(&pdev_data->lock);
 
@@ -651,12 +2514,12 @@ static void async_operation_timer_func(unsigned long arg){
          local_irq_save(flags);
          spin_lock(&pdev_data->lock);
 
-         if ((pdev_data->evt_src_flags & EVENT_SRC_INTERRUPT_RISE) == 0){
-            /* timeout has kicked in and that the interrupt flag 
+         if ((pdev_data->evt_src_flags & EVENT_SRC_INTERRUPT_FALL) == 0){
+            /* timeout has kicked in and that some echo 
              * has not come back so far
              * kickoff the controller with timeout flag set */
              pdev_data->evt_src_flags |= EVENT_SRC_TIMEOUT;
-             tasklet_schedule (&pdev_data->controller_tasklet);
+             dispatch_controller(pdev_data);
               
          }
 
@@ -668,66 +2531,168 @@ static void async_operation_timer_func(unsigned long arg){
       case CONTROLLER_TIMEDOUT:
       case CONTROLLER_INVALID:
 
-         up(&pdev_data->ready_sem);
+         publish_ranging_samples(pdev_data);
          break;
       default:
          break;
    }
+
+   PROFILE_STOP(pdev_data,timer,start_time);
+
+   return HRTIMER_NORESTART;
 }
 
 /* Interrupt request handler for GPIO wired to the echo_gpio pin of HCSR04 device */
 static irqreturn_t irq_handler(int irq,void* dev_id){
-   struct device_data* pdev_data = (struct device_data*)dev_id;
+   struct echo_channel* echo = (struct echo_channel*)dev_id;
+   struct device_data* pdev_data = echo->pdev_data;
    unsigned long flags;
+   unsigned int i;
+   u8 all_fallen = EVENT_SRC_INTERRUPT_FALL;
    irqreturn_t  irqret = IRQ_NONE;
+   PROFILE_START(start_time);
 
    /* ======================== */
    local_irq_save(flags);
    spin_lock(&pdev_data->lock);
+
+   if (echo->irq_num == irq && pdev_data->edge_capture_users != 0){
+      /* every edge is recorded, sampling the level as soon as possible */
+      capture_edge(pdev_data,(u8)(echo - pdev_data->echo),hw_gpio_get(echo->gpio));
+
+      if (pdev_data->cycle_capture){
+         /* the cycle is left to run until the timeout */
+         irqret = IRQ_HANDLED;
+         goto unlock_func;
+      }
+   }
  
-   if (pdev_data->gpio.irq_num == irq){
+   /* noise, a late fall after a timeout or an echo edge between the
+    * cycles must not turn into a cycle of its own */
+   if (echo->irq_num == irq &&
+         pdev_data->ctl_stat != CONTROLLER_TRIGGERED &&
+         !(pdev_data->ctl_stat == CONTROLLER_TRIGGER_LO && (pdev_data->evt_src_flags & EVENT_SRC_TRG_LO))){
+
+      pdev_data->stats.stray_edges++;
+      irqret = IRQ_HANDLED;
+      goto unlock_func;
+   }
+
+   if (echo->irq_num == irq){
  
-      if ((pdev_data->evt_src_flags & EVENT_SRC_INTERRUPT_RISE) == 0){
+      if ((echo->evt_src_flags & EVENT_SRC_INTERRUPT_RISE) == 0){
 
          /* lets notify the controller that we have received the hardware response
           */
-         pdev_data->evt_src_flags |= EVENT_SRC_INTERRUPT_RISE;
+         echo->evt_src_flags |= EVENT_SRC_INTERRUPT_RISE;
          /* fetch the ranging end time
           * This piece of code is very critical to the accuracy of the reading
           * hence handled in the interrupt level*/
          /*pdev_data->range.end_time = current_kernel_time();*/
-         getnstimeofday(&pdev_data->range.start_time);
-
-
-         /* go let the rest of the processing handled by the tasklet */
-         tasklet_schedule (&pdev_data->controller_tasklet);
+         hw_timestamp(&echo->range.start_time);
 
          irqret =  IRQ_HANDLED;
       }
-      else if ((pdev_data->evt_src_flags & EVENT_SRC_INTERRUPT_FALL)== 0){
+      else if ((echo->evt_src_flags & EVENT_SRC_INTERRUPT_FALL)== 0){
          /* lets notify the controller that we have received the hardware response
           */
-         pdev_data->evt_src_flags |= EVENT_SRC_INTERRUPT_FALL;
+         echo->evt_src_flags |= EVENT_SRC_INTERRUPT_FALL;
          /* fetch the ranging end time
           * This piece of code is very critical to the accuracy of the reading
           * hence handled in the interrupt level*/
          /*pdev_data->range.end_time = current_kernel_time();*/
-         getnstimeofday(&pdev_data->range.end_time);
+         hw_timestamp(&echo->range.end_time);
 
+         irqret =  IRQ_HANDLED;
+      }
 
-         /* go let the rest of the processing handled by the tasklet */
-         tasklet_schedule (&pdev_data->controller_tasklet);
+   }
 
-         irqret =  IRQ_HANDLED;
-         
+   if (irqret == IRQ_HANDLED){
+      /* the controller only needs to know about the first rise
+       * and about the last fall of the echoes */
+      for (i = 0; i < pdev_data->echo_count; i++){
+         if ((pdev_data->echo[i].evt_src_flags & EVENT_SRC_INTERRUPT_FALL) == 0){
+            all_fallen = 0;
+         }
       }
 
+      pdev_data->evt_src_flags |= EVENT_SRC_INTERRUPT_RISE | all_fallen;
+
+      /* go let the rest of the processing handled by the tasklet */
+      dispatch_controller(pdev_data);
    }
- 
+#ifdef HCSR04_PROFILE
+   else{
+      /* an edge outside of the expected rise/fall sequence */
+      pdev_data->profile.spurious_edges++;
+   }
+#endif
+
+unlock_func:
    spin_unlock(&pdev_data->lock);
    local_irq_restore(flags);
 
+   PROFILE_STOP(pdev_data,irq,start_time);
+
    return irqret;
 }
 
+/* Fires at every periodic slot. The expiry is advanced by whole periods
+ * from the previous one so the schedule does not drift */
+static enum hrtimer_restart periodic_slot_timer_func(struct hrtimer* timer){
+   struct device_data* pdev_data = container_of(timer,struct device_data,period_timer);
+   unsigned long flags;
+   u64 overruns;
+
+   local_irq_save(flags);
+   spin_lock(&pdev_data->lock);
+
+   pdev_data->stats.slots++;
+
+   switch (request_triggered_cycle(pdev_data,hrtimer_get_expires(timer),CYCLE_SRC_SLOT)){
+      case -EBUSY:
+         /* the previous cycle (e.g. a timeout) is still running */
+         pdev_data->stats.missed_slots++;
+         break;
+      default:
+         break;
+   }
+
+   overruns = hrtimer_forward(timer,hw_clock(),pdev_data->period);
+
+   if (overruns > 1){
+      /* the slots in between were not even looked at */
+      pdev_data->stats.slots += overruns - 1;
+      pdev_data->stats.missed_slots += overruns - 1;
+   }
+
+   spin_unlock(&pdev_data->lock);
+   local_irq_restore(flags);
+
+   return HRTIMER_RESTART;
+}
+
+/* Interrupt request handler for the GPIO of the external trigger source */
+static irqreturn_t ext_trigger_irq_handler(int irq,void* dev_id){
+   struct device_data* pdev_data = (struct device_data*)dev_id;
+
+   /* timestamp the event first, it is the reference of the trigger latency */
+   trigger_async_ranging(pdev_data,hw_clock());
+
+   return IRQ_HANDLED;
+}
+
+/* the device has lost its pins, e.g. to a failed rollback of a pin change
+ * must be called with the lock held */
+static bool ranging_pins_missing(struct device_data* pdev_data){
+   return pdev_data->gpio.trigger_gpio == INVALID_GPIO_NUM || pdev_data->echo_count == 0;
+}
 
+/* the cycles are started by the periodic slots or an external trigger
+ * rather than by the userspace application
+ * must be called with the lock held */
+static bool sample_queue_active(struct device_data* pdev_data){
+   return ktime_to_ns(pdev_data->period) != 0 ||
+      pdev_data->gpio.ext_trigger_gpio != INVALID_EXT_GPIO_NUM;
+}
@@ -22,6 +22,11 @@
 #define __HCSR04_ASYNC_DEVICE_H
 
 #include <linux/err.h>
+#include <linux/time.h>
+#include <linux/ktime.h>
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include "hcsr04_ioctl.h"
 
 
 typedef enum {
@@ -34,28 +39,118 @@ typedef enum {
 
 #define SUCCESS 0
 
+/* The datasheet suggests a measurement cycle of over 60ms to prevent
+ * the echo of the previous trigger from being taken as the current one */
+#define HCSR04_MIN_CYCLE_USEC 60000
+
+/* the result of a single echo of a completed ranging cycle, the samples
+ * of the echoes of a cycle share the same seq */
+struct ranging_sample {
+   u32              seq;
+   ktime_t          trigger_time;
+   ranging_result_t result_code;
+   u32              health;       /* HCSR04_HEALTH_* after this cycle */
+   u32              channel;      /* index of the echo */
+   u32              channels;     /* number of the echoes of the cycle */
+   struct timespec  start_time;
+   struct timespec  end_time;
+   struct timespec  delta_time;
+};
+
 /* asynchronous interface function */
 
 extern int init_ranging_device(
       unsigned int trigger_gpio,
-      unsigned int echo_gpio,
+      const unsigned int* echo_gpio,
+      unsigned int echo_count,
       unsigned int usec_pulse_width,
       unsigned int usec_timeout,
-      bool blocking,
       void**   pprivata_data);
 
 extern int release_ranging_device(void* private_data);
 
-extern int start_async_ranging(void* private_data);
+/* A client (open file) of the device with its own sample queue, sampling
+ * every usec_period or on demand with 0. The device is triggered at the
+ * rate of the strictest client */
+extern int open_ranging_client(void* private_data, unsigned int usec_period, void** pclient);
+
+extern int close_ranging_client(void* client);
+
+extern int set_client_period(void* client, unsigned int usec_period);
+
+extern int get_client_period(void* client, unsigned int* usec_period);
+
+/* wakeup moderation of the reader of the client, see HCSR04_IOC_SET_WAKEUP */
+extern int set_client_wakeup(void* client, const struct hcsr04_wakeup* wakeup);
+
+extern int get_client_wakeup_stats(void* client, struct hcsr04_wakeup_stats* stats);
+
+/* requests an on demand sample for the client */
+extern int start_async_ranging(void* client);
+
+/* the same unless the client has a sample queued or requested already
+ * or samples periodically */
+extern int start_async_ranging_if_idle(void* client);
+
+/* the samples delivered to the client */
+extern int read_ranging_sample(
+      void* client,
+      struct ranging_sample* sample,
+      bool blocking);
+
+/* waits up to timeout jiffies for a sample to read, -ETIMEDOUT when
+ * none came meanwhile */
+extern int wait_ranging_sample(void* client, unsigned long timeout);
+
+extern unsigned int poll_ranging_sample(void* client, struct file* filp, poll_table* wait);
+
+extern int fasync_ranging_sample(void* client, int fd, struct file* filp, int on);
 
-extern int reset_async_ranging(void* private_data);
+/* external trigger gpio, a negative gpio turns it off
+ * edges is a combination of HCSR04_EDGE_* flags */
+extern int set_external_trigger(void* private_data, int gpio, unsigned int edges);
 
-extern int read_async_ranging_result(
+extern int trigger_async_ranging(void* private_data, ktime_t request_time);
+
+extern int get_ranging_stats(void* private_data, struct hcsr04_stats* stats);
+
+extern int get_ranging_health(void* private_data, struct hcsr04_health* health);
+
+/* -EBUSY while the triggers of an unhealthy device are backed off */
+extern int check_ranging_backoff(void* private_data);
+
+/* records every published sample to a history of hcsr04_history.h,
+ * NULL stops the recording */
+extern int set_ranging_history(void* private_data, void* history);
+
+/* the context the controller runs in, see HCSR04_IOC_SET_EXEC */
+extern int set_execution_context(void* private_data, const struct hcsr04_exec* exec);
+
+extern int get_dispatch_stats(void* private_data, struct hcsr04_dispatch_stats* stats);
+
+/* raw edge capture, see HCSR04_FORMAT_EDGES */
+extern int set_edge_capture(void* private_data, bool on);
+
+extern int read_ranging_edges(
       void* private_data,
-      ranging_result_t* result_code,
-      struct timespec* start_time,
-      struct timespec* end_time,
-      struct timespec* delta_time);
+      struct hcsr04_edge* edges,
+      unsigned int count,
+      bool blocking);
+
+extern unsigned int poll_ranging_edges(void* private_data, struct file* filp, poll_table* wait);
+
+/* handler timing, reset clears it after the copy */
+extern int get_ranging_profile(void* private_data, struct hcsr04_profile* profile, bool reset);
+
+/* runtime configuration, config->format and config->rate_hz are
+ * settings of the client and are not used */
+extern int set_ranging_config(void* private_data, const struct hcsr04_config* config);
+
+/* -EINVAL unless the timing, the echo count and the filter are usable,
+ * checked by set_ranging_config as well */
+extern int check_ranging_config(const struct hcsr04_config* config);
+
+extern int get_ranging_config(void* private_data, struct hcsr04_config* config);
 
 
 #endif
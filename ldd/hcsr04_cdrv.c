@@ -24,7 +24,16 @@
 #include <linux/cdev.h>
 #include <asm/uaccess.h>
 #include <linux/ctype.h>
+#include <linux/uio.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/moduleparam.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
+#include <linux/jiffies.h>
 #include "hcsr04_async_device.h"
+#include "hcsr04_history.h"
 /* This code is written for Rasberry PI 2 */
 
 MODULE_LICENSE("GPL");
@@ -37,23 +46,75 @@ static int driver_entry(void);
 static void driver_exit(void);
 static int device_open(struct inode *, struct file *);
 static int device_release(struct inode *, struct file *);
-static ssize_t device_read(struct file *, char *, size_t, loff_t *);
+static ssize_t device_read_iter(struct kiocb *, struct iov_iter *);
+static unsigned int device_poll(struct file *, poll_table *);
+static int device_fasync(int, struct file *, int);
 static ssize_t device_write(struct file *, const char *, size_t, loff_t *);
+static long device_ioctl(struct file *, unsigned int, unsigned long);
+static int param_set_live(const char *, const struct kernel_param *);
+static int param_set_rate(const char *, const struct kernel_param *);
+static int param_get_measure(char *, const struct kernel_param *);
+static size_t format_text_line(struct ranging_sample* sample, char* buffer);
+static int setup_ranging_device(void);
+static unsigned int usec_inverse(unsigned int value);
+static int check_sample_rate(unsigned int rate_hz);
+static int set_file_format(struct file_context* context, __u32 format);
 
 
 static unsigned int  param_trigger_gpio = 17;
-static unsigned int  param_echo_gpio    = 18;
+static unsigned int  param_echo_gpio[HCSR04_MAX_ECHOES] = { 18 };
+static unsigned int  param_echo_gpio_count = 1;
 static unsigned int  param_usec_pulse_width = 10;  /* 10 ms */
 static unsigned int  param_usec_timeout = 300000;  /* 300 ms */
+static unsigned int  param_sample_rate_hz = 0;     /* on demand */
+static int           param_ext_trigger_gpio = -1;  /* none */
+static unsigned int  param_filter = HCSR04_FILTER_NONE;
+static unsigned int  param_history_kb = 512;       /* ~2.5 hours at 16 Hz */
+static unsigned int  param_exec_context = HCSR04_EXEC_TASKLET;
+static unsigned int  param_exec_priority = 50;     /* SCHED_FIFO */
+
+/* the tuning parameters are writable through
+ * /sys/module/<module>/parameters and are applied to the device
+ * between the measurements */
+static const struct kernel_param_ops param_live_ops = {
+   .set = param_set_live,
+   .get = param_get_uint,
+};
+
+/* the rate of the files opened later, checked against the minimum
+ * cycle so that a bad default never fails every open */
+static const struct kernel_param_ops param_rate_ops = {
+   .set = param_set_rate,
+   .get = param_get_uint,
+};
+
+/* a read-only parameter that measures on every read, for scripts */
+static const struct kernel_param_ops param_measure_ops = {
+   .get = param_get_measure,
+};
 
 module_param(param_trigger_gpio,uint,S_IRUSR|S_IRGRP);
-module_param(param_echo_gpio,uint,S_IRUSR|S_IRGRP);
-module_param(param_usec_pulse_width,uint,S_IRUSR|S_IRGRP);
-module_param(param_usec_timeout,uint,S_IRUSR|S_IRGRP);
+module_param_array(param_echo_gpio,uint,&param_echo_gpio_count,S_IRUSR|S_IRGRP);
+module_param_cb(param_usec_pulse_width,&param_live_ops,&param_usec_pulse_width,S_IRUSR|S_IWUSR|S_IRGRP);
+module_param_cb(param_usec_timeout,&param_live_ops,&param_usec_timeout,S_IRUSR|S_IWUSR|S_IRGRP);
+module_param_cb(param_sample_rate_hz,&param_rate_ops,&param_sample_rate_hz,S_IRUSR|S_IWUSR|S_IRGRP);
+module_param(param_ext_trigger_gpio,int,S_IRUSR|S_IRGRP);
+module_param_cb(param_filter,&param_live_ops,&param_filter,S_IRUSR|S_IWUSR|S_IRGRP);
+module_param(param_history_kb,uint,S_IRUSR|S_IRGRP);
+module_param(param_exec_context,uint,S_IRUSR|S_IRGRP);
+module_param(param_exec_priority,uint,S_IRUSR|S_IRGRP);
+module_param_cb(param_measure,&param_measure_ops,NULL,S_IRUSR|S_IRGRP);
 MODULE_PARM_DESC(param_trigger_gpio,"The GPIO pin for hc-sr04 trigger");
-MODULE_PARM_DESC(param_echo_gpio,"The GPIO pin for hc-sr04 echo");
+MODULE_PARM_DESC(param_echo_gpio,"The GPIO pins for hc-sr04 echo, comma separated for sensors sharing the trigger pin");
 MODULE_PARM_DESC(param_usec_pulse_width,"The pulse width duration for the hc-sr04 trigger");
 MODULE_PARM_DESC(param_usec_timeout,"The timeout setting for non responding hc-sr04 echo signal");
+MODULE_PARM_DESC(param_sample_rate_hz,"The periodic sampling rate of a newly opened file, 0 for ranging on demand");
+MODULE_PARM_DESC(param_ext_trigger_gpio,"The GPIO pin whose rising edge starts the ranging, -1 for none, applied on the first open");
+MODULE_PARM_DESC(param_filter,"The filter of the echo width, 0 for none, 1 for the median of the last three");
+MODULE_PARM_DESC(param_history_kb,"The memory in KB of the sample history, 0 turns it off");
+MODULE_PARM_DESC(param_exec_context,"The context of the controller, 0 tasklet, 1 inline in the interrupt, 2 high priority workqueue, 3 kernel thread");
+MODULE_PARM_DESC(param_exec_priority,"The SCHED_FIFO priority of the kernel thread context");
+MODULE_PARM_DESC(param_measure,"Reading it returns a fresh measurement in the text format, a line per echo");
 
 
 
@@ -63,13 +124,34 @@ extern char DEVICE_NAME[];
 
 static const char start_cmd[] = "start";
 
-static struct semaphore instance_sem;
+/* The ranging device is set up on the first open and kept until the
+ * module is unloaded, open and release only hand out the reference */
+static DEFINE_MUTEX(device_lock);
+static void* ranging_device = NULL;
+static bool  driver_unloading = false;  /* no setup any more */
+
+/* allocated at load time so that it outlives the device setup */
+static void* ranging_history = NULL;
+
+static DEFINE_SPINLOCK(open_stats_lock);
+static struct hcsr04_open_stats open_stats;
+
+/* the state of an open file */
+struct file_context {
+   void*  ranging_device;
+   void*  client;          /* the sample queue and rate of this file */
+   __u32  format;          /* HCSR04_FORMAT_* of the data returned by read() */
+   bool   oneshot_read;    /* read() starts the ranging when nothing is queued */
+};
 
 
 static struct file_operations fops = {
    .owner = THIS_MODULE,
-   .read = device_read,
+   .read_iter = device_read_iter,
    .write = device_write,
+   .poll = device_poll,
+   .fasync = device_fasync,
+   .unlocked_ioctl = device_ioctl,
    .open = device_open,
    .release = device_release
 };
@@ -95,17 +177,19 @@ static int driver_entry(void){
       goto func_exit;
    }
 
+   if (param_history_kb > 0 &&
+         (result = init_ranging_history(param_history_kb,&ranging_history)) != SUCCESS){
+      goto func_exit;
+   }
+
    mcdev->ops = &fops;
    mcdev->owner = THIS_MODULE;
 
    if ((result = cdev_add(mcdev,dev_num,1)) < SUCCESS){
       printk(KERN_ALERT "%s: Unable to add cdev to kernel\n",DEVICE_NAME);
-      return result;
+      goto func_exit;
    }
 
-   // only one instance supported for now
-   sema_init(&instance_sem,1);
-
    printk(KERN_INFO "%s: Initialization success with major number = %d!\n",DEVICE_NAME,MAJOR(dev_num));
 
 func_exit:
@@ -120,12 +204,39 @@ func_exit:
          unregister_chrdev_region(dev_num,1);
          dev_num = 0;
       }
+
+      release_ranging_history(ranging_history);
+      ranging_history = NULL;
    }
    return result;  
 }
 
 static void driver_exit(void){
+   void* pdev;
+
+   /* no new open, the open files hold the module */
    cdev_del(mcdev);
+
+   /* the parameters stay reachable until the module is gone, a
+    * param_measure in progress is waited for and the later ones find
+    * the driver unloading */
+   kernel_param_lock(THIS_MODULE);
+   mutex_lock(&device_lock);
+
+   driver_unloading = true;
+   pdev = ranging_device;
+   ranging_device = NULL;
+
+   mutex_unlock(&device_lock);
+   kernel_param_unlock(THIS_MODULE);
+
+   if (pdev != NULL){
+      release_ranging_device(pdev);
+   }
+
+   release_ranging_history(ranging_history);
+   ranging_history = NULL;
+
    unregister_chrdev_region(dev_num,1);
    printk(KERN_INFO "%s: Device is uninitialized\n",DEVICE_NAME);
 }
@@ -136,100 +247,426 @@ static void driver_exit(void){
 /* File Operation Functions */
 static int device_open(struct inode *inode, struct file *file)
 {
-   int retval; 
+   int retval = SUCCESS;
+   unsigned long flags;
+   ktime_t start_time = ktime_get();
+   u64 open_ns;
+   struct file_context* context = NULL;
+
+   if ((context = kmalloc(sizeof(struct file_context),GFP_KERNEL)) == NULL){
+      printk (KERN_ALERT "%s: Unable to allocate memory.\n", DEVICE_NAME);
+      retval = -ENOMEM;
+      goto exit_func;
+   }
+
+   memset(context,0x00,sizeof(struct file_context));
+   context->format = HCSR04_FORMAT_TEXT;
+
+   mutex_lock(&device_lock);
+
+   if (ranging_device == NULL){
+      retval = setup_ranging_device();
+      /* the one time setup is reported on its own */
+      start_time = ktime_get();
+   }
+   context->ranging_device = ranging_device;
+
+   mutex_unlock(&device_lock);
+
+   if (retval != SUCCESS){
+      goto release_func;
+   }
+
+   /* every file has its own samples at its own rate */
+   if ((retval = open_ranging_client(context->ranging_device,
+               usec_inverse(param_sample_rate_hz),
+               &context->client)) != SUCCESS){
+
+      printk (KERN_ALERT "%s: Unable to open a client at %u Hz\n",DEVICE_NAME,param_sample_rate_hz);
+      goto release_func;
+   }
+
+   file->private_data = context;
+
+   open_ns = ktime_to_ns(ktime_sub(ktime_get(),start_time));
+
+   spin_lock_irqsave(&open_stats_lock,flags);
+   open_stats.opens++;
+   open_stats.open_ns_sum += open_ns;
+   if (open_ns > open_stats.open_ns_max){
+      open_stats.open_ns_max = open_ns;
+   }
+   spin_unlock_irqrestore(&open_stats_lock,flags);
+
+   return SUCCESS;
+
+release_func:
+   kfree(context);
+
+exit_func:
+   return retval;
+}
+
+static int device_release(struct inode *inode, struct file *file)
+{
+   struct file_context* context = (struct file_context*)file->private_data;
+
+   device_fasync(-1,file,0);
+   set_file_format(context,HCSR04_FORMAT_TEXT);
+   close_ranging_client(context->client);
+   kfree(context);
+   return SUCCESS;
+}
+
+/* Measures through a client of its own, the device is set up unless
+ * a file has done it already. The module parameter lock is held
+ * meanwhile, so the wait is bounded by a cycle and a backed off device
+ * is reported busy rather than waited for */
+static int param_get_measure(char *buffer, const struct kernel_param *kp)
+{
+   int retval = SUCCESS;
+   size_t length = 0;
+   unsigned int i;
+   void* pdev;
+   void* client = NULL;
+   struct ranging_sample sample;
 
-   if (down_trylock(&instance_sem)){
-      printk (KERN_ALERT "%s: Device is currently in use!\n",DEVICE_NAME);
-      retval = -EBUSY;
+   mutex_lock(&device_lock);
+
+   if (driver_unloading){
+      retval = -ENODEV;
+   }
+   else if (ranging_device == NULL){
+      retval = setup_ranging_device();
+   }
+   pdev = ranging_device;
+
+   mutex_unlock(&device_lock);
+
+   if (retval != SUCCESS){
+      goto exit_func;
+   }
+
+   if ((retval = check_ranging_backoff(pdev)) != SUCCESS ||
+         (retval = open_ranging_client(pdev,0,&client)) != SUCCESS ||
+         (retval = start_async_ranging(client)) != SUCCESS){
+      goto exit_func;
+   }
+
+   /* a cycle in progress for another file is completed first, the
+    * samples of the echoes of a cycle are queued together */
+   if ((retval = wait_ranging_sample(client,usecs_to_jiffies(
+               2 * (param_usec_pulse_width + param_usec_timeout + HCSR04_MIN_CYCLE_USEC)))) != SUCCESS ||
+         (retval = read_ranging_sample(client,&sample,false)) != SUCCESS){
       goto exit_func;
    }
 
+   length = format_text_line(&sample,buffer);
+
+   for (i = 1; i < sample.channels; i++){
+      if (read_ranging_sample(client,&sample,false) != SUCCESS){
+         break;
+      }
+      length += format_text_line(&sample,buffer + length);
+   }
+
+exit_func:
+   if (client != NULL){
+      close_ranging_client(client);
+   }
+
+   return (retval == SUCCESS ? length : retval);
+}
+
+/* the period in usec of a rate in Hz or the rate of a period,
+ * 0 stays on demand */
+static unsigned int usec_inverse(unsigned int value)
+{
+   return (value == 0 ? 0 : USEC_PER_SEC / value);
+}
+
+/* -EINVAL for a rate faster than the minimum cycle, a rate above 1 MHz
+ * has a period of 0 and is rejected as well rather than taken as on demand */
+static int check_sample_rate(unsigned int rate_hz)
+{
+   if (rate_hz != 0 && usec_inverse(rate_hz) < HCSR04_MIN_CYCLE_USEC){
+      return -EINVAL;
+   }
+   return SUCCESS;
+}
+
+/* acquires the gpio and irq of the device with the module parameters,
+ * must be called with device_lock held */
+static int setup_ranging_device(void)
+{
+   int retval;
+   void* pdev = NULL;
+   ktime_t start_time = ktime_get();
+   struct hcsr04_config config;
+   struct hcsr04_exec exec;
+
    if ((retval = init_ranging_device(param_trigger_gpio,
          param_echo_gpio,
+         param_echo_gpio_count,
          param_usec_pulse_width,
          param_usec_timeout,
-         true,
-         &file->private_data)) != SUCCESS){
+         &pdev)) != SUCCESS){
 
-      printk (KERN_ALERT "%s: Opening device failed with error: %d\n",DEVICE_NAME,retval);
+      printk (KERN_ALERT "%s: Device setup failed with error: %d\n",DEVICE_NAME,retval);
+      goto exit_func;
+   }
+
+   get_ranging_config(pdev,&config);
+   config.filter = param_filter;
+
+   if ((retval = set_ranging_config(pdev,&config)) != SUCCESS){
+
+      printk (KERN_ALERT "%s: Unable to apply the filter %u\n",DEVICE_NAME,param_filter);
       goto exit_func;
-      
    }
+
+   if (param_ext_trigger_gpio >= 0 &&
+         (retval = set_external_trigger(pdev,param_ext_trigger_gpio,HCSR04_EDGE_RISING)) != SUCCESS){
+
+      printk (KERN_ALERT "%s: Unable to use gpio %d as external trigger\n",DEVICE_NAME,param_ext_trigger_gpio);
+      goto exit_func;
+   }
+
+   exec.context = param_exec_context;
+   exec.priority = param_exec_priority;
+
+   if ((retval = set_execution_context(pdev,&exec)) != SUCCESS){
+
+      printk (KERN_ALERT "%s: Unable to run the controller in context %u\n",DEVICE_NAME,param_exec_context);
+      goto exit_func;
+   }
+
+   set_ranging_history(pdev,ranging_history);
+
+   ranging_device = pdev;
+   open_stats.setup_ns = ktime_to_ns(ktime_sub(ktime_get(),start_time));
+
+   printk (KERN_INFO "%s: Device setup success\n",DEVICE_NAME);
+
 exit_func:
+   if (retval != SUCCESS && pdev != NULL){
+      release_ranging_device(pdev);
+   }
+
+   return retval;
+}
+
+/* Changes the read() format of the open file, the raw edge capture of
+ * the device stays on while any file reads edges */
+static int set_file_format(struct file_context* context, __u32 format)
+{
+   int retval = SUCCESS;
+
+   if (format != HCSR04_FORMAT_TEXT && format != HCSR04_FORMAT_BINARY && format != HCSR04_FORMAT_EDGES){
+      return -EINVAL;
+   }
+
+   mutex_lock(&device_lock);
+
+   if (format == HCSR04_FORMAT_EDGES && context->format != HCSR04_FORMAT_EDGES){
+      retval = set_edge_capture(context->ranging_device,true);
+   }
+   else if (format != HCSR04_FORMAT_EDGES && context->format == HCSR04_FORMAT_EDGES){
+      retval = set_edge_capture(context->ranging_device,false);
+   }
+
    if (retval == SUCCESS){
-      printk (KERN_INFO "%s: Open success\n",DEVICE_NAME);
+      context->format = format;
    }
+
+   mutex_unlock(&device_lock);
+
    return retval;
 }
 
-static int device_release(struct inode *inode, struct file *file)
+/* the captured edges, as many as the buffer can take without waiting for more */
+static ssize_t read_edges(struct file_context* context, struct iov_iter *to, bool blocking)
 {
-   release_ranging_device(file->private_data);
-   up(&instance_sem);
-   return SUCCESS;
+   int count;
+   size_t size;
+   ssize_t length = 0;
+   struct hcsr04_edge edges[16];
+
+   if (iov_iter_count(to) < sizeof(struct hcsr04_edge)){
+      printk (KERN_ALERT "%s: Read buffer is insufficient!\n",DEVICE_NAME);
+      return -ENOBUFS;
+   }
+
+   while (iov_iter_count(to) >= sizeof(struct hcsr04_edge)){
+
+      count = min_t(size_t,ARRAY_SIZE(edges),iov_iter_count(to) / sizeof(struct hcsr04_edge));
+
+      if ((count = read_ranging_edges(context->ranging_device,edges,count,blocking && length == 0)) < SUCCESS){
+         if (length == 0){
+            length = (count == -ENODATA ? 0 : count);
+         }
+         break;
+      }
+
+      size = count * sizeof(struct hcsr04_edge);
+      if (copy_to_iter(edges,size,to) != size){
+         length = -EFAULT;
+         break;
+      }
+      length += size;
+   }
+
+   return length;
 }
 
-static ssize_t device_read(struct file *filp,	/* see include/linux/fs.h   */
-			   char *buffer,	/* buffer to fill with buffer */
-			   size_t length,	/* length of the buffer     */
-			   loff_t * offset)
+/* formats a sample as a line of the text format, returns its length */
+static size_t format_text_line(struct ranging_sample* sample, char* buffer)
 {
-   int retval = SUCCESS;
-   static char data_buffer[100];
-   static ranging_result_t result_code;
-   static struct timespec start_time;
-   static struct timespec end_time;
-   static struct timespec delta_time;
-
-   if ((retval = read_async_ranging_result(
-               filp->private_data,
-               &result_code,
-               &start_time,
-               &end_time,
-               &delta_time)) != SUCCESS){
-      printk (KERN_ALERT "%s: Failed to read the ranging device!\n",DEVICE_NAME);
-      goto exit_func;
+   size_t length;
+
+   length = sprintf(buffer,"%d,%ld:%ld,%ld",
+         (int)sample->result_code, /* result code */
+         sample->delta_time.tv_sec, /* duration incident + reflected sound */
+         sample->delta_time.tv_nsec,
+         (sample->delta_time.tv_nsec*100) / 58140 /* calculated distance in cm * 100 */
+         );
+
+   if (sample->channels > 1){
+      length += sprintf(buffer + length,",%u",sample->channel);
    }
-   
 
-   if ( result_code  == RRESULT_NOT_STARTED ){
-      retval  =0;
-      printk (KERN_WARNING "%s: Device has not been started!\n",DEVICE_NAME);
+   length += sprintf(buffer + length,"\n");
+
+   return length;
+}
+
+static ssize_t format_text_sample(struct ranging_sample* sample, struct iov_iter *to)
+{
+   size_t length;
+   char data_buffer[100];
+
+   length = format_text_line(sample,data_buffer);
+
+   /* the read path runs at the sample rate, logged with dynamic debug only */
+   pr_debug("%s:%s",DEVICE_NAME,data_buffer);
+
+   if (iov_iter_count(to) < length || copy_to_iter(data_buffer,length,to) != length){
+      printk (KERN_ALERT "%s: Read buffer is insufficient!\n",DEVICE_NAME);
+      return -ENOBUFS;
+   }
+
+   return length;
+}
+
+static ssize_t format_binary_sample(struct ranging_sample* sample, struct iov_iter *to)
+{
+   struct hcsr04_sample record;
+
+   memset(&record,0x00,sizeof(record));
+   record.timestamp_ns = ktime_to_ns(sample->trigger_time);
+   record.seq = sample->seq;
+   record.echo_ns = (__u32)timespec_to_ns(&sample->delta_time);
+   record.result_code = sample->result_code;
+   record.flags = (sample->health & HCSR04_SAMPLE_HEALTH_MASK) |
+      ((sample->channel << HCSR04_SAMPLE_CHANNEL_SHIFT) & HCSR04_SAMPLE_CHANNEL_MASK);
+
+   if (copy_to_iter(&record,sizeof(record),to) != sizeof(record)){
+      return -EFAULT;
+   }
+
+   return sizeof(record);
+}
+
+static ssize_t device_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+   ssize_t retval = SUCCESS;
+   ssize_t length = 0;
+   struct file_context* context = (struct file_context*)iocb->ki_filp->private_data;
+   struct ranging_sample sample;
+   bool blocking = !(iocb->ki_filp->f_flags & O_NONBLOCK);
+
+#ifdef IOCB_NOWAIT
+   /* io_uring/aio attempt without blocking first, then poll() */
+   if (iocb->ki_flags & IOCB_NOWAIT){
+      blocking = false;
+   }
+#endif
+
+   if (context->format == HCSR04_FORMAT_EDGES){
+      retval = read_edges(context,to,blocking);
       goto exit_func;
    }
 
-   if ((retval = reset_async_ranging(filp->private_data)) != SUCCESS){
-      printk (KERN_ALERT "%s: Failed to reset the ranging device!\n",DEVICE_NAME);
+   if (context->format == HCSR04_FORMAT_BINARY && iov_iter_count(to) < sizeof(struct hcsr04_sample)){
+      printk (KERN_ALERT "%s: Read buffer is insufficient!\n",DEVICE_NAME);
+      retval = -ENOBUFS;
       goto exit_func;
    }
 
-   sprintf(data_buffer,"%d,%ld:%ld,%ld\n",
-         (int)result_code, /* result code */
-         delta_time.tv_sec, /* duration incident + reflected sound */
-         delta_time.tv_nsec,
-         (delta_time.tv_nsec*100) / 58140 /* calculated distance in cm * 100 */
-         );
+   /* a one-shot read starts the ranging by itself, a non-blocking one
+    * returns -EAGAIN until the result is in */
+   if (context->oneshot_read &&
+         (retval = start_async_ranging_if_idle(context->client)) != SUCCESS){
+      goto exit_func;
+   }
 
-   printk(KERN_INFO "%s:%s\n",DEVICE_NAME,data_buffer);
+   if ((retval = read_ranging_sample(context->client,&sample,blocking)) != SUCCESS){
 
-   
-   retval = strlen(data_buffer);
-   if (length < retval || copy_to_user(buffer,data_buffer,retval) != SUCCESS){
-      printk (KERN_ALERT "%s: Read buffer is insufficient!\n",DEVICE_NAME);
+      if (retval == -ENODATA){
+         retval  =0;
+         printk (KERN_WARNING "%s: Device has not been started!\n",DEVICE_NAME);
+      }
+      goto exit_func;
+   }
 
-      retval = -ENOBUFS;
+   if (context->format == HCSR04_FORMAT_TEXT){
+      retval = format_text_sample(&sample,to);
+      goto exit_func;
    }
 
+   /* the binary records are batched, as many queued samples as
+    * the buffer can take are returned without waiting for more */
+   do {
+      if ((retval = format_binary_sample(&sample,to)) < SUCCESS){
+         break;
+      }
+      length += retval;
+
+   } while (iov_iter_count(to) >= sizeof(struct hcsr04_sample) &&
+         read_ranging_sample(context->client,&sample,false) == SUCCESS);
+
+   if (length > 0){
+      retval = length;
+   }
 
 exit_func:
    return retval;
 }
 
+static unsigned int device_poll(struct file *filp, poll_table *wait)
+{
+   struct file_context* context = (struct file_context*)filp->private_data;
+
+   if (context->format == HCSR04_FORMAT_EDGES){
+      return poll_ranging_edges(context->ranging_device,filp,wait);
+   }
+
+   return poll_ranging_sample(context->client,filp,wait);
+}
+
+static int device_fasync(int fd, struct file *filp, int on)
+{
+   struct file_context* context = (struct file_context*)filp->private_data;
+
+   return fasync_ranging_sample(context->client,fd,filp,on);
+}
+
 static ssize_t
 device_write(struct file *filp, const char *buff, size_t len, loff_t * off)
 {
    int oldlen = len;
    int retval  = SUCCESS;  
+   struct file_context* context = (struct file_context*)filp->private_data;
       
    const char *p  = start_cmd;
    char  c_user;
@@ -253,7 +690,7 @@ device_write(struct file *filp, const char *buff, size_t len, loff_t * off)
       goto exit_func;
    } 
 
-   if ((retval = start_async_ranging (filp->private_data)) != SUCCESS){
+   if ((retval = start_async_ranging (context->client)) != SUCCESS){
 
       printk (KERN_ALERT "%s: Failed to start device ranging!\n",DEVICE_NAME);
       goto exit_func;
@@ -263,6 +700,311 @@ exit_func:
    return  (retval == SUCCESS ? oldlen:retval);
 }
 
+static long device_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+   long retval = SUCCESS;
+   __u32 rate_hz;
+   __u32 format;
+   unsigned int usec_period;
+   unsigned int old_usec_period;
+   struct hcsr04_stats stats;
+   struct hcsr04_ext_trigger ext_trigger;
+   struct hcsr04_health health;
+   struct hcsr04_config config;
+   struct hcsr04_open_stats open_stats_copy;
+   struct hcsr04_profile profile;
+   struct hcsr04_history_query query;
+   struct hcsr04_exec exec;
+   struct hcsr04_dispatch_stats dispatch;
+   __u32 on;
+   struct hcsr04_wakeup wakeup;
+   struct hcsr04_wakeup_stats wakeup_stats;
+   unsigned long flags;
+   struct file_context* context = (struct file_context*)filp->private_data;
+
+   switch (cmd){
+      case HCSR04_IOC_SET_RATE:
+         if (get_user(rate_hz,(__u32 __user *)arg)){
+            retval = -EFAULT;
+            break;
+         }
+
+         if ((retval = check_sample_rate(rate_hz)) != SUCCESS){
+            break;
+         }
+
+         retval = set_client_period(context->client,usec_inverse(rate_hz));
+         break;
+
+      case HCSR04_IOC_GET_RATE:
+         if ((retval = get_client_period(context->client,&usec_period)) != SUCCESS){
+            break;
+         }
+
+         rate_hz = usec_inverse(usec_period);
+         if (put_user(rate_hz,(__u32 __user *)arg)){
+            retval = -EFAULT;
+         }
+         break;
+
+      case HCSR04_IOC_GET_STATS:
+         if ((retval = get_ranging_stats(context->ranging_device,&stats)) != SUCCESS){
+            break;
+         }
+
+         if (copy_to_user((void __user *)arg,&stats,sizeof(stats))){
+            retval = -EFAULT;
+         }
+         break;
+
+      case HCSR04_IOC_SET_EXT_TRIGGER:
+         if (copy_from_user(&ext_trigger,(void __user *)arg,sizeof(ext_trigger))){
+            retval = -EFAULT;
+            break;
+         }
+
+         mutex_lock(&device_lock);
+         retval = set_external_trigger(context->ranging_device,ext_trigger.gpio,ext_trigger.edges);
+         mutex_unlock(&device_lock);
+         break;
+
+      case HCSR04_IOC_GET_HEALTH:
+         if ((retval = get_ranging_health(context->ranging_device,&health)) != SUCCESS){
+            break;
+         }
+
+         if (copy_to_user((void __user *)arg,&health,sizeof(health))){
+            retval = -EFAULT;
+         }
+         break;
+
+      case HCSR04_IOC_GET_CONFIG:
+         if ((retval = get_ranging_config(context->ranging_device,&config)) != SUCCESS ||
+               (retval = get_client_period(context->client,&usec_period)) != SUCCESS){
+            break;
+         }
+
+         config.rate_hz = usec_inverse(usec_period);
+         config.format = context->format;
+         if (copy_to_user((void __user *)arg,&config,sizeof(config))){
+            retval = -EFAULT;
+         }
+         break;
+
+      case HCSR04_IOC_SET_CONFIG:
+         if (copy_from_user(&config,(void __user *)arg,sizeof(config))){
+            retval = -EFAULT;
+            break;
+         }
+
+         if (config.format != HCSR04_FORMAT_TEXT &&
+               config.format != HCSR04_FORMAT_BINARY &&
+               config.format != HCSR04_FORMAT_EDGES){
+            retval = -EINVAL;
+            break;
+         }
+
+         if ((retval = check_sample_rate(config.rate_hz)) != SUCCESS){
+            break;
+         }
+
+         usec_period = usec_inverse(config.rate_hz);
+
+         /* the rate applies to this open file, it is set first since
+          * the pins can not be changed while sampling periodically */
+         if ((retval = get_client_period(context->client,&old_usec_period)) != SUCCESS ||
+               (retval = set_client_period(context->client,usec_period)) != SUCCESS){
+            break;
+         }
+
+         mutex_lock(&device_lock);
+         retval = set_ranging_config(context->ranging_device,&config);
+         mutex_unlock(&device_lock);
+
+         if (retval != SUCCESS){
+            /* the previous rate was valid, it is set again */
+            set_client_period(context->client,old_usec_period);
+            break;
+         }
+
+         /* the format only applies to this open file */
+         retval = set_file_format(context,config.format);
+         break;
+
+      case HCSR04_IOC_GET_OPEN_STATS:
+         spin_lock_irqsave(&open_stats_lock,flags);
+         memcpy(&open_stats_copy,&open_stats,sizeof(open_stats_copy));
+         spin_unlock_irqrestore(&open_stats_lock,flags);
+
+         if (copy_to_user((void __user *)arg,&open_stats_copy,sizeof(open_stats_copy))){
+            retval = -EFAULT;
+         }
+         break;
+
+      case HCSR04_IOC_GET_PROFILE:
+      case HCSR04_IOC_GET_RESET_PROFILE:
+         if ((retval = get_ranging_profile(context->ranging_device,&profile,
+                     cmd == HCSR04_IOC_GET_RESET_PROFILE)) != SUCCESS){
+            break;
+         }
+
+         if (copy_to_user((void __user *)arg,&profile,sizeof(profile))){
+            retval = -EFAULT;
+         }
+         break;
+
+      case HCSR04_IOC_GET_HISTORY:
+         if (ranging_history == NULL){
+            retval = -ENOTTY;
+            break;
+         }
+
+         if (copy_from_user(&query,(void __user *)arg,sizeof(query))){
+            retval = -EFAULT;
+            break;
+         }
+
+         if ((retval = query_ranging_history(ranging_history,&query)) != SUCCESS){
+            break;
+         }
+
+         if (copy_to_user((void __user *)arg,&query,sizeof(query))){
+            retval = -EFAULT;
+         }
+         break;
+
+      case HCSR04_IOC_SET_EXEC:
+         if (copy_from_user(&exec,(void __user *)arg,sizeof(exec))){
+            retval = -EFAULT;
+            break;
+         }
+
+         retval = set_execution_context(context->ranging_device,&exec);
+         break;
+
+      case HCSR04_IOC_GET_DISPATCH_STATS:
+         if ((retval = get_dispatch_stats(context->ranging_device,&dispatch)) != SUCCESS){
+            break;
+         }
+
+         if (copy_to_user((void __user *)arg,&dispatch,sizeof(dispatch))){
+            retval = -EFAULT;
+         }
+         break;
+
+      case HCSR04_IOC_SET_ONESHOT_READ:
+         if (get_user(on,(__u32 __user *)arg)){
+            retval = -EFAULT;
+            break;
+         }
+
+         context->oneshot_read = (on != 0);
+         break;
+
+      case HCSR04_IOC_SET_WAKEUP:
+         if (copy_from_user(&wakeup,(void __user *)arg,sizeof(wakeup))){
+            retval = -EFAULT;
+            break;
+         }
+
+         retval = set_client_wakeup(context->client,&wakeup);
+         break;
+
+      case HCSR04_IOC_GET_WAKEUP_STATS:
+         if ((retval = get_client_wakeup_stats(context->client,&wakeup_stats)) != SUCCESS){
+            break;
+         }
+
+         if (copy_to_user((void __user *)arg,&wakeup_stats,sizeof(wakeup_stats))){
+            retval = -EFAULT;
+         }
+         break;
+
+      case HCSR04_IOC_SET_FORMAT:
+         if (get_user(format,(__u32 __user *)arg)){
+            retval = -EFAULT;
+            break;
+         }
+
+         retval = set_file_format(context,format);
+         break;
+
+      default:
+         retval = -ENOTTY;
+         break;
+   }
 
+   return retval;
+}
 
+/* stores a writable parameter and applies it to the device,
+ * the parameter is left unchanged when it is out of range or the
+ * device rejects it, whether the device is set up or not */
+static int param_set_live(const char *val, const struct kernel_param *kp)
+{
+   int retval = SUCCESS;
+   unsigned int i;
+   unsigned int value;
+   struct hcsr04_config config;
 
+   if ((retval = kstrtouint(val,0,&value)) != SUCCESS){
+      goto exit_func;
+   }
+
+   mutex_lock(&device_lock);
+
+   if (ranging_device != NULL){
+      get_ranging_config(ranging_device,&config);
+   }
+   else{
+      /* what setup_ranging_device will apply */
+      memset(&config,0x00,sizeof(config));
+      config.trigger_gpio = param_trigger_gpio;
+      config.echo_count = param_echo_gpio_count;
+      for (i = 0; i < param_echo_gpio_count && i < HCSR04_MAX_ECHOES; i++){
+         config.echo_gpio[i] = param_echo_gpio[i];
+      }
+      config.usec_pulse_width = param_usec_pulse_width;
+      config.usec_timeout = param_usec_timeout;
+      config.filter = param_filter;
+   }
+
+   if (kp->arg == &param_usec_pulse_width){
+      config.usec_pulse_width = value;
+   }
+   else if (kp->arg == &param_usec_timeout){
+      config.usec_timeout = value;
+   }
+   else if (kp->arg == &param_filter){
+      config.filter = value;
+   }
+
+   if ((retval = check_ranging_config(&config)) == SUCCESS && ranging_device != NULL){
+      retval = set_ranging_config(ranging_device,&config);
+   }
+
+   if (retval == SUCCESS){
+      *(unsigned int*)kp->arg = value;
+   }
+
+   mutex_unlock(&device_lock);
+
+exit_func:
+   return retval;
+}
+
+/* stores the rate of the files opened later, a rate faster than the
+ * minimum cycle would fail every open and is refused */
+static int param_set_rate(const char *val, const struct kernel_param *kp)
+{
+   int retval = SUCCESS;
+   unsigned int value;
+
+   if ((retval = kstrtouint(val,0,&value)) != SUCCESS ||
+         (retval = check_sample_rate(value)) != SUCCESS){
+      return retval;
+   }
+
+   *(unsigned int*)kp->arg = value;
+   return SUCCESS;
+}
@@ -0,0 +1,528 @@
+/*
+ * A Linux device driver for HC-SR04 Ultrasonic sensor interfaced with Raspberry PI 2 GPIO
+ * Copyright (C) 2016  Jeune Prime M. Origines <primeyo2004@yahoo.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * */
+
+#include <linux/err.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include "hcsr04_history.h"
+
+/* size of a block of the ring, the records of a block are encoded
+ * against its header so that every block can be decoded on its own */
+#define HISTORY_BLOCK_SIZE 512
+
+/* the longest record: the flags, the seq delta, the timestamp and the echo */
+#define HISTORY_MAX_RECORD (1 + 5 + 10 + 10)
+
+/* samples decoded per copy to the user buffer */
+#define HISTORY_COPY_BATCH 8
+
+/* The flags byte that starts every record, followed by
+ *    the seq delta and the zigzag timestamp delta-of-delta in usec,
+ *       unless RECORD_SAME_CYCLE
+ *    the zigzag echo width delta in usec from the previous echo of the
+ *       same channel, for the successful samples only
+ * all of them as LEB128 varints */
+#define RECORD_RESULT_MASK    0x07
+#define RECORD_HEALTH_SHIFT   3
+#define RECORD_HEALTH_MASK    0x18
+#define RECORD_CHANNEL_SHIFT  5
+#define RECORD_CHANNEL_MASK   0x60
+#define RECORD_SAME_CYCLE     0x80   /* same seq and timestamp as the previous record */
+
+struct history_block {
+   u64 first_us;     /* timestamp of the first sample */
+   u64 last_us;      /* timestamp of the last sample */
+   u32 first_seq;
+   u16 count;        /* samples in the block */
+   u16 used;         /* bytes of data in use */
+   u8  data[HISTORY_BLOCK_SIZE - 24];
+};
+
+/* a decoded sample */
+struct history_record {
+   u64 timestamp_us;
+   u32 seq;
+   u32 echo_us;
+   u8  result_code;
+   u8  health;
+   u8  channel;
+};
+
+/* the previous sample the next record is encoded and decoded against */
+struct history_cursor {
+   u64 last_us;
+   s64 last_delta_us;
+   u32 last_seq;
+   u32 last_echo_us[HCSR04_MAX_ECHOES];
+};
+
+struct ranging_history {
+   spinlock_t            lock;
+   struct history_block* blocks;
+   unsigned int          block_count;
+   u32                   head_no;   /* number of the block appended to */
+   u32                   tail_no;   /* number of the oldest block */
+   struct history_cursor cursor;    /* the last sample of the head block */
+};
+
+extern char DEVICE_NAME[];
+
+static unsigned int put_varint(u8* buf, u64 value);
+static bool get_varint(const u8** pos, const u8* end, u64* value);
+static void start_block(struct history_block* block, struct history_cursor* cursor, const struct history_record* record);
+static void reset_cursor(struct history_cursor* cursor, const struct history_block* block);
+static unsigned int encode_record(const struct history_cursor* cursor, const struct history_record* record, u8* buf);
+static bool decode_record(struct history_cursor* cursor, const u8** pos, const u8* end, struct history_record* record);
+static void advance_cursor(struct history_cursor* cursor, const struct history_record* record);
+static u64 ns_to_us_roundup(u64 ns);
+
+
+int init_ranging_history(unsigned int kbytes, void** phistory){
+   int retval = SUCCESS;
+   struct ranging_history* phist = (struct ranging_history*)(*phistory);
+   unsigned int block_count = (kbytes * 1024) / HISTORY_BLOCK_SIZE;
+
+   BUILD_BUG_ON(sizeof(struct history_block) != HISTORY_BLOCK_SIZE);
+   BUILD_BUG_ON(HCSR04_MAX_ECHOES > (RECORD_CHANNEL_MASK >> RECORD_CHANNEL_SHIFT) + 1);
+
+   if (phist != NULL){
+      printk (KERN_ALERT "%s: History may already have been initialized!\n",DEVICE_NAME);
+      retval = -EBADFD;
+      goto exit_func;
+   }
+
+   /* one block is always open for appending */
+   if (block_count < 2){
+      printk (KERN_ALERT "%s: History of %u KB is too small\n",DEVICE_NAME,kbytes);
+      retval = -EINVAL;
+      goto exit_func;
+   }
+
+   if ((phist = kzalloc(sizeof(struct ranging_history),GFP_KERNEL)) == NULL){
+      printk (KERN_ALERT "%s: Unable to allocate memory.\n", DEVICE_NAME);
+      retval = -ENOMEM;
+      goto exit_func;
+   }
+
+   spin_lock_init(&phist->lock);
+   phist->block_count = block_count;
+
+   *phistory = phist;
+
+   if ((phist->blocks = vzalloc(block_count * sizeof(struct history_block))) == NULL){
+      printk (KERN_ALERT "%s: Unable to allocate %u KB of history\n",DEVICE_NAME,kbytes);
+      retval = -ENOMEM;
+      goto exit_func;
+   }
+
+exit_func:
+   if (retval != SUCCESS){
+      release_ranging_history(*phistory);
+      *phistory = NULL;
+   }
+
+   return retval;
+}
+
+int release_ranging_history(void* history){
+   struct ranging_history* phist = (struct ranging_history*)history;
+
+   if (phist == NULL){
+      return SUCCESS;
+   }
+
+   vfree (phist->blocks);
+   kfree (phist);
+
+   return SUCCESS;
+}
+
+/* appends a published sample, the block at the head is sealed once the
+ * record does not fit and the oldest block is overwritten when full */
+void append_ranging_history(void* history, const struct ranging_sample* sample){
+   struct ranging_history* phist = (struct ranging_history*)history;
+   struct history_block* block;
+   struct history_record record;
+   u8 buf[HISTORY_MAX_RECORD];
+   unsigned int length;
+   unsigned long flags;
+
+   if (phist == NULL){
+      return;
+   }
+
+   record.timestamp_us = ktime_to_us(sample->trigger_time);
+   record.seq = sample->seq;
+   record.result_code = sample->result_code;
+   record.health = sample->health;
+   record.channel = sample->channel;
+   record.echo_us = 0;
+
+   if (sample->result_code == RRESULT_SUCCESS){
+      record.echo_us = sample->delta_time.tv_sec * USEC_PER_SEC +
+         sample->delta_time.tv_nsec / NSEC_PER_USEC;
+   }
+
+   local_irq_save(flags);
+   spin_lock(&phist->lock);
+
+   block = &phist->blocks[phist->head_no % phist->block_count];
+
+   if (block->count == 0){
+      start_block(block,&phist->cursor,&record);
+   }
+
+   length = encode_record(&phist->cursor,&record,buf);
+
+   if (block->used + length > sizeof(block->data)){
+      phist->head_no++;
+
+      if (phist->head_no - phist->tail_no >= phist->block_count){
+         phist->tail_no++;
+      }
+
+      block = &phist->blocks[phist->head_no % phist->block_count];
+      start_block(block,&phist->cursor,&record);
+      length = encode_record(&phist->cursor,&record,buf);
+   }
+
+   memcpy(block->data + block->used,buf,length);
+   block->used += length;
+   block->count++;
+   block->last_us = record.timestamp_us;
+
+   advance_cursor(&phist->cursor,&record);
+
+   spin_unlock(&phist->lock);
+   local_irq_restore(flags);
+}
+
+/* The blocks are copied out one at a time under the lock and decoded
+ * without it, a block overwritten in the meantime is skipped */
+int query_ranging_history(void* history, struct hcsr04_history_query* query){
+   int retval = SUCCESS;
+   struct ranging_history* phist = (struct ranging_history*)history;
+   struct hcsr04_sample __user* out = (struct hcsr04_sample __user*)(uintptr_t)query->samples;
+   struct hcsr04_sample batch[HISTORY_COPY_BATCH];
+   struct history_block* block = NULL;
+   struct history_cursor cursor;
+   struct history_record record;
+   const u8* pos;
+   const u8* end;
+   u64 start_us;
+   u64 end_us;
+   u32 block_no;
+   u32 count = 0;          /* samples taken, the batched ones included */
+   u32 copied = 0;         /* samples copied to the user buffer */
+   u32 cycle_count = 0;    /* samples taken of the last cycle */
+   u32 last_seq = 0;
+   u64 last_us = 0;
+   unsigned int batched = 0;
+   unsigned int i;
+   unsigned long flags;
+   bool finished = false;
+
+   if (phist == NULL){
+      printk (KERN_ALERT "%s: Invalid history data!\n",DEVICE_NAME);
+      return -ENOMEM;
+   }
+
+   query->count = 0;
+   query->oldest_ns = 0;
+
+   if (query->max_count == 0 || query->end_ns <= query->start_ns){
+      return -EINVAL;
+   }
+
+   /* a sample of t usec is reported as t * 1000 ns */
+   start_us = ns_to_us_roundup(query->start_ns);
+   end_us = ns_to_us_roundup(query->end_ns);
+
+   if ((block = kmalloc(sizeof(struct history_block),GFP_KERNEL)) == NULL){
+      printk (KERN_ALERT "%s: Unable to allocate memory.\n", DEVICE_NAME);
+      return -ENOMEM;
+   }
+
+   local_irq_save(flags);
+   spin_lock(&phist->lock);
+
+   block_no = phist->tail_no;
+   if (phist->blocks[block_no % phist->block_count].count > 0){
+      query->oldest_ns = phist->blocks[block_no % phist->block_count].first_us * NSEC_PER_USEC;
+   }
+
+   spin_unlock(&phist->lock);
+   local_irq_restore(flags);
+
+   while (!finished){
+
+      local_irq_save(flags);
+      spin_lock(&phist->lock);
+
+      /* the ring has moved past the next block */
+      if ((s32)(block_no - phist->tail_no) < 0){
+         block_no = phist->tail_no;
+      }
+
+      if ((s32)(block_no - phist->head_no) > 0){
+         finished = true;
+      }
+      else{
+         memcpy(block,&phist->blocks[block_no % phist->block_count],sizeof(struct history_block));
+         block_no++;
+      }
+
+      spin_unlock(&phist->lock);
+      local_irq_restore(flags);
+
+      if (finished || block->count == 0 || block->last_us < start_us){
+         continue;
+      }
+
+      if (block->first_us >= end_us){
+         break;
+      }
+
+      reset_cursor(&cursor,block);
+      pos = block->data;
+      end = block->data + block->used;
+
+      for (i = 0; i < block->count && decode_record(&cursor,&pos,end,&record); i++){
+
+         if (record.timestamp_us < start_us){
+            continue;
+         }
+
+         if (record.timestamp_us >= end_us){
+            finished = true;
+            break;
+         }
+
+         /* full, the samples of the last cycle are held back when the
+          * cycle does not fit unless nothing else has been taken */
+         if (count == query->max_count){
+            if (record.seq == last_seq && record.timestamp_us == last_us &&
+                  cycle_count < count){
+               count -= cycle_count;
+            }
+
+            finished = true;
+            break;
+         }
+
+         if (count > 0 && record.seq == last_seq && record.timestamp_us == last_us){
+            cycle_count++;
+         }
+         else{
+            cycle_count = 1;
+            last_seq = record.seq;
+            last_us = record.timestamp_us;
+         }
+
+         if (batched == HISTORY_COPY_BATCH){
+            if (copy_to_user(out + copied,batch,sizeof(batch))){
+               retval = -EFAULT;
+               goto exit_func;
+            }
+
+            copied += batched;
+            batched = 0;
+         }
+
+         memset(&batch[batched],0x00,sizeof(batch[batched]));
+         batch[batched].timestamp_ns = record.timestamp_us * NSEC_PER_USEC;
+         batch[batched].seq = record.seq;
+         batch[batched].echo_ns = record.echo_us * NSEC_PER_USEC;
+         batch[batched].result_code = record.result_code;
+         batch[batched].flags = (record.health & HCSR04_SAMPLE_HEALTH_MASK) |
+            ((record.channel << HCSR04_SAMPLE_CHANNEL_SHIFT) & HCSR04_SAMPLE_CHANNEL_MASK);
+         batched++;
+         count++;
+      }
+   }
+
+   /* the held back samples may already be in the user buffer, only the
+    * count tells what is valid */
+   if (count > copied &&
+         copy_to_user(out + copied,batch,(count - copied) * sizeof(struct hcsr04_sample))){
+      retval = -EFAULT;
+      goto exit_func;
+   }
+
+   query->count = count;
+
+exit_func:
+   kfree(block);
+
+   return retval;
+}
+
+static u64 ns_to_us_roundup(u64 ns){
+   u32 remainder;
+   u64 us = div_u64_rem(ns,NSEC_PER_USEC,&remainder);
+
+   return us + (remainder != 0 ? 1 : 0);
+}
+
+static unsigned int put_varint(u8* buf, u64 value){
+   unsigned int length = 0;
+
+   while (value >= 0x80){
+      buf[length++] = (u8)(value | 0x80);
+      value >>= 7;
+   }
+
+   buf[length++] = (u8)value;
+
+   return length;
+}
+
+static bool get_varint(const u8** pos, const u8* end, u64* value){
+   u64 result = 0;
+   unsigned int shift = 0;
+   u8 byte;
+
+   while (*pos < end && shift < 64){
+      byte = *(*pos)++;
+      result |= (u64)(byte & 0x7F) << shift;
+
+      if (!(byte & 0x80)){
+         *value = result;
+         return true;
+      }
+
+      shift += 7;
+   }
+
+   return false;
+}
+
+/* the signed deltas are folded so that small magnitudes stay short */
+static inline u64 zigzag_encode(s64 value){
+   return ((u64)value << 1) ^ (u64)(value >> 63);
+}
+
+static inline s64 zigzag_decode(u64 value){
+   return (s64)(value >> 1) ^ -(s64)(value & 1);
+}
+
+/* must be called with the lock held */
+static void start_block(struct history_block* block, struct history_cursor* cursor, const struct history_record* record){
+   block->first_us = record->timestamp_us;
+   block->last_us = record->timestamp_us;
+   block->first_seq = record->seq;
+   block->count = 0;
+   block->used = 0;
+
+   reset_cursor(cursor,block);
+}
+
+static void reset_cursor(struct history_cursor* cursor, const struct history_block* block){
+   memset(cursor,0x00,sizeof(*cursor));
+   cursor->last_us = block->first_us;
+   cursor->last_seq = block->first_seq;
+}
+
+static unsigned int encode_record(const struct history_cursor* cursor, const struct history_record* record, u8* buf){
+   unsigned int length = 1;
+   s64 delta_us;
+
+   buf[0] = (record->result_code & RECORD_RESULT_MASK) |
+      ((record->health << RECORD_HEALTH_SHIFT) & RECORD_HEALTH_MASK) |
+      ((record->channel << RECORD_CHANNEL_SHIFT) & RECORD_CHANNEL_MASK);
+
+   if (record->seq == cursor->last_seq && record->timestamp_us == cursor->last_us){
+      buf[0] |= RECORD_SAME_CYCLE;
+   }
+   else{
+      /* a steady rate leaves the jitter only */
+      delta_us = (s64)(record->timestamp_us - cursor->last_us);
+      length += put_varint(buf + length,(u32)(record->seq - cursor->last_seq));
+      length += put_varint(buf + length,zigzag_encode(delta_us - cursor->last_delta_us));
+   }
+
+   if (record->result_code == RRESULT_SUCCESS){
+      length += put_varint(buf + length,
+            zigzag_encode((s64)record->echo_us - cursor->last_echo_us[record->channel]));
+   }
+
+   return length;
+}
+
+static bool decode_record(struct history_cursor* cursor, const u8** pos, const u8* end, struct history_record* record){
+   u64 value;
+   u8 flags;
+
+   if (*pos >= end){
+      return false;
+   }
+
+   flags = *(*pos)++;
+
+   record->result_code = flags & RECORD_RESULT_MASK;
+   record->health = (flags & RECORD_HEALTH_MASK) >> RECORD_HEALTH_SHIFT;
+   record->channel = (flags & RECORD_CHANNEL_MASK) >> RECORD_CHANNEL_SHIFT;
+   record->seq = cursor->last_seq;
+   record->timestamp_us = cursor->last_us;
+   record->echo_us = 0;
+
+   if (!(flags & RECORD_SAME_CYCLE)){
+      if (!get_varint(pos,end,&value)){
+         return false;
+      }
+
+      record->seq += (u32)value;
+
+      if (!get_varint(pos,end,&value)){
+         return false;
+      }
+
+      record->timestamp_us += cursor->last_delta_us + zigzag_decode(value);
+   }
+
+   if (record->result_code == RRESULT_SUCCESS){
+      if (!get_varint(pos,end,&value)){
+         return false;
+      }
+
+      record->echo_us = (u32)(cursor->last_echo_us[record->channel] + zigzag_decode(value));
+   }
+
+   advance_cursor(cursor,record);
+
+   return true;
+}
+
+/* shared by the encoder and the decoder so that both sides agree */
+static void advance_cursor(struct history_cursor* cursor, const struct history_record* record){
+   if (record->seq != cursor->last_seq || record->timestamp_us != cursor->last_us){
+      cursor->last_delta_us = (s64)(record->timestamp_us - cursor->last_us);
+      cursor->last_us = record->timestamp_us;
+      cursor->last_seq = record->seq;
+   }
+
+   if (record->result_code == RRESULT_SUCCESS){
+      cursor->last_echo_us[record->channel] = record->echo_us;
+   }
+}
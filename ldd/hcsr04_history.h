@@ -0,0 +1,42 @@
+/*
+ * A Linux device driver for HC-SR04 Ultrasonic sensor interfaced with Raspberry PI 2 GPIO
+ * Copyright (C) 2016  Jeune Prime M. Origines <primeyo2004@yahoo.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * */
+
+#ifndef __HCSR04_HISTORY_H
+#define __HCSR04_HISTORY_H
+
+#include "hcsr04_async_device.h"
+
+
+/* A long term history of the published samples, delta encoded in fixed
+ * size blocks of a ring that overwrites the oldest block once full.
+ * The timestamps and the echo widths are kept with 1 usec resolution */
+
+extern int init_ranging_history(unsigned int kbytes, void** phistory);
+
+extern int release_ranging_history(void* history);
+
+/* may be called from the tasklet */
+extern void append_ranging_history(void* history, const struct ranging_sample* sample);
+
+/* copies the samples of [query->start_ns, query->end_ns) to the user
+ * buffer query->samples, see HCSR04_IOC_GET_HISTORY */
+extern int query_ranging_history(void* history, struct hcsr04_history_query* query);
+
+
+#endif
@@ -0,0 +1,234 @@
+/*
+ * A Linux device driver for HC-SR04 Ultrasonic sensor interfaced with Raspberry PI 2 GPIO
+ * Copyright (C) 2016  Jeune Prime M. Origines <primeyo2004@yahoo.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * */
+
+/* ioctl interface of /dev/hcsr04_driver, shared by the driver and
+ * userspace applications */
+
+#ifndef __HCSR04_IOCTL_H
+#define __HCSR04_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define HCSR04_IOC_MAGIC 'h'
+
+/* echo lines sharing a single trigger line, every trigger pulse yields
+ * one sample per echo */
+#define HCSR04_MAX_ECHOES  4
+
+/* result codes, the same as the first field of the text format */
+#define HCSR04_RESULT_SUCCESS      0
+#define HCSR04_RESULT_IN_PROGRESS  1
+#define HCSR04_RESULT_TIMEDOUT     2
+#define HCSR04_RESULT_NOT_STARTED  3
+#define HCSR04_RESULT_UNKNOWN      4
+
+/* the data format returned by read() */
+#define HCSR04_FORMAT_TEXT    0   /* "<result code>,<sec>:<nsec>,<distance in cm * 100>\n" */
+#define HCSR04_FORMAT_BINARY  1   /* an array of struct hcsr04_sample */
+#define HCSR04_FORMAT_EDGES   2   /* an array of struct hcsr04_edge, raw edge capture */
+
+/* a measurement in the binary format */
+struct hcsr04_sample {
+   __u64 timestamp_ns;    /* CLOCK_MONOTONIC time of the trigger pulse */
+   __u32 seq;             /* sample sequence number, a gap means dropped samples */
+   __u32 echo_ns;         /* width of the echo pulse, 0 unless successful */
+   __u32 result_code;     /* HCSR04_RESULT_* */
+   __u32 flags;           /* HCSR04_SAMPLE_HEALTH_MASK: HCSR04_HEALTH_* after this cycle
+                           * HCSR04_SAMPLE_CHANNEL_MASK: index of the echo line */
+};
+
+#define HCSR04_SAMPLE_HEALTH_MASK   0x03
+#define HCSR04_SAMPLE_CHANNEL_MASK  0xFF00
+#define HCSR04_SAMPLE_CHANNEL_SHIFT 8
+
+/* A raw edge of the edge capture mode. While any open file reads in
+ * HCSR04_FORMAT_EDGES every trigger and echo edge is recorded as is and
+ * the cycles run until the timeout, no samples are produced */
+struct hcsr04_edge {
+   __u64 timestamp_ns;    /* CLOCK_MONOTONIC time of the edge */
+   __u32 seq;             /* sequence number of the cycle */
+   __u8  source;          /* echo index or HCSR04_EDGE_SRC_TRIGGER */
+   __u8  level;           /* level of the line after the edge */
+   __u16 reserved;
+};
+
+#define HCSR04_EDGE_SRC_TRIGGER  0x80
+
+/* health of the sensor */
+#define HCSR04_HEALTH_OK        0   /* the last cycle succeeded */
+#define HCSR04_HEALTH_DEGRADED  1   /* recent cycles failed */
+#define HCSR04_HEALTH_FAILED    2   /* consecutive cycles failed, the triggers are backed off */
+
+struct hcsr04_health {
+   __u32 state;                /* HCSR04_HEALTH_* */
+   __u32 consecutive_failures;
+   __u32 backoff_usec;         /* minimum time between the triggers, 0 when healthy */
+   __u32 reserved;
+   __u64 timeouts;             /* cycles without an echo */
+   __u64 stuck_echoes;         /* cycles aborted since the echo line was still high */
+   __u64 invalid_states;       /* cycles aborted on an unexpected controller state */
+   __u64 backoff_skips;        /* periodic or external triggers dropped during the back-off */
+};
+
+/* measurement statistics of the device */
+struct hcsr04_stats {
+   __u64 slots;           /* periodic slots elapsed */
+   __u64 missed_slots;    /* slots skipped since the previous cycle was still running */
+   __u64 jitter_sum_ns;   /* sum of the trigger time deviation from its slot */
+   __u64 jitter_max_ns;   /* worst trigger time deviation from its slot */
+   __u64 dropped_samples; /* queued samples overwritten before they were read */
+   __u64 ext_triggers;        /* external trigger events */
+   __u64 missed_ext_triggers; /* external trigger events during a cycle in progress */
+   __u64 latency_sum_ns;      /* sum of the external trigger to pulse latency */
+   __u64 latency_max_ns;      /* worst external trigger to pulse latency */
+   __u64 dropped_edges;       /* captured edges lost since the ring was full */
+   __u64 stray_edges;         /* echo edges outside of a triggered cycle, ignored */
+};
+
+/* edges of the external trigger gpio */
+#define HCSR04_EDGE_RISING   0x01
+#define HCSR04_EDGE_FALLING  0x02
+
+struct hcsr04_ext_trigger {
+   __s32 gpio;            /* negative to turn the external trigger off */
+   __u32 edges;           /* HCSR04_EDGE_* flags */
+};
+
+/* filters applied on the echo width of the successful samples */
+#define HCSR04_FILTER_NONE     0
+#define HCSR04_FILTER_MEDIAN3  1   /* median of the last three */
+
+/* runtime configuration, applied between the measurements */
+struct hcsr04_config {
+   __u32 trigger_gpio;        /* the pins can only be changed while idle */
+   __u32 echo_count;          /* 1 to HCSR04_MAX_ECHOES */
+   __u32 echo_gpio[HCSR04_MAX_ECHOES];
+   __u32 usec_pulse_width;
+   __u32 usec_timeout;
+   __u32 rate_hz;             /* of this open file, 0 for ranging on demand */
+   __u32 filter;              /* HCSR04_FILTER_* */
+   __u32 format;              /* HCSR04_FORMAT_* of this open file */
+};
+
+/* open() statistics of the driver, the device is set up on the first open */
+struct hcsr04_open_stats {
+   __u64 opens;
+   __u64 open_ns_sum;     /* time spent in open(), the setup excluded */
+   __u64 open_ns_max;
+   __u64 setup_ns;        /* time of the gpio/irq setup of the first open */
+};
+
+/* run time of a handler */
+struct hcsr04_handler_profile {
+   __u64 count;
+   __u64 ns_sum;
+   __u64 ns_max;
+};
+
+/* handler timing of a driver built with HCSR04_PROFILE */
+struct hcsr04_profile {
+   struct hcsr04_handler_profile irq;      /* echo interrupt handler */
+   struct hcsr04_handler_profile tasklet;  /* controller, in any context but HCSR04_EXEC_HARDIRQ
+                                            * which is timed as part of its caller */
+   struct hcsr04_handler_profile timer;    /* operation timer */
+   __u64 spurious_edges;                   /* echo edges outside of a rise/fall pair, all echoes */
+};
+
+/* the context the controller of the device runs in */
+#define HCSR04_EXEC_TASKLET    0   /* a tasklet (softirq), the default */
+#define HCSR04_EXEC_HARDIRQ    1   /* inline in the interrupt or timer that advances it */
+#define HCSR04_EXEC_WORKQUEUE  2   /* the high priority system workqueue */
+#define HCSR04_EXEC_THREAD     3   /* a kernel thread of the device at a SCHED_FIFO priority */
+
+struct hcsr04_exec {
+   __u32 context;         /* HCSR04_EXEC_* */
+   __u32 priority;        /* SCHED_FIFO priority 1-99 of HCSR04_EXEC_THREAD */
+};
+
+/* timing of the execution context, restarted by HCSR04_IOC_SET_EXEC */
+struct hcsr04_dispatch_stats {
+   __u32 context;             /* HCSR04_EXEC_* in use */
+   __u32 priority;
+   __u64 dispatches;          /* controller runs */
+   __u64 latency_ns_sum;      /* sum of the time from the request to the controller run */
+   __u64 latency_ns_max;
+   __u64 timer_fires;         /* operation timer callbacks */
+   __u64 timer_late_ns_sum;   /* sum of the time past the expiry of the operation timer */
+   __u64 timer_late_ns_max;
+};
+
+/* Wakeup moderation of an open file: its reader is woken once batch
+ * samples are queued or usec_budget after the first of them, whichever
+ * comes first. read() and poll() hold the samples back until then */
+struct hcsr04_wakeup {
+   __u32 batch;           /* 1 (every cycle) to 64 samples */
+   __u32 usec_budget;     /* 0 for no latency budget */
+};
+
+struct hcsr04_wakeup_stats {
+   __u32 batch;
+   __u32 usec_budget;
+   __u64 samples;         /* samples queued to the file */
+   __u64 wakeups;
+   __u64 batch_wakeups;   /* on reaching the batch, or with no more samples expected */
+   __u64 budget_wakeups;  /* on the expiry of the latency budget */
+};
+
+/* A time range query of the sample history. The samples are returned
+ * oldest first with 1 usec resolution and the samples of a trigger pulse
+ * are never split, a query that fills the buffer is continued with
+ * start_ns past the timestamp of the last returned sample */
+struct hcsr04_history_query {
+   __u64 start_ns;        /* CLOCK_MONOTONIC, inclusive */
+   __u64 end_ns;          /* exclusive */
+   __u64 samples;         /* user pointer to an array of struct hcsr04_sample */
+   __u32 max_count;       /* size of the array */
+   __u32 count;           /* out: the samples returned */
+   __u64 oldest_ns;       /* out: the oldest sample still held, 0 when empty */
+};
+
+/* sample rate in Hz of the open file, 0 turns its periodic sampling off.
+ * The device runs at the highest rate of the open files. A rate above
+ * 16 Hz, faster than the 60ms cycle of the datasheet, fails with EINVAL */
+#define HCSR04_IOC_SET_RATE   _IOW(HCSR04_IOC_MAGIC, 1, __u32)
+#define HCSR04_IOC_GET_RATE   _IOR(HCSR04_IOC_MAGIC, 2, __u32)
+#define HCSR04_IOC_GET_STATS  _IOR(HCSR04_IOC_MAGIC, 3, struct hcsr04_stats)
+#define HCSR04_IOC_SET_EXT_TRIGGER _IOW(HCSR04_IOC_MAGIC, 4, struct hcsr04_ext_trigger)
+/* HCSR04_FORMAT_* of the open file */
+#define HCSR04_IOC_SET_FORMAT _IOW(HCSR04_IOC_MAGIC, 5, __u32)
+#define HCSR04_IOC_GET_HEALTH _IOR(HCSR04_IOC_MAGIC, 6, struct hcsr04_health)
+#define HCSR04_IOC_GET_CONFIG _IOR(HCSR04_IOC_MAGIC, 7, struct hcsr04_config)
+#define HCSR04_IOC_SET_CONFIG _IOW(HCSR04_IOC_MAGIC, 8, struct hcsr04_config)
+#define HCSR04_IOC_GET_OPEN_STATS _IOR(HCSR04_IOC_MAGIC, 9, struct hcsr04_open_stats)
+/* ENOTTY unless the driver is built with HCSR04_PROFILE, the reset variant
+ * clears the timing after the copy */
+#define HCSR04_IOC_GET_PROFILE       _IOR(HCSR04_IOC_MAGIC, 10, struct hcsr04_profile)
+#define HCSR04_IOC_GET_RESET_PROFILE _IOR(HCSR04_IOC_MAGIC, 11, struct hcsr04_profile)
+/* ENOTTY when the history is turned off with param_history_kb=0 */
+#define HCSR04_IOC_GET_HISTORY       _IOWR(HCSR04_IOC_MAGIC, 12, struct hcsr04_history_query)
+#define HCSR04_IOC_SET_EXEC          _IOW(HCSR04_IOC_MAGIC, 13, struct hcsr04_exec)
+#define HCSR04_IOC_GET_DISPATCH_STATS _IOR(HCSR04_IOC_MAGIC, 14, struct hcsr04_dispatch_stats)
+/* non-zero to have read() of an on demand file start the ranging by
+ * itself when nothing is queued, no write() needed */
+#define HCSR04_IOC_SET_ONESHOT_READ  _IOW(HCSR04_IOC_MAGIC, 15, __u32)
+#define HCSR04_IOC_SET_WAKEUP        _IOW(HCSR04_IOC_MAGIC, 16, struct hcsr04_wakeup)
+#define HCSR04_IOC_GET_WAKEUP_STATS  _IOR(HCSR04_IOC_MAGIC, 17, struct hcsr04_wakeup_stats)
+
+#endif
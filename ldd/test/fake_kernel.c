@@ -0,0 +1,677 @@
+/*
+ * HC-SR04 Linux device driver, userspace test harness
+ * Copyright (C) 2016  Jeune Prime M. Origines <primeyo2004@yahoo.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * */
+
+#include "fake_kernel.h"
+
+#define FAKE_IRQ_BASE    100
+#define FAKE_MAX_TIMERS  32
+#define FAKE_MAX_PENDING 32
+#define FAKE_MAX_THREADS 4
+
+bool fake_verbose = false;
+bool fake_racing_cancel = false;
+struct workqueue_struct* system_highpri_wq = NULL;
+
+struct fake_gpio {
+   bool         requested;
+   int          level;
+   unsigned int rises;
+   ktime_t      last_rise;
+   ktime_t      last_fall;
+   irq_handler_t handler;
+   unsigned long irq_flags;
+   void*        dev;
+};
+
+static ktime_t fake_clock;
+static struct fake_gpio gpios[FAKE_GPIO_COUNT];
+
+/* the queued timers, unordered */
+static struct hrtimer* timers[FAKE_MAX_TIMERS];
+static unsigned int timer_count;
+
+/* the tasklets and work items in the order they were scheduled */
+static struct tasklet_struct* tasklets[FAKE_MAX_PENDING];
+static unsigned int tasklet_count;
+static struct work_struct* works[FAKE_MAX_PENDING];
+static unsigned int work_count;
+
+struct task_struct {
+   int          (*fn)(void*);
+   void*        data;
+   unsigned int stop_checks;   /* of kthread_should_stop() in the current pass */
+};
+
+static struct task_struct* threads[FAKE_MAX_THREADS];
+static unsigned int thread_count;
+static struct task_struct* current_thread;
+
+/* the wakeups of any wait queue, the threads run a pass on a change */
+static unsigned int wakeups;
+static unsigned int wakeups_seen;
+
+static unsigned int spin_depth;
+static unsigned int irq_depth;
+static unsigned int atomic_depth;   /* in a timer, an interrupt or a tasklet */
+static unsigned int violations;
+
+static struct fake_handler_stats handler_stats;
+
+static void violation(const char* fmt,...){
+   va_list args;
+
+   va_start(args,fmt);
+   fprintf(stderr,"   locking rule: ");
+   vfprintf(stderr,fmt,args);
+   fprintf(stderr,"\n");
+   va_end(args);
+
+   violations++;
+}
+
+static u64 real_ns(void){
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC,&ts);
+   return (u64)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void account(struct fake_handler_timing* timing,u64 start){
+   u64 elapsed = real_ns() - start;
+
+   timing->count++;
+   timing->ns_sum += elapsed;
+   if (elapsed > timing->ns_max){
+      timing->ns_max = elapsed;
+   }
+}
+
+void fake_reset(void){
+   unsigned int i;
+
+   /* the threads left running by a failed test */
+   for (i = 0; i < thread_count; i++){
+      free(threads[i]);
+   }
+   thread_count = 0;
+   current_thread = NULL;
+   wakeups = 0;
+   wakeups_seen = 0;
+
+   fake_clock = ktime_set(1,0);
+   memset(gpios,0x00,sizeof(gpios));
+   timer_count = 0;
+   tasklet_count = 0;
+   work_count = 0;
+   spin_depth = 0;
+   irq_depth = 0;
+   atomic_depth = 0;
+   violations = 0;
+   fake_racing_cancel = false;
+   memset(&handler_stats,0x00,sizeof(handler_stats));
+}
+
+ktime_t ktime_get(void){
+   return fake_clock;
+}
+
+ktime_t fake_now(void){
+   return fake_clock;
+}
+
+void fake_timestamp(struct timespec* ts){
+   *ts = ns_to_timespec(fake_clock);
+}
+
+/* ======================== */
+/* locking */
+
+void fake_might_sleep(const char* what){
+   if (spin_depth != 0 || irq_depth != 0){
+      violation("%s may sleep, called with a spinlock held or the interrupts off",what);
+   }
+   else if (atomic_depth != 0){
+      violation("%s may sleep, called from a timer, an interrupt or a tasklet",what);
+   }
+}
+
+void fake_spin_lock(spinlock_t* lock){
+   if (lock->held){
+      violation("recursive spin_lock, a deadlock on the target");
+   }
+   lock->held++;
+   spin_depth++;
+}
+
+void fake_spin_unlock(spinlock_t* lock){
+   if (!lock->held){
+      violation("spin_unlock of a lock not held");
+      return;
+   }
+   lock->held--;
+   spin_depth--;
+}
+
+unsigned long fake_irq_save(void){
+   return irq_depth++;
+}
+
+void fake_irq_restore(unsigned long flags){
+   irq_depth = flags;
+}
+
+void fake_mutex_lock(struct mutex* lock){
+   fake_might_sleep("mutex_lock");
+
+   if (lock->held){
+      violation("recursive mutex_lock, a deadlock on the target");
+   }
+   lock->held = 1;
+}
+
+unsigned int fake_take_violations(void){
+   unsigned int count = violations;
+
+   violations = 0;
+   return count;
+}
+
+/* ======================== */
+/* timers */
+
+static void dequeue_timer(struct hrtimer* timer){
+   unsigned int i;
+
+   for (i = 0; i < timer_count; i++){
+      if (timers[i] == timer){
+         timers[i] = timers[--timer_count];
+         break;
+      }
+   }
+   timer->queued = false;
+}
+
+void fake_hrtimer_start(struct hrtimer* timer,ktime_t time,enum hrtimer_mode mode){
+   timer->expires = (mode == HRTIMER_MODE_REL ? ktime_add(fake_clock,time) : time);
+
+   if (timer->queued){
+      return;
+   }
+
+   if (timer_count == FAKE_MAX_TIMERS){
+      fprintf(stderr,"fake_kernel: too many timers\n");
+      abort();
+   }
+
+   timers[timer_count++] = timer;
+   timer->queued = true;
+}
+
+int fake_hrtimer_try_to_cancel(struct hrtimer* timer){
+   if (timer->running){
+      return -1;
+   }
+   if (!timer->queued){
+      return 0;
+   }
+   dequeue_timer(timer);
+   return 1;
+}
+
+static enum hrtimer_restart run_timer_callback(struct hrtimer* timer){
+   enum hrtimer_restart restart;
+   u64 start;
+
+   timer->running = true;
+
+   atomic_depth++;
+   start = real_ns();
+   restart = timer->function(timer);
+   account(&handler_stats.timer,start);
+   atomic_depth--;
+
+   timer->running = false;
+
+   return restart;
+}
+
+int fake_hrtimer_cancel(struct hrtimer* timer){
+   int was_queued = timer->queued;
+
+   /* waits for a running callback on the target */
+   fake_might_sleep("hrtimer_cancel");
+
+   if (timer->queued && fake_racing_cancel){
+      /* the callback had just started on another CPU */
+      dequeue_timer(timer);
+      run_timer_callback(timer);
+   }
+
+   /* a callback rearming its timer is cancelled again */
+   if (timer->queued){
+      dequeue_timer(timer);
+   }
+   return was_queued;
+}
+
+u64 hrtimer_forward(struct hrtimer* timer,ktime_t now,ktime_t interval){
+   u64 overruns;
+
+   if (now < timer->expires){
+      return 0;
+   }
+
+   overruns = (now - timer->expires) / interval + 1;
+   timer->expires += overruns * interval;
+
+   return overruns;
+}
+
+unsigned int fake_timers_queued(void){
+   return timer_count;
+}
+
+static struct hrtimer* next_timer(void){
+   struct hrtimer* next = NULL;
+   unsigned int i;
+
+   for (i = 0; i < timer_count; i++){
+      if (next == NULL || timers[i]->expires < next->expires){
+         next = timers[i];
+      }
+   }
+   return next;
+}
+
+static void fire_timer(struct hrtimer* timer){
+   enum hrtimer_restart restart;
+
+   if (timer->expires > fake_clock){
+      fake_clock = timer->expires;
+   }
+
+   dequeue_timer(timer);
+   restart = run_timer_callback(timer);
+
+   /* a callback that armed its own timer keeps it armed */
+   if (restart == HRTIMER_RESTART && !timer->queued){
+      fake_hrtimer_start(timer,timer->expires,HRTIMER_MODE_ABS);
+   }
+
+   fake_run_softirqs();
+}
+
+bool fake_fire_next_timer(void){
+   struct hrtimer* timer;
+
+   fake_run_softirqs();
+
+   if ((timer = next_timer()) == NULL){
+      return false;
+   }
+
+   fire_timer(timer);
+   return true;
+}
+
+void fake_advance_us(s64 usec){
+   ktime_t until = ktime_add_us(fake_clock,usec);
+   struct hrtimer* timer;
+
+   fake_run_softirqs();
+
+   while ((timer = next_timer()) != NULL && timer->expires <= until){
+      fire_timer(timer);
+   }
+
+   fake_clock = until;
+}
+
+/* ======================== */
+/* kernel threads */
+
+struct task_struct* kthread_run(int (*fn)(void*),void* data,const char* fmt,...){
+   struct task_struct* thread;
+
+   fake_might_sleep("kthread_run");
+
+   if (thread_count == FAKE_MAX_THREADS){
+      return (struct task_struct*)ERR_PTR(-ENOMEM);
+   }
+
+   if ((thread = calloc(1,sizeof(*thread))) == NULL){
+      return (struct task_struct*)ERR_PTR(-ENOMEM);
+   }
+
+   thread->fn = fn;
+   thread->data = data;
+   threads[thread_count++] = thread;
+
+   /* the first pass finds nothing to do and goes to sleep */
+   wakeups++;
+   return thread;
+}
+
+int kthread_stop(struct task_struct* thread){
+   unsigned int i;
+
+   fake_might_sleep("kthread_stop");
+
+   for (i = 0; i < thread_count; i++){
+      if (threads[i] == thread){
+         threads[i] = threads[--thread_count];
+         free(thread);
+         return 0;
+      }
+   }
+
+   violation("kthread_stop of a thread not running");
+   return -EINVAL;
+}
+
+bool kthread_should_stop(void){
+   return current_thread == NULL || current_thread->stop_checks++ != 0;
+}
+
+void fake_wake_up(wait_queue_head_t* wq){
+   wq->wakeups++;
+   wakeups++;
+}
+
+unsigned int fake_threads_running(void){
+   return thread_count;
+}
+
+/* a pass of the loop of every thread, they sleep in process context */
+static void run_threads(void){
+   unsigned int i;
+   u64 start;
+
+   wakeups_seen = wakeups;
+
+   for (i = 0; i < thread_count; i++){
+      current_thread = threads[i];
+      current_thread->stop_checks = 0;
+
+      start = real_ns();
+      current_thread->fn(current_thread->data);
+      account(&handler_stats.softirq,start);
+
+      current_thread = NULL;
+   }
+}
+
+/* ======================== */
+/* tasklets and work items */
+
+void fake_tasklet_schedule(struct tasklet_struct* tasklet){
+   if (tasklet->scheduled){
+      return;
+   }
+   tasklet->scheduled = true;
+   tasklets[tasklet_count++] = tasklet;
+}
+
+bool fake_queue_work(struct work_struct* work){
+   if (work->queued){
+      return false;
+   }
+   work->queued = true;
+   works[work_count++] = work;
+   return true;
+}
+
+/* a killed tasklet or a cancelled work item leaves its queue, its device
+ * may be freed next */
+void fake_tasklet_kill(struct tasklet_struct* tasklet){
+   unsigned int i;
+   unsigned int n = 0;
+   u64 start;
+
+   fake_might_sleep("tasklet_kill");
+
+   /* a scheduled tasklet is waited for, it runs on another CPU */
+   if (tasklet->scheduled && fake_racing_cancel){
+      atomic_depth++;
+      start = real_ns();
+      tasklet->func(tasklet->data);
+      account(&handler_stats.softirq,start);
+      atomic_depth--;
+   }
+
+   for (i = 0; i < tasklet_count; i++){
+      if (tasklets[i] != tasklet){
+         tasklets[n++] = tasklets[i];
+      }
+   }
+   tasklet_count = n;
+   tasklet->scheduled = false;
+}
+
+void fake_cancel_work_sync(struct work_struct* work){
+   unsigned int i;
+   unsigned int n = 0;
+
+   fake_might_sleep("cancel_work_sync");
+
+   for (i = 0; i < work_count; i++){
+      if (works[i] != work){
+         works[n++] = works[i];
+      }
+   }
+   work_count = n;
+   work->queued = false;
+}
+
+void fake_run_softirqs(void){
+   struct tasklet_struct* tasklet;
+   struct work_struct* work;
+   unsigned int i;
+   u64 start;
+
+   /* a run may schedule the next one */
+   while (tasklet_count != 0 || work_count != 0 || wakeups != wakeups_seen){
+
+      if (tasklet_count != 0){
+         tasklet = tasklets[0];
+         for (i = 1; i < tasklet_count; i++){
+            tasklets[i - 1] = tasklets[i];
+         }
+         tasklet_count--;
+         tasklet->scheduled = false;
+
+         atomic_depth++;
+         start = real_ns();
+         tasklet->func(tasklet->data);
+         account(&handler_stats.softirq,start);
+         atomic_depth--;
+         continue;
+      }
+
+      if (work_count != 0){
+         work = works[0];
+         for (i = 1; i < work_count; i++){
+            works[i - 1] = works[i];
+         }
+         work_count--;
+         work->queued = false;
+
+         start = real_ns();
+         work->func(work);
+         account(&handler_stats.softirq,start);
+         continue;
+      }
+
+      run_threads();
+   }
+}
+
+/* ======================== */
+/* gpio and interrupts */
+
+/* a pin out of range, e.g. INVALID_GPIO_NUM, is a violation and gets
+ * a scratch pin */
+static struct fake_gpio* lookup_gpio(unsigned int gpio){
+   static struct fake_gpio no_gpio;
+
+   if (gpio >= FAKE_GPIO_COUNT){
+      violation("no gpio %u",gpio);
+      memset(&no_gpio,0x00,sizeof(no_gpio));
+      return &no_gpio;
+   }
+   return &gpios[gpio];
+}
+
+int gpio_request_one(unsigned int gpio,unsigned long flags,const char* label){
+   struct fake_gpio* pin;
+
+   fake_might_sleep("gpio_request_one");
+
+   if (gpio >= FAKE_GPIO_COUNT){
+      return -EINVAL;
+   }
+
+   pin = lookup_gpio(gpio);
+   if (pin->requested){
+      return -EBUSY;
+   }
+
+   pin->requested = true;
+   return 0;
+}
+
+void gpio_free(unsigned int gpio){
+   fake_might_sleep("gpio_free");
+   lookup_gpio(gpio)->requested = false;
+}
+
+int gpio_to_irq(unsigned int gpio){
+   return FAKE_IRQ_BASE + gpio;
+}
+
+int request_irq(unsigned int irq,irq_handler_t handler,unsigned long flags,const char* name,void* dev){
+   struct fake_gpio* pin = lookup_gpio(irq - FAKE_IRQ_BASE);
+
+   fake_might_sleep("request_irq");
+
+   if (pin->handler != NULL){
+      return -EBUSY;
+   }
+
+   pin->handler = handler;
+   pin->irq_flags = flags;
+   pin->dev = dev;
+   return 0;
+}
+
+void free_irq(unsigned int irq,void* dev){
+   struct fake_gpio* pin = lookup_gpio(irq - FAKE_IRQ_BASE);
+
+   fake_might_sleep("free_irq");
+
+   if (pin->dev != dev){
+      violation("free_irq of irq %u with another dev_id",irq);
+      return;
+   }
+
+   pin->handler = NULL;
+   pin->dev = NULL;
+}
+
+int fake_gpio_get(unsigned int gpio){
+   struct fake_gpio* pin = lookup_gpio(gpio);
+
+   if (!pin->requested){
+      violation("gpio %u read without being requested",gpio);
+   }
+
+   return pin->level;
+}
+
+int fake_gpio_level(unsigned int gpio){
+   return lookup_gpio(gpio)->level;
+}
+
+void fake_gpio_set(unsigned int gpio,int value){
+   struct fake_gpio* pin = lookup_gpio(gpio);
+
+   if (!pin->requested){
+      violation("gpio %u driven without being requested",gpio);
+   }
+
+   if (value && !pin->level){
+      pin->rises++;
+      pin->last_rise = fake_clock;
+   }
+   else if (!value && pin->level){
+      pin->last_fall = fake_clock;
+   }
+
+   pin->level = (value != 0);
+}
+
+bool fake_gpio_requested(unsigned int gpio){
+   return lookup_gpio(gpio)->requested;
+}
+
+bool fake_irq_requested(unsigned int gpio){
+   return lookup_gpio(gpio)->handler != NULL;
+}
+
+unsigned int fake_gpio_rises(unsigned int gpio){
+   return lookup_gpio(gpio)->rises;
+}
+
+ktime_t fake_gpio_last_rise(unsigned int gpio){
+   return lookup_gpio(gpio)->last_rise;
+}
+
+ktime_t fake_gpio_last_fall(unsigned int gpio){
+   return lookup_gpio(gpio)->last_fall;
+}
+
+void fake_edge(unsigned int gpio,int level){
+   struct fake_gpio* pin = lookup_gpio(gpio);
+   u64 start;
+
+   level = (level != 0);
+
+   if (pin->level == level){
+      return;
+   }
+
+   pin->level = level;
+
+   /* only the edges the interrupt was requested for */
+   if (pin->handler != NULL &&
+         (pin->irq_flags & (level ? IRQF_TRIGGER_RISING : IRQF_TRIGGER_FALLING))){
+      atomic_depth++;
+      start = real_ns();
+      pin->handler(gpio_to_irq(gpio),pin->dev);
+      account(&handler_stats.irq,start);
+      atomic_depth--;
+   }
+
+   fake_run_softirqs();
+}
+
+void fake_take_handler_stats(struct fake_handler_stats* stats){
+   *stats = handler_stats;
+   memset(&handler_stats,0x00,sizeof(handler_stats));
+}
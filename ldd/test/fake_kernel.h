@@ -0,0 +1,405 @@
+/*
+ * HC-SR04 Linux device driver, userspace test harness
+ * Copyright (C) 2016  Jeune Prime M. Origines <primeyo2004@yahoo.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * */
+
+/* Just enough of the kernel to build hcsr04_async_device.c and
+ * hcsr04_history.c as a userspace program. Time only moves when the test
+ * says so, the timers, the tasklets, the work items and the kernel threads
+ * run from fake_advance_us() and fake_fire_next_timer(),
+ * the interrupts from fake_edge(). The locking rules are checked: a
+ * recursive spin_lock() or a sleeping call under a spinlock is reported
+ * as a failure of the running test */
+
+#ifndef __HCSR04_FAKE_KERNEL_H
+#define __HCSR04_FAKE_KERNEL_H
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <linux/types.h>
+
+typedef uint8_t  u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int32_t  s32;
+typedef int64_t  s64;
+
+#define ERESTARTSYS 512
+
+#define __user
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+#define container_of(ptr,type,member) \
+   ((type*)((char*)(ptr) - offsetof(type,member)))
+
+#define min(a,b) ({ __typeof__(a) __a = (a); __typeof__(b) __b = (b); __a < __b ? __a : __b; })
+#define max(a,b) ({ __typeof__(a) __a = (a); __typeof__(b) __b = (b); __a > __b ? __a : __b; })
+
+#define MAX_ERRNO 4095
+#define IS_ERR(ptr)  ((unsigned long)(ptr) >= (unsigned long)-MAX_ERRNO)
+#define PTR_ERR(ptr) ((long)(ptr))
+#define ERR_PTR(err) ((void*)(long)(err))
+
+/* printk, quiet unless fake_verbose */
+#define KERN_ALERT   ""
+#define KERN_WARNING ""
+#define KERN_INFO    ""
+
+extern bool fake_verbose;
+#define printk(...) (fake_verbose ? fprintf(stderr,__VA_ARGS__) : 0)
+
+/* time, ktime_t is in nanoseconds */
+typedef s64 ktime_t;
+
+#define NSEC_PER_USEC 1000L
+#define NSEC_PER_SEC  1000000000L
+#define USEC_PER_SEC  1000000L
+
+static inline ktime_t ktime_set(s64 secs,unsigned long nsecs){ return secs * NSEC_PER_SEC + nsecs; }
+static inline ktime_t ktime_add(ktime_t a,ktime_t b){ return a + b; }
+static inline ktime_t ktime_sub(ktime_t a,ktime_t b){ return a - b; }
+static inline ktime_t ktime_add_us(ktime_t t,u64 usec){ return t + (s64)usec * NSEC_PER_USEC; }
+static inline int ktime_compare(ktime_t a,ktime_t b){ return a < b ? -1 : (a > b ? 1 : 0); }
+static inline s64 ktime_to_ns(ktime_t t){ return t; }
+static inline s64 ktime_to_us(ktime_t t){ return t / NSEC_PER_USEC; }
+static inline ktime_t ns_to_ktime(u64 ns){ return (ktime_t)ns; }
+static inline s64 ktime_us_delta(ktime_t later,ktime_t earlier){ return (later - earlier) / NSEC_PER_USEC; }
+
+static inline s64 timespec_to_ns(const struct timespec* ts){
+   return (s64)ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
+
+static inline struct timespec ns_to_timespec(s64 ns){
+   struct timespec ts = { ns / NSEC_PER_SEC, ns % NSEC_PER_SEC };
+   return ts;
+}
+
+static inline struct timespec timespec_sub(struct timespec a,struct timespec b){
+   return ns_to_timespec(timespec_to_ns(&a) - timespec_to_ns(&b));
+}
+
+extern ktime_t ktime_get(void);
+
+/* memory */
+#define GFP_KERNEL 0
+
+extern void fake_might_sleep(const char* what);
+
+#define kmalloc(size,gfp) (fake_might_sleep("kmalloc"),malloc(size))
+#define kzalloc(size,gfp) (fake_might_sleep("kzalloc"),calloc(1,size))
+#define kfree(ptr)        free(ptr)
+#define vzalloc(size)     (fake_might_sleep("vzalloc"),calloc(1,size))
+#define vfree(ptr)        free(ptr)
+
+/* the user buffers are plain memory */
+#define copy_to_user(to,from,n) (memcpy((void*)(to),(from),(n)),0UL)
+
+#define BUILD_BUG_ON(cond) ((void)sizeof(char[1 - 2 * !!(cond)]))
+
+static inline u64 div_u64_rem(u64 dividend,u32 divisor,u32* remainder){
+   *remainder = dividend % divisor;
+   return dividend / divisor;
+}
+
+/* locking */
+typedef struct {
+   int held;
+} spinlock_t;
+
+struct mutex {
+   int held;
+};
+
+extern void fake_spin_lock(spinlock_t* lock);
+extern void fake_spin_unlock(spinlock_t* lock);
+extern unsigned long fake_irq_save(void);
+extern void fake_irq_restore(unsigned long flags);
+
+#define spin_lock_init(lock)     ((lock)->held = 0)
+#define spin_lock(lock)          fake_spin_lock(lock)
+#define spin_unlock(lock)        fake_spin_unlock(lock)
+#define local_irq_save(flags)    ((flags) = fake_irq_save())
+#define local_irq_restore(flags) fake_irq_restore(flags)
+
+extern void fake_mutex_lock(struct mutex* lock);
+
+#define mutex_init(lock)   ((lock)->held = 0)
+#define mutex_lock(lock)   fake_mutex_lock(lock)
+#define mutex_unlock(lock) ((lock)->held = 0)
+
+/* lists */
+struct list_head {
+   struct list_head* next;
+   struct list_head* prev;
+};
+
+static inline void INIT_LIST_HEAD(struct list_head* list){
+   list->next = list;
+   list->prev = list;
+}
+
+static inline void list_add_tail(struct list_head* entry,struct list_head* head){
+   entry->prev = head->prev;
+   entry->next = head;
+   head->prev->next = entry;
+   head->prev = entry;
+}
+
+static inline void list_del(struct list_head* entry){
+   entry->prev->next = entry->next;
+   entry->next->prev = entry->prev;
+   entry->next = entry->prev = NULL;
+}
+
+#define list_for_each_entry(pos,head,member) \
+   for (pos = container_of((head)->next,__typeof__(*pos),member); \
+         &pos->member != (head); \
+         pos = container_of(pos->member.next,__typeof__(*pos),member))
+
+/* kfifo, sizes are powers of 2 */
+#define DECLARE_KFIFO(fifo,type,size) \
+   struct { unsigned int in, out, mask; type* data; type buf[size]; } fifo
+
+#define DECLARE_KFIFO_PTR(fifo,type) \
+   struct { unsigned int in, out, mask; type* data; } fifo
+
+#define INIT_KFIFO(fifo) \
+   ((fifo).in = (fifo).out = 0, (fifo).mask = ARRAY_SIZE((fifo).buf) - 1, (fifo).data = (fifo).buf)
+
+#define kfifo_alloc(fifo,size,gfp) \
+   ((fifo)->in = (fifo)->out = 0, (fifo)->mask = (size) - 1, \
+    (fifo)->data = calloc((size),sizeof(*(fifo)->data)), (fifo)->data ? 0 : -ENOMEM)
+
+#define kfifo_free(fifo)     (free((fifo)->data), (fifo)->data = NULL)
+#define kfifo_reset(fifo)    ((fifo)->in = (fifo)->out = 0)
+#define kfifo_len(fifo)      ((fifo)->in - (fifo)->out)
+#define kfifo_is_empty(fifo) ((fifo)->in == (fifo)->out)
+#define kfifo_is_full(fifo)  (kfifo_len(fifo) > (fifo)->mask)
+#define kfifo_skip(fifo)     ((void)(fifo)->out++)
+
+#define kfifo_put(fifo,value) \
+   (kfifo_is_full(fifo) ? 0 : ((fifo)->data[(fifo)->in++ & (fifo)->mask] = (value), 1))
+
+#define kfifo_get(fifo,ptr) \
+   (kfifo_is_empty(fifo) ? 0 : (*(ptr) = (fifo)->data[(fifo)->out++ & (fifo)->mask], 1))
+
+#define kfifo_out(fifo,buf,n) ({ \
+   unsigned int __count = 0; \
+   while (__count < (unsigned int)(n) && !kfifo_is_empty(fifo)){ \
+      (buf)[__count++] = (fifo)->data[(fifo)->out++ & (fifo)->mask]; \
+   } \
+   __count; })
+
+/* wait queues, nothing ever waits in a single threaded test, a wakeup
+ * lets the kernel threads run a pass of their loop */
+typedef struct {
+   unsigned int wakeups;
+} wait_queue_head_t;
+
+extern void fake_wake_up(wait_queue_head_t* wq);
+
+#define init_waitqueue_head(wq)     ((wq)->wakeups = 0)
+#define wake_up(wq)                 fake_wake_up(wq)
+#define wake_up_interruptible(wq)   fake_wake_up(wq)
+#define wait_event_interruptible(wq,condition) ((condition) ? 0 : -ERESTARTSYS)
+#define wait_event_interruptible_timeout(wq,condition,timeout) \
+   ((condition) ? ((long)(timeout) > 0 ? (long)(timeout) : 1L) : 0L)
+
+/* files, poll and fasync */
+struct file;
+struct fasync_struct;
+typedef struct poll_table_struct poll_table;
+
+#define poll_wait(filp,wq,wait)            ((void)(wq))
+#define fasync_helper(fd,filp,on,queue)    0
+#define kill_fasync(queue,sig,band)        ((void)(queue))
+
+/* tasklets and work items, run by fake_run_softirqs() */
+struct tasklet_struct {
+   void                   (*func)(unsigned long);
+   unsigned long          data;
+   bool                   scheduled;
+};
+
+struct work_struct {
+   void                   (*func)(struct work_struct*);
+   bool                   queued;
+};
+
+struct workqueue_struct;
+extern struct workqueue_struct* system_highpri_wq;
+
+extern void fake_tasklet_schedule(struct tasklet_struct* tasklet);
+extern bool fake_queue_work(struct work_struct* work);
+extern void fake_tasklet_kill(struct tasklet_struct* tasklet);
+extern void fake_cancel_work_sync(struct work_struct* work);
+
+#define tasklet_init(t,f,d)       ((t)->func = (f), (t)->data = (d), (t)->scheduled = false)
+#define tasklet_schedule(t)       fake_tasklet_schedule(t)
+#define tasklet_kill(t)           fake_tasklet_kill(t)
+#define INIT_WORK(w,f)            ((w)->func = (f), (w)->queued = false)
+#define queue_work(wq,w)          fake_queue_work(w)
+#define cancel_work_sync(w)       fake_cancel_work_sync(w)
+
+/* kernel threads, run by fake_run_softirqs() after a wakeup. A run is
+ * one pass of the loop of the thread: kthread_should_stop() is false on
+ * its first check and true from then on */
+struct task_struct;
+
+struct sched_param {
+   int sched_priority;
+};
+
+#ifndef SCHED_FIFO
+#define SCHED_FIFO 1
+#endif
+#define MAX_USER_RT_PRIO 100
+
+extern struct task_struct* kthread_run(int (*fn)(void*),void* data,const char* fmt,...);
+extern int kthread_stop(struct task_struct* thread);
+extern bool kthread_should_stop(void);
+
+static inline int sched_setscheduler(struct task_struct* thread,int policy,const struct sched_param* param){
+   return 0;
+}
+
+/* hrtimers on the fake clock */
+enum hrtimer_restart {
+   HRTIMER_NORESTART,
+   HRTIMER_RESTART
+};
+
+enum hrtimer_mode {
+   HRTIMER_MODE_ABS,
+   HRTIMER_MODE_REL
+};
+
+struct hrtimer {
+   ktime_t              expires;
+   enum hrtimer_restart (*function)(struct hrtimer*);
+   bool                 queued;
+   bool                 running;
+};
+
+#define hrtimer_init(timer,clock,mode) memset((timer),0x00,sizeof(struct hrtimer))
+#define hrtimer_get_expires(timer)     ((timer)->expires)
+#define hrtimer_active(timer)          ((timer)->queued || (timer)->running)
+
+extern void fake_hrtimer_start(struct hrtimer* timer,ktime_t time,enum hrtimer_mode mode);
+extern int fake_hrtimer_try_to_cancel(struct hrtimer* timer);
+extern int fake_hrtimer_cancel(struct hrtimer* timer);
+extern u64 hrtimer_forward(struct hrtimer* timer,ktime_t now,ktime_t interval);
+
+/* gpio and interrupts */
+#define GPIOF_DIR_OUT       0x00
+#define GPIOF_IN            0x01
+#define GPIOF_OUT_INIT_LOW  0x00
+#define GPIOF_OPEN_SOURCE   0x10
+
+typedef int irqreturn_t;
+typedef irqreturn_t (*irq_handler_t)(int,void*);
+
+#define IRQ_NONE    0
+#define IRQ_HANDLED 1
+
+#define IRQF_TRIGGER_RISING  0x01
+#define IRQF_TRIGGER_FALLING 0x02
+
+extern int gpio_request_one(unsigned int gpio,unsigned long flags,const char* label);
+extern void gpio_free(unsigned int gpio);
+extern int gpio_to_irq(unsigned int gpio);
+extern int request_irq(unsigned int irq,irq_handler_t handler,unsigned long flags,const char* name,void* dev);
+extern void free_irq(unsigned int irq,void* dev);
+
+/* ======================== */
+/* the fake hardware, driven by the tests */
+
+#define FAKE_GPIO_COUNT 64
+
+/* the time spent in the handlers of one kind, see fake_take_handler_stats() */
+struct fake_handler_timing {
+   u64 count;
+   u64 ns_sum;
+   u64 ns_max;
+};
+
+struct fake_handler_stats {
+   struct fake_handler_timing irq;
+   struct fake_handler_timing timer;
+   struct fake_handler_timing softirq;   /* the tasklets, the work items and the threads */
+};
+
+/* forgets every timer, pin, interrupt and thread and restarts the clock at 1 s */
+extern void fake_reset(void);
+
+/* hrtimer_cancel() and tasklet_kill() find a queued callback already
+ * running on another CPU and wait for it, as on an SMP target */
+extern bool fake_racing_cancel;
+
+extern ktime_t fake_now(void);
+extern void fake_timestamp(struct timespec* ts);
+
+/* moves the clock by usec, firing the timers that come due on the way */
+extern void fake_advance_us(s64 usec);
+
+/* moves the clock to the next timer and fires it, false when none is queued */
+extern bool fake_fire_next_timer(void);
+
+extern unsigned int fake_timers_queued(void);
+
+/* runs the tasklets, the work items and the threads woken so far */
+extern void fake_run_softirqs(void);
+
+extern unsigned int fake_threads_running(void);
+
+/* the pin accesses of the driver, flagged on a pin it does not hold */
+extern int fake_gpio_get(unsigned int gpio);
+extern void fake_gpio_set(unsigned int gpio,int value);
+
+/* the level of a pin for the tests, unchecked */
+extern int fake_gpio_level(unsigned int gpio);
+extern bool fake_gpio_requested(unsigned int gpio);
+extern bool fake_irq_requested(unsigned int gpio);
+
+/* the rising edges driven on an output and the time of its last ones */
+extern unsigned int fake_gpio_rises(unsigned int gpio);
+extern ktime_t fake_gpio_last_rise(unsigned int gpio);
+extern ktime_t fake_gpio_last_fall(unsigned int gpio);
+
+/* sets the level of an input and raises its interrupt on a change,
+ * the softirqs run right after the handler */
+extern void fake_edge(unsigned int gpio,int level);
+
+/* the violations of the locking rules since the last call */
+extern unsigned int fake_take_violations(void);
+
+/* the real time spent in the handlers since the last call, for the
+ * microbenchmarks */
+extern void fake_take_handler_stats(struct fake_handler_stats* stats);
+
+#endif
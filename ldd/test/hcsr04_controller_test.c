@@ -0,0 +1,1132 @@
+/*
+ * HC-SR04 Linux device driver, userspace test harness
+ * Copyright (C) 2016  Jeune Prime M. Origines <primeyo2004@yahoo.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * */
+
+/* Drives the ranging controller of hcsr04_async_device.c through its
+ * cycles with fake pins, interrupts, timers, threads and clock, see
+ * fake_kernel.h. The samples go to the real history of hcsr04_history.c.
+ *
+ *   hcsr04_controller_test              runs the tests
+ *   hcsr04_controller_test -b [cycles]  times the handlers per event
+ *   hcsr04_controller_test -v           prints the driver messages */
+
+#include <unistd.h>
+
+#include "fake_kernel.h"
+
+/* the controller runs on the fakes */
+#define hw_gpio_get(gpio)                fake_gpio_get(gpio)
+#define hw_gpio_set(gpio,value)          fake_gpio_set(gpio,value)
+#define hw_timer_start(timer,time,mode)  fake_hrtimer_start(timer,time,mode)
+#define hw_timer_cancel(timer)           fake_hrtimer_cancel(timer)
+#define hw_timer_try_to_cancel(timer)    fake_hrtimer_try_to_cancel(timer)
+#define hw_clock()                       fake_now()
+#define hw_timestamp(ts)                 fake_timestamp(ts)
+
+#include "../hcsr04_async_device.c"
+
+#define TRIGGER_GPIO      17
+#define ECHO_GPIO         18   /* and up for the further echoes */
+#define EXT_TRIGGER_GPIO  22
+#define OTHER_GPIO        23
+
+#define USEC_PULSE_WIDTH  10
+#define USEC_TIMEOUT      300000
+
+/* an echo of 1 ms, 17 cm */
+#define USEC_ECHO_DELAY   200
+#define USEC_ECHO_WIDTH   1000
+
+#define THREAD_PRIORITY   50
+
+static unsigned int failures;
+static const char* test_name;
+
+#define CHECK(cond) do { \
+   if (!(cond)){ \
+      fprintf(stderr,"   %s:%d: %s\n",__FILE__,__LINE__,#cond); \
+      failures++; \
+   } \
+} while (0)
+
+#define CHECK_EQ(a,b) do { \
+   long long __a = (long long)(a), __b = (long long)(b); \
+   if (__a != __b){ \
+      fprintf(stderr,"   %s:%d: %s == %s, %lld != %lld\n",__FILE__,__LINE__,#a,#b,__a,__b); \
+      failures++; \
+   } \
+} while (0)
+
+/* ======================== */
+/* helpers */
+
+static struct device_data* setup_device(unsigned int echo_count,unsigned int context){
+   unsigned int echo_gpio[HCSR04_MAX_ECHOES];
+   struct hcsr04_exec exec = { context, context == HCSR04_EXEC_THREAD ? THREAD_PRIORITY : 0 };
+   void* pdev = NULL;
+   unsigned int i;
+
+   for (i = 0; i < echo_count; i++){
+      echo_gpio[i] = ECHO_GPIO + i;
+   }
+
+   CHECK_EQ(init_ranging_device(TRIGGER_GPIO,echo_gpio,echo_count,USEC_PULSE_WIDTH,USEC_TIMEOUT,&pdev),SUCCESS);
+
+   if (context != HCSR04_EXEC_TASKLET){
+      CHECK_EQ(set_execution_context(pdev,&exec),SUCCESS);
+   }
+
+   return (struct device_data*)pdev;
+}
+
+static void* open_client(struct device_data* pdev_data){
+   void* client = NULL;
+
+   CHECK_EQ(open_ranging_client(pdev_data,0,&client),SUCCESS);
+   return client;
+}
+
+/* fires the timers up to the rising edge of the trigger pulse,
+ * false when the cycle ended before */
+static bool run_to_trigger(void){
+   unsigned int rises = fake_gpio_rises(TRIGGER_GPIO);
+
+   while (fake_gpio_rises(TRIGGER_GPIO) == rises){
+      if (!fake_fire_next_timer()){
+         return false;
+      }
+   }
+   return true;
+}
+
+/* from the rising edge of the trigger pulse to an echo of usec_width
+ * usec_delay after it, every echo the same */
+static void run_echo(struct device_data* pdev_data,unsigned int usec_delay,unsigned int usec_width){
+   unsigned int i;
+
+   /* the falling edge of the trigger pulse */
+   fake_fire_next_timer();
+   fake_advance_us(usec_delay);
+
+   for (i = 0; i < pdev_data->echo_count; i++){
+      fake_edge(ECHO_GPIO + i,1);
+   }
+
+   fake_advance_us(usec_width);
+
+   for (i = 0; i < pdev_data->echo_count; i++){
+      fake_edge(ECHO_GPIO + i,0);
+   }
+
+   /* the completion */
+   fake_advance_us(0);
+}
+
+/* an on demand cycle with a good echo */
+static void run_good_cycle(struct device_data* pdev_data,void* client){
+   CHECK_EQ(start_async_ranging(client),SUCCESS);
+   CHECK(run_to_trigger());
+   run_echo(pdev_data,USEC_ECHO_DELAY,USEC_ECHO_WIDTH);
+}
+
+/* runs the periodic slots for usec, every trigger pulse gets a good
+ * echo on every channel */
+static void run_slots(struct device_data* pdev_data,unsigned int usec){
+   ktime_t until = ktime_add_us(fake_now(),usec);
+   unsigned int rises = fake_gpio_rises(TRIGGER_GPIO);
+   unsigned int i;
+
+   while (ktime_compare(fake_now(),until) < 0){
+      fake_advance_us(USEC_ECHO_WIDTH);
+
+      if (fake_gpio_rises(TRIGGER_GPIO) == rises){
+         continue;
+      }
+      rises = fake_gpio_rises(TRIGGER_GPIO);
+
+      /* past the falling edge of the trigger pulse */
+      fake_advance_us(USEC_ECHO_DELAY);
+
+      for (i = 0; i < pdev_data->echo_count; i++){
+         fake_edge(ECHO_GPIO + i,1);
+      }
+
+      fake_advance_us(USEC_ECHO_WIDTH);
+
+      for (i = 0; i < pdev_data->echo_count; i++){
+         fake_edge(ECHO_GPIO + i,0);
+      }
+   }
+}
+
+/* reads the samples queued to the client, returns their count and
+ * the seq of the last one */
+static unsigned int drain_samples(void* client,u32* last_seq){
+   struct ranging_sample sample;
+   unsigned int count = 0;
+
+   while (read_ranging_sample(client,&sample,false) == SUCCESS){
+      *last_seq = sample.seq;
+      count++;
+   }
+   return count;
+}
+
+/* the cycle is over and nothing is left running */
+static void check_idle(struct device_data* pdev_data){
+   CHECK_EQ(pdev_data->ctl_stat,CONTROLLER_NONE);
+   CHECK_EQ(fake_timers_queued(),0);
+   CHECK_EQ(fake_gpio_level(TRIGGER_GPIO),0);
+}
+
+/* ======================== */
+/* success */
+
+static void check_good_cycle(unsigned int context){
+   struct device_data* pdev_data = setup_device(1,context);
+   void* client = open_client(pdev_data);
+   struct ranging_sample sample;
+   struct hcsr04_health health;
+   struct hcsr04_dispatch_stats dispatch;
+
+   CHECK_EQ(start_async_ranging(client),SUCCESS);
+   CHECK(run_to_trigger());
+
+   /* a pulse of usec_pulse_width, then the timeout watcher */
+   CHECK_EQ(pdev_data->ctl_stat,CONTROLLER_TRIGGER_LO);
+   CHECK_EQ(read_ranging_sample(client,&sample,false),-EAGAIN);
+   fake_fire_next_timer();
+   CHECK_EQ(pdev_data->ctl_stat,CONTROLLER_TRIGGERED);
+   CHECK_EQ(ktime_us_delta(fake_gpio_last_fall(TRIGGER_GPIO),fake_gpio_last_rise(TRIGGER_GPIO)),USEC_PULSE_WIDTH);
+   CHECK_EQ(fake_timers_queued(),1);
+
+   fake_advance_us(USEC_ECHO_DELAY);
+   fake_edge(ECHO_GPIO,1);
+   CHECK_EQ(pdev_data->ctl_stat,CONTROLLER_TRIGGERED);
+   fake_advance_us(USEC_ECHO_WIDTH);
+   fake_edge(ECHO_GPIO,0);
+
+   /* the timeout watcher makes way for the completion */
+   CHECK_EQ(pdev_data->ctl_stat,CONTROLLER_COMPLETED);
+   fake_advance_us(0);
+   check_idle(pdev_data);
+
+   CHECK_EQ(read_ranging_sample(client,&sample,false),SUCCESS);
+   CHECK_EQ(sample.result_code,RRESULT_SUCCESS);
+   CHECK_EQ(timespec_to_ns(&sample.delta_time),USEC_ECHO_WIDTH * NSEC_PER_USEC);
+   CHECK_EQ(sample.trigger_time,fake_gpio_last_rise(TRIGGER_GPIO));
+   CHECK_EQ(sample.health,HCSR04_HEALTH_OK);
+   CHECK_EQ(read_ranging_sample(client,&sample,false),-ENODATA);
+
+   get_ranging_health(pdev_data,&health);
+   CHECK_EQ(health.consecutive_failures,0);
+
+   get_dispatch_stats(pdev_data,&dispatch);
+   CHECK_EQ(dispatch.context,context);
+   CHECK(dispatch.dispatches > 0);
+
+   close_ranging_client(client);
+   release_ranging_device(pdev_data);
+   CHECK_EQ(fake_threads_running(),0);
+}
+
+static void test_success_tasklet(void){
+   check_good_cycle(HCSR04_EXEC_TASKLET);
+}
+
+static void test_success_workqueue(void){
+   check_good_cycle(HCSR04_EXEC_WORKQUEUE);
+}
+
+static void test_success_hardirq(void){
+   check_good_cycle(HCSR04_EXEC_HARDIRQ);
+}
+
+/* the thread runs with its context only, the cycles go on without it */
+static void test_success_thread(void){
+   struct hcsr04_exec exec = { HCSR04_EXEC_TASKLET, 0 };
+   struct device_data* pdev_data;
+   void* client;
+   u32 seq = 0;
+
+   check_good_cycle(HCSR04_EXEC_THREAD);
+
+   pdev_data = setup_device(1,HCSR04_EXEC_THREAD);
+   client = open_client(pdev_data);
+   CHECK_EQ(fake_threads_running(),1);
+   run_good_cycle(pdev_data,client);
+
+   CHECK_EQ(set_execution_context(pdev_data,&exec),SUCCESS);
+   CHECK_EQ(fake_threads_running(),0);
+   run_good_cycle(pdev_data,client);
+
+   CHECK_EQ(drain_samples(client,&seq),2);
+   CHECK_EQ(seq,1);
+   check_idle(pdev_data);
+
+   close_ranging_client(client);
+   release_ranging_device(pdev_data);
+}
+
+/* the next trigger keeps the minimum cycle time */
+static void test_success_back_to_back(void){
+   struct device_data* pdev_data = setup_device(1,HCSR04_EXEC_TASKLET);
+   void* client = open_client(pdev_data);
+   struct ranging_sample sample;
+   ktime_t first;
+
+   run_good_cycle(pdev_data,client);
+   first = fake_gpio_last_rise(TRIGGER_GPIO);
+   run_good_cycle(pdev_data,client);
+
+   CHECK_EQ(ktime_us_delta(fake_gpio_last_rise(TRIGGER_GPIO),first),HCSR04_MIN_CYCLE_USEC);
+   CHECK_EQ(read_ranging_sample(client,&sample,false),SUCCESS);
+   CHECK_EQ(read_ranging_sample(client,&sample,false),SUCCESS);
+   CHECK_EQ(sample.seq,1);
+   check_idle(pdev_data);
+
+   close_ranging_client(client);
+   release_ranging_device(pdev_data);
+}
+
+/* ======================== */
+/* timeout */
+
+static void test_timeout_no_echo(void){
+   struct device_data* pdev_data = setup_device(1,HCSR04_EXEC_TASKLET);
+   void* client = open_client(pdev_data);
+   struct ranging_sample sample;
+   struct hcsr04_health health;
+
+   CHECK_EQ(start_async_ranging(client),SUCCESS);
+   CHECK(run_to_trigger());
+   fake_fire_next_timer();
+
+   fake_advance_us(USEC_TIMEOUT - 1);
+   CHECK_EQ(pdev_data->ctl_stat,CONTROLLER_TRIGGERED);
+   fake_advance_us(1);
+   check_idle(pdev_data);
+
+   CHECK_EQ(read_ranging_sample(client,&sample,false),SUCCESS);
+   CHECK_EQ(sample.result_code,RRESULT_TIMEDOUT);
+   CHECK_EQ(sample.health,HCSR04_HEALTH_DEGRADED);
+
+   get_ranging_health(pdev_data,&health);
+   CHECK_EQ(health.timeouts,1);
+   CHECK_EQ(health.consecutive_failures,1);
+
+   close_ranging_client(client);
+   release_ranging_device(pdev_data);
+}
+
+/* the echo rose but never fell */
+static void test_timeout_open_echo(void){
+   struct device_data* pdev_data = setup_device(1,HCSR04_EXEC_TASKLET);
+   void* client = open_client(pdev_data);
+   struct ranging_sample sample;
+
+   CHECK_EQ(start_async_ranging(client),SUCCESS);
+   CHECK(run_to_trigger());
+   fake_fire_next_timer();
+   fake_advance_us(USEC_ECHO_DELAY);
+   fake_edge(ECHO_GPIO,1);
+   fake_advance_us(USEC_TIMEOUT);
+   check_idle(pdev_data);
+
+   CHECK_EQ(read_ranging_sample(client,&sample,false),SUCCESS);
+   CHECK_EQ(sample.result_code,RRESULT_TIMEDOUT);
+
+   close_ranging_client(client);
+   release_ranging_device(pdev_data);
+}
+
+/* of two echoes only the first comes back, the sensors are alive */
+static void test_timeout_one_of_two_echoes(void){
+   struct device_data* pdev_data = setup_device(2,HCSR04_EXEC_TASKLET);
+   void* client = open_client(pdev_data);
+   struct ranging_sample sample;
+
+   CHECK_EQ(start_async_ranging(client),SUCCESS);
+   CHECK(run_to_trigger());
+   fake_fire_next_timer();
+   fake_advance_us(USEC_ECHO_DELAY);
+   fake_edge(ECHO_GPIO,1);
+   fake_advance_us(USEC_ECHO_WIDTH);
+   fake_edge(ECHO_GPIO,0);
+   CHECK_EQ(pdev_data->ctl_stat,CONTROLLER_TRIGGERED);
+   fake_advance_us(USEC_TIMEOUT);
+   check_idle(pdev_data);
+
+   CHECK_EQ(read_ranging_sample(client,&sample,false),SUCCESS);
+   CHECK_EQ(sample.channel,0);
+   CHECK_EQ(sample.result_code,RRESULT_SUCCESS);
+   CHECK_EQ(sample.health,HCSR04_HEALTH_OK);
+   CHECK_EQ(read_ranging_sample(client,&sample,false),SUCCESS);
+   CHECK_EQ(sample.channel,1);
+   CHECK_EQ(sample.result_code,RRESULT_TIMEDOUT);
+
+   close_ranging_client(client);
+   release_ranging_device(pdev_data);
+}
+
+/* consecutive timeouts back the triggers off, a good echo recovers */
+static void test_timeout_backoff(void){
+   struct device_data* pdev_data = setup_device(1,HCSR04_EXEC_TASKLET);
+   void* client = open_client(pdev_data);
+   struct ranging_sample sample;
+   struct hcsr04_health health;
+   ktime_t last;
+   unsigned int i;
+
+   for (i = 0; i < HEALTH_FAILED_THRESHOLD; i++){
+      CHECK_EQ(start_async_ranging(client),SUCCESS);
+      CHECK(run_to_trigger());
+      fake_fire_next_timer();
+      fake_advance_us(USEC_TIMEOUT);
+      CHECK_EQ(read_ranging_sample(client,&sample,false),SUCCESS);
+   }
+
+   get_ranging_health(pdev_data,&health);
+   CHECK_EQ(health.state,HCSR04_HEALTH_FAILED);
+   CHECK_EQ(health.backoff_usec,HCSR04_MIN_CYCLE_USEC);
+   CHECK_EQ(check_ranging_backoff(pdev_data),-EBUSY);
+
+   /* an on demand request waits for the back-off to pass */
+   last = fake_now();
+   run_good_cycle(pdev_data,client);
+   CHECK(ktime_us_delta(fake_gpio_last_rise(TRIGGER_GPIO),last) >= HCSR04_MIN_CYCLE_USEC);
+
+   CHECK_EQ(read_ranging_sample(client,&sample,false),SUCCESS);
+   CHECK_EQ(sample.result_code,RRESULT_SUCCESS);
+   CHECK_EQ(sample.health,HCSR04_HEALTH_OK);
+   CHECK_EQ(check_ranging_backoff(pdev_data),SUCCESS);
+
+   close_ranging_client(client);
+   release_ranging_device(pdev_data);
+}
+
+/* ======================== */
+/* spurious edges */
+
+/* echo edges between the cycles do not start one */
+static void test_spurious_idle(void){
+   struct device_data* pdev_data = setup_device(1,HCSR04_EXEC_TASKLET);
+   void* client = open_client(pdev_data);
+   struct ranging_sample sample;
+   struct hcsr04_stats stats;
+
+   fake_edge(ECHO_GPIO,1);
+   fake_edge(ECHO_GPIO,0);
+   fake_advance_us(USEC_TIMEOUT);
+
+   check_idle(pdev_data);
+   CHECK_EQ(fake_gpio_rises(TRIGGER_GPIO),0);
+   CHECK_EQ(read_ranging_sample(client,&sample,false),-ENODATA);
+
+   get_ranging_stats(pdev_data,&stats);
+   CHECK_EQ(stats.stray_edges,2);
+
+   close_ranging_client(client);
+   release_ranging_device(pdev_data);
+}
+
+/* an edge before the trigger pulse is ignored, the cycle goes on */
+static void test_spurious_before_trigger(void){
+   struct device_data* pdev_data = setup_device(1,HCSR04_EXEC_TASKLET);
+   void* client = open_client(pdev_data);
+   struct ranging_sample sample;
+   struct hcsr04_stats stats;
+
+   /* the second cycle waits for the minimum cycle time */
+   run_good_cycle(pdev_data,client);
+   CHECK_EQ(start_async_ranging(client),SUCCESS);
+   fake_advance_us(0);
+   CHECK_EQ(pdev_data->ctl_stat,CONTROLLER_TRIGGER_HI);
+
+   fake_edge(ECHO_GPIO,1);
+   fake_edge(ECHO_GPIO,0);
+   CHECK_EQ(pdev_data->ctl_stat,CONTROLLER_TRIGGER_HI);
+
+   CHECK(run_to_trigger());
+   run_echo(pdev_data,USEC_ECHO_DELAY,USEC_ECHO_WIDTH);
+   check_idle(pdev_data);
+
+   CHECK_EQ(read_ranging_sample(client,&sample,false),SUCCESS);
+   CHECK_EQ(read_ranging_sample(client,&sample,false),SUCCESS);
+   CHECK_EQ(sample.result_code,RRESULT_SUCCESS);
+   CHECK_EQ(timespec_to_ns(&sample.delta_time),USEC_ECHO_WIDTH * NSEC_PER_USEC);
+
+   get_ranging_stats(pdev_data,&stats);
+   CHECK_EQ(stats.stray_edges,2);
+
+   close_ranging_client(client);
+   release_ranging_device(pdev_data);
+}
+
+/* a fall arriving after the timeout belongs to no cycle */
+static void test_spurious_late_fall(void){
+   struct device_data* pdev_data = setup_device(1,HCSR04_EXEC_TASKLET);
+   void* client = open_client(pdev_data);
+   struct ranging_sample sample;
+   struct hcsr04_stats stats;
+
+   CHECK_EQ(start_async_ranging(client),SUCCESS);
+   CHECK(run_to_trigger());
+   fake_fire_next_timer();
+   fake_edge(ECHO_GPIO,1);
+   fake_advance_us(USEC_TIMEOUT);
+   fake_edge(ECHO_GPIO,0);
+   check_idle(pdev_data);
+
+   CHECK_EQ(read_ranging_sample(client,&sample,false),SUCCESS);
+   CHECK_EQ(sample.result_code,RRESULT_TIMEDOUT);
+
+   get_ranging_stats(pdev_data,&stats);
+   CHECK_EQ(stats.stray_edges,1);
+
+   /* the next cycle is not disturbed */
+   run_good_cycle(pdev_data,client);
+   CHECK_EQ(read_ranging_sample(client,&sample,false),SUCCESS);
+   CHECK_EQ(sample.result_code,RRESULT_SUCCESS);
+
+   close_ranging_client(client);
+   release_ranging_device(pdev_data);
+}
+
+/* an echo line still high at the trigger time aborts the cycle without
+ * a pulse, the sample is stamped with the abort time */
+static void test_spurious_stuck_echo(void){
+   struct device_data* pdev_data = setup_device(1,HCSR04_EXEC_TASKLET);
+   void* client = open_client(pdev_data);
+   struct ranging_sample sample;
+   struct hcsr04_health health;
+
+   fake_edge(ECHO_GPIO,1);
+
+   CHECK_EQ(start_async_ranging(client),SUCCESS);
+   CHECK(!run_to_trigger());
+   check_idle(pdev_data);
+   CHECK_EQ(fake_gpio_rises(TRIGGER_GPIO),0);
+
+   CHECK_EQ(read_ranging_sample(client,&sample,false),SUCCESS);
+   CHECK_EQ(sample.result_code,RRESULT_UNKNOWN);
+   CHECK_EQ(sample.trigger_time,fake_now());
+
+   get_ranging_health(pdev_data,&health);
+   CHECK_EQ(health.stuck_echoes,1);
+   CHECK_EQ(health.invalid_states,0);
+
+   close_ranging_client(client);
+   release_ranging_device(pdev_data);
+}
+
+/* ======================== */
+/* reset while in progress */
+
+/* the device is released at every step of a cycle, nothing may be left
+ * running on the freed device nor touch its freed pins, also with the
+ * pending timer and tasklet running meanwhile on another CPU */
+static void test_reset_release_at_every_step(void){
+   struct device_data* pdev_data;
+   void* client;
+   unsigned int step;
+   unsigned int i;
+
+   for (step = 0; step < 10; step++){
+      fake_reset();
+      fake_racing_cancel = (step >= 5);
+
+      pdev_data = setup_device(1,HCSR04_EXEC_TASKLET);
+      client = open_client(pdev_data);
+
+      CHECK_EQ(start_async_ranging(client),SUCCESS);
+
+      /* 0: requested, 1: trigger high, 2: triggered, 3: echo risen, 4: completed */
+      for (i = 0; i < step % 5; i++){
+         switch (i){
+            case 0:
+               CHECK(run_to_trigger());
+               break;
+            case 1:
+               fake_fire_next_timer();
+               break;
+            case 2:
+               fake_edge(ECHO_GPIO,1);
+               break;
+            case 3:
+               fake_edge(ECHO_GPIO,0);
+               break;
+         }
+      }
+
+      close_ranging_client(client);
+      release_ranging_device(pdev_data);
+
+      CHECK_EQ(fake_timers_queued(),0);
+      CHECK(!fake_gpio_requested(TRIGGER_GPIO));
+      CHECK(!fake_gpio_requested(ECHO_GPIO));
+      CHECK(!fake_irq_requested(ECHO_GPIO));
+      CHECK_EQ(fake_gpio_level(TRIGGER_GPIO),0);
+
+      /* an edge now reaches no handler */
+      fake_edge(ECHO_GPIO,0);
+      fake_advance_us(USEC_TIMEOUT);
+
+      if (fake_take_violations() != 0){
+         fprintf(stderr,"   released at step %u%s\n",step % 5,fake_racing_cancel ? ", racing" : "");
+         failures++;
+      }
+   }
+}
+
+/* the pins stay while a cycle runs, the timing changes from the next cycle */
+static void test_reset_reconfigure(void){
+   struct device_data* pdev_data = setup_device(1,HCSR04_EXEC_TASKLET);
+   void* client = open_client(pdev_data);
+   struct ranging_sample sample;
+   struct hcsr04_config config;
+
+   get_ranging_config(pdev_data,&config);
+
+   CHECK_EQ(start_async_ranging(client),SUCCESS);
+   CHECK(run_to_trigger());
+
+   config.echo_gpio[0] = OTHER_GPIO;
+   CHECK_EQ(set_ranging_config(pdev_data,&config),-EBUSY);
+   CHECK(fake_irq_requested(ECHO_GPIO));
+
+   config.echo_gpio[0] = ECHO_GPIO;
+   config.usec_pulse_width = 2 * USEC_PULSE_WIDTH;
+   CHECK_EQ(set_ranging_config(pdev_data,&config),SUCCESS);
+
+   run_echo(pdev_data,USEC_ECHO_DELAY,USEC_ECHO_WIDTH);
+   CHECK_EQ(ktime_us_delta(fake_gpio_last_fall(TRIGGER_GPIO),fake_gpio_last_rise(TRIGGER_GPIO)),USEC_PULSE_WIDTH);
+   CHECK_EQ(read_ranging_sample(client,&sample,false),SUCCESS);
+   CHECK_EQ(sample.result_code,RRESULT_SUCCESS);
+
+   run_good_cycle(pdev_data,client);
+   CHECK_EQ(ktime_us_delta(fake_gpio_last_fall(TRIGGER_GPIO),fake_gpio_last_rise(TRIGGER_GPIO)),2 * USEC_PULSE_WIDTH);
+
+   /* idle, the pins move */
+   config.echo_gpio[0] = OTHER_GPIO;
+   CHECK_EQ(set_ranging_config(pdev_data,&config),SUCCESS);
+   CHECK(!fake_gpio_requested(ECHO_GPIO));
+   CHECK(fake_irq_requested(OTHER_GPIO));
+
+   close_ranging_client(client);
+   release_ranging_device(pdev_data);
+}
+
+/* the pins are taken, the device stays on the previous ones */
+static void test_reset_reconfigure_rollback(void){
+   struct device_data* pdev_data = setup_device(1,HCSR04_EXEC_TASKLET);
+   void* client = open_client(pdev_data);
+   struct hcsr04_config config;
+
+   CHECK_EQ(gpio_request_one(OTHER_GPIO,GPIOF_IN,"other driver"),0);
+
+   get_ranging_config(pdev_data,&config);
+   config.echo_gpio[0] = OTHER_GPIO;
+   CHECK_EQ(set_ranging_config(pdev_data,&config),-EBUSY);
+   CHECK(fake_irq_requested(ECHO_GPIO));
+   CHECK(!pdev_data->reconfiguring);
+
+   run_good_cycle(pdev_data,client);
+   check_idle(pdev_data);
+
+   gpio_free(OTHER_GPIO);
+   close_ranging_client(client);
+   release_ranging_device(pdev_data);
+}
+
+/* the only client goes away in the middle of its cycle */
+static void test_reset_close_client(void){
+   struct device_data* pdev_data = setup_device(1,HCSR04_EXEC_TASKLET);
+   void* client = open_client(pdev_data);
+
+   CHECK_EQ(start_async_ranging(client),SUCCESS);
+   CHECK(run_to_trigger());
+   close_ranging_client(client);
+
+   run_echo(pdev_data,USEC_ECHO_DELAY,USEC_ECHO_WIDTH);
+   check_idle(pdev_data);
+
+   release_ranging_device(pdev_data);
+}
+
+/* ======================== */
+/* external trigger */
+
+static void test_external_trigger(void){
+   struct device_data* pdev_data = setup_device(1,HCSR04_EXEC_TASKLET);
+   void* client = open_client(pdev_data);
+   struct ranging_sample sample;
+   struct hcsr04_stats stats;
+
+   CHECK_EQ(set_external_trigger(pdev_data,EXT_TRIGGER_GPIO,HCSR04_EDGE_RISING),SUCCESS);
+   CHECK(fake_irq_requested(EXT_TRIGGER_GPIO));
+
+   fake_edge(EXT_TRIGGER_GPIO,1);
+   CHECK(run_to_trigger());
+
+   /* a second event during the cycle is missed */
+   fake_edge(EXT_TRIGGER_GPIO,0);
+   fake_edge(EXT_TRIGGER_GPIO,1);
+   run_echo(pdev_data,USEC_ECHO_DELAY,USEC_ECHO_WIDTH);
+
+   CHECK_EQ(read_ranging_sample(client,&sample,false),SUCCESS);
+   CHECK_EQ(sample.result_code,RRESULT_SUCCESS);
+
+   get_ranging_stats(pdev_data,&stats);
+   CHECK_EQ(stats.ext_triggers,2);
+   CHECK_EQ(stats.missed_ext_triggers,1);
+
+   CHECK_EQ(set_external_trigger(pdev_data,-1,0),SUCCESS);
+   CHECK(!fake_irq_requested(EXT_TRIGGER_GPIO));
+   CHECK(!fake_gpio_requested(EXT_TRIGGER_GPIO));
+   CHECK_EQ(read_ranging_sample(client,&sample,false),-ENODATA);
+
+   close_ranging_client(client);
+   release_ranging_device(pdev_data);
+}
+
+/* ======================== */
+/* periodic schedule */
+
+/* the slots run at the rate of the fastest client, the slower one gets
+ * every other cycle */
+static void test_schedule_two_rates(void){
+   struct device_data* pdev_data = setup_device(1,HCSR04_EXEC_TASKLET);
+   void* fast = NULL;
+   void* slow = NULL;
+   struct hcsr04_stats stats;
+   struct ranging_sample sample;
+   unsigned int count;
+   u32 seq = 0;
+
+   CHECK_EQ(open_ranging_client(pdev_data,100000,&fast),SUCCESS);
+   CHECK_EQ(open_ranging_client(pdev_data,200000,&slow),SUCCESS);
+   CHECK_EQ(ktime_to_us(pdev_data->period),100000);
+
+   /* the slots at 0, 100, ... 900 ms */
+   run_slots(pdev_data,950000);
+
+   get_ranging_stats(pdev_data,&stats);
+   CHECK_EQ(stats.slots,10);
+   CHECK_EQ(stats.missed_slots,0);
+   CHECK_EQ(stats.jitter_max_ns,0);
+
+   CHECK_EQ(drain_samples(fast,&seq),10);
+   CHECK_EQ(seq,9);
+
+   /* the same cycles, every other one */
+   count = 0;
+   while (read_ranging_sample(slow,&sample,false) == SUCCESS){
+      CHECK_EQ(sample.seq,2 * count);
+      count++;
+   }
+   CHECK_EQ(count,5);
+
+   /* the schedule slows down to the remaining client, its first slot right away */
+   close_ranging_client(fast);
+   CHECK_EQ(ktime_to_us(pdev_data->period),200000);
+
+   run_slots(pdev_data,950000);
+
+   get_ranging_stats(pdev_data,&stats);
+   CHECK_EQ(stats.slots,15);
+   CHECK_EQ(stats.missed_slots,0);
+   CHECK_EQ(drain_samples(slow,&seq),5);
+   CHECK_EQ(seq,14);
+
+   /* no client left to schedule for */
+   close_ranging_client(slow);
+   CHECK_EQ(ktime_to_ns(pdev_data->period),0);
+   check_idle(pdev_data);
+
+   release_ranging_device(pdev_data);
+}
+
+/* the on demand requests share the cycle in progress or the next slot */
+static void test_schedule_coalesce_on_demand(void){
+   struct device_data* pdev_data = setup_device(1,HCSR04_EXEC_TASKLET);
+   void* first = open_client(pdev_data);
+   void* second = open_client(pdev_data);
+   void* periodic = NULL;
+   unsigned int rises;
+   u32 seq = 0;
+   u32 periodic_seq = 0;
+
+   /* two requests, one cycle */
+   CHECK_EQ(start_async_ranging(first),SUCCESS);
+   CHECK_EQ(start_async_ranging(second),SUCCESS);
+   CHECK(run_to_trigger());
+   run_echo(pdev_data,USEC_ECHO_DELAY,USEC_ECHO_WIDTH);
+   check_idle(pdev_data);
+
+   CHECK_EQ(fake_gpio_rises(TRIGGER_GPIO),1);
+   CHECK_EQ(drain_samples(first,&seq),1);
+   CHECK_EQ(seq,0);
+   CHECK_EQ(drain_samples(second,&seq),1);
+   CHECK_EQ(seq,0);
+
+   /* the slots at 0 and 100 ms, the next one 50 ms away */
+   CHECK_EQ(open_ranging_client(pdev_data,100000,&periodic),SUCCESS);
+   run_slots(pdev_data,150000);
+   CHECK_EQ(drain_samples(periodic,&periodic_seq),2);
+
+   /* a request close to a slot waits for it */
+   rises = fake_gpio_rises(TRIGGER_GPIO);
+   CHECK_EQ(start_async_ranging(first),SUCCESS);
+   fake_advance_us(0);
+   CHECK_EQ(pdev_data->ctl_stat,CONTROLLER_NONE);
+
+   run_slots(pdev_data,60000);
+   CHECK_EQ(fake_gpio_rises(TRIGGER_GPIO),rises + 1);
+   CHECK_EQ(drain_samples(periodic,&periodic_seq),1);
+   CHECK_EQ(drain_samples(first,&seq),1);
+   CHECK_EQ(seq,periodic_seq);
+
+   /* a request far from the next slot gets a cycle of its own */
+   fake_advance_us(10000);
+   CHECK_EQ(start_async_ranging(second),SUCCESS);
+   fake_advance_us(0);
+   CHECK(pdev_data->ctl_stat != CONTROLLER_NONE);
+
+   CHECK(run_to_trigger());
+   CHECK(ktime_compare(fake_gpio_last_rise(TRIGGER_GPIO),hrtimer_get_expires(&pdev_data->period_timer)) < 0);
+   run_echo(pdev_data,USEC_ECHO_DELAY,USEC_ECHO_WIDTH);
+   CHECK_EQ(fake_gpio_rises(TRIGGER_GPIO),rises + 2);
+   CHECK_EQ(drain_samples(second,&seq),1);
+   CHECK_EQ(seq,periodic_seq + 1);
+   CHECK_EQ(drain_samples(first,&seq),0);
+
+   close_ranging_client(periodic);
+   close_ranging_client(second);
+   close_ranging_client(first);
+   release_ranging_device(pdev_data);
+}
+
+/* ======================== */
+/* wakeup moderation */
+
+/* the reader is woken for every third sample */
+static void test_wakeup_batch(void){
+   struct device_data* pdev_data = setup_device(1,HCSR04_EXEC_TASKLET);
+   struct hcsr04_wakeup wakeup = { 3, 0 };
+   struct hcsr04_wakeup_stats stats;
+   struct ranging_sample sample;
+   void* client = NULL;
+   unsigned int i;
+
+   CHECK_EQ(open_ranging_client(pdev_data,100000,&client),SUCCESS);
+   CHECK_EQ(set_client_wakeup(client,&wakeup),SUCCESS);
+
+   /* two samples queued, a blocking reader sleeps on */
+   run_slots(pdev_data,150000);
+   get_client_wakeup_stats(client,&stats);
+   CHECK_EQ(stats.samples,2);
+   CHECK_EQ(stats.wakeups,0);
+   CHECK_EQ(wait_ranging_sample(client,1),-ETIMEDOUT);
+   CHECK_EQ(read_ranging_sample(client,&sample,true),-ERESTARTSYS);
+
+   /* the third one wakes it for the batch */
+   run_slots(pdev_data,100000);
+   get_client_wakeup_stats(client,&stats);
+   CHECK_EQ(stats.wakeups,1);
+   CHECK_EQ(stats.batch_wakeups,1);
+   CHECK_EQ(wait_ranging_sample(client,1),SUCCESS);
+
+   for (i = 0; i < 3; i++){
+      CHECK_EQ(read_ranging_sample(client,&sample,true),SUCCESS);
+      CHECK_EQ(sample.seq,i);
+   }
+   CHECK_EQ(read_ranging_sample(client,&sample,true),-ERESTARTSYS);
+
+   run_slots(pdev_data,300000);
+   get_client_wakeup_stats(client,&stats);
+   CHECK_EQ(stats.samples,6);
+   CHECK_EQ(stats.wakeups,2);
+   CHECK_EQ(stats.batch_wakeups,2);
+   CHECK_EQ(stats.budget_wakeups,0);
+
+   /* a batch beyond the queue is never reached */
+   wakeup.batch = SAMPLE_FIFO_SIZE + 1;
+   CHECK_EQ(set_client_wakeup(client,&wakeup),-EINVAL);
+   wakeup.batch = 0;
+   CHECK_EQ(set_client_wakeup(client,&wakeup),-EINVAL);
+
+   close_ranging_client(client);
+   release_ranging_device(pdev_data);
+}
+
+/* the budget wakes the reader before the batch is reached, the batch
+ * cancels the budget */
+static void test_wakeup_budget(void){
+   struct device_data* pdev_data = setup_device(1,HCSR04_EXEC_TASKLET);
+   struct hcsr04_wakeup wakeup = { 4, 30000 };
+   struct hcsr04_wakeup_stats stats;
+   struct ranging_sample sample;
+   struct ranging_client* client = NULL;
+   ktime_t first;
+
+   CHECK_EQ(open_ranging_client(pdev_data,100000,(void**)&client),SUCCESS);
+   CHECK_EQ(set_client_wakeup(client,&wakeup),SUCCESS);
+
+   /* the first sample, the budget runs from its completion */
+   run_slots(pdev_data,20000);
+   first = fake_now();
+   CHECK(hrtimer_active(&client->wake_timer));
+   CHECK_EQ(read_ranging_sample(client,&sample,true),-ERESTARTSYS);
+
+   run_slots(pdev_data,30000);
+   get_client_wakeup_stats(client,&stats);
+   CHECK_EQ(stats.wakeups,1);
+   CHECK_EQ(stats.budget_wakeups,1);
+   CHECK(ktime_us_delta(fake_now(),first) <= 30000);
+   CHECK_EQ(read_ranging_sample(client,&sample,true),SUCCESS);
+   CHECK_EQ(read_ranging_sample(client,&sample,true),-ERESTARTSYS);
+
+   /* a budget longer than the batch takes */
+   wakeup.batch = 2;
+   wakeup.usec_budget = 250000;
+   CHECK_EQ(set_client_wakeup(client,&wakeup),SUCCESS);
+
+   run_slots(pdev_data,200000);
+   get_client_wakeup_stats(client,&stats);
+   CHECK_EQ(stats.wakeups,2);
+   CHECK_EQ(stats.batch_wakeups,1);
+   CHECK_EQ(stats.budget_wakeups,1);
+   CHECK_EQ(stats.usec_budget,250000);
+   CHECK(!hrtimer_active(&client->wake_timer));
+   CHECK_EQ(read_ranging_sample(client,&sample,true),SUCCESS);
+   CHECK_EQ(read_ranging_sample(client,&sample,true),SUCCESS);
+   CHECK_EQ(sample.seq,2);
+
+   /* the last sample before the client stops needs no budget */
+   CHECK_EQ(set_client_period(client,0),SUCCESS);
+   CHECK_EQ(start_async_ranging(client),SUCCESS);
+   run_slots(pdev_data,100000);
+   get_client_wakeup_stats(client,&stats);
+   CHECK_EQ(stats.wakeups,3);
+   CHECK_EQ(stats.batch_wakeups,2);
+   CHECK_EQ(read_ranging_sample(client,&sample,true),SUCCESS);
+   CHECK_EQ(sample.seq,3);
+
+   close_ranging_client(client);
+   release_ranging_device(pdev_data);
+}
+
+/* ======================== */
+/* history */
+
+/* every published sample is appended, the echo and the trigger time
+ * come back with 1 usec resolution */
+static void test_history_appends(void){
+   static const unsigned int usec_width[] = { 1000, 2500, 0 };
+   struct device_data* pdev_data = setup_device(1,HCSR04_EXEC_TASKLET);
+   void* client = open_client(pdev_data);
+   struct hcsr04_sample out[8];
+   struct hcsr04_history_query query;
+   ktime_t trigger_time[ARRAY_SIZE(usec_width)];
+   void* history = NULL;
+   unsigned int i;
+   u32 seq = 0;
+
+   CHECK_EQ(init_ranging_history(4,&history),SUCCESS);
+   CHECK_EQ(set_ranging_history(pdev_data,history),SUCCESS);
+
+   /* two echoes and a timeout */
+   for (i = 0; i < ARRAY_SIZE(usec_width); i++){
+      CHECK_EQ(start_async_ranging(client),SUCCESS);
+      CHECK(run_to_trigger());
+      trigger_time[i] = fake_gpio_last_rise(TRIGGER_GPIO);
+
+      if (usec_width[i] != 0){
+         run_echo(pdev_data,USEC_ECHO_DELAY,usec_width[i]);
+      }
+      else{
+         fake_advance_us(USEC_TIMEOUT + USEC_PULSE_WIDTH);
+      }
+   }
+   CHECK_EQ(drain_samples(client,&seq),3);
+
+   memset(&query,0x00,sizeof(query));
+   query.start_ns = 0;
+   query.end_ns = ktime_to_ns(fake_now()) + 1;
+   query.samples = (u64)(uintptr_t)out;
+   query.max_count = ARRAY_SIZE(out);
+
+   CHECK_EQ(query_ranging_history(history,&query),SUCCESS);
+   CHECK_EQ(query.count,3);
+   CHECK_EQ(query.oldest_ns,ktime_to_ns(trigger_time[0]));
+
+   for (i = 0; i < ARRAY_SIZE(usec_width) && i < query.count; i++){
+      CHECK_EQ(out[i].seq,i);
+      CHECK_EQ(out[i].timestamp_ns,ktime_to_ns(trigger_time[i]));
+      CHECK_EQ(out[i].echo_ns,usec_width[i] * NSEC_PER_USEC);
+      CHECK_EQ(out[i].result_code,usec_width[i] != 0 ? HCSR04_RESULT_SUCCESS : HCSR04_RESULT_TIMEDOUT);
+   }
+
+   /* the middle cycle only */
+   query.start_ns = ktime_to_ns(trigger_time[1]);
+   query.end_ns = ktime_to_ns(trigger_time[2]);
+
+   CHECK_EQ(query_ranging_history(history,&query),SUCCESS);
+   CHECK_EQ(query.count,1);
+   CHECK_EQ(out[0].seq,1);
+
+   close_ranging_client(client);
+   release_ranging_device(pdev_data);
+   release_ranging_history(history);
+}
+
+/* ======================== */
+/* microbenchmarks */
+
+static void print_timing(const char* name,const struct fake_handler_timing* timing,unsigned int cycles){
+   if (timing->count == 0){
+      printf("   %-8s %10s\n",name,"-");
+      return;
+   }
+
+   printf("   %-8s %10llu %10.2f %10llu %10llu\n",
+         name,
+         (unsigned long long)timing->count,
+         (double)timing->count / cycles,
+         (unsigned long long)(timing->ns_sum / timing->count),
+         (unsigned long long)timing->ns_max);
+}
+
+/* the real time the handlers take per event over good cycles, in every
+ * context */
+static void run_benchmarks(unsigned int cycles){
+   static const struct {
+      unsigned int context;
+      const char*  name;
+   } contexts[] = {
+      { HCSR04_EXEC_TASKLET,   "tasklet"   },
+      { HCSR04_EXEC_WORKQUEUE, "workqueue" },
+      { HCSR04_EXEC_HARDIRQ,   "hardirq"   },
+      { HCSR04_EXEC_THREAD,    "thread"    },
+   };
+   struct fake_handler_stats stats;
+   struct device_data* pdev_data;
+   struct ranging_sample sample;
+   void* client;
+   unsigned int c;
+   unsigned int i;
+
+   for (c = 0; c < ARRAY_SIZE(contexts); c++){
+      fake_reset();
+
+      pdev_data = setup_device(1,contexts[c].context);
+      client = open_client(pdev_data);
+
+      /* the setup is not part of the measurement */
+      fake_take_handler_stats(&stats);
+
+      for (i = 0; i < cycles; i++){
+         run_good_cycle(pdev_data,client);
+         read_ranging_sample(client,&sample,false);
+      }
+
+      fake_take_handler_stats(&stats);
+
+      printf("%s, %u cycles\n",contexts[c].name,cycles);
+      printf("   %-8s %10s %10s %10s %10s\n","handler","events","per cycle","avg ns","max ns");
+      print_timing("irq",&stats.irq,cycles);
+      print_timing("timer",&stats.timer,cycles);
+      print_timing("softirq",&stats.softirq,cycles);
+
+      close_ranging_client(client);
+      release_ranging_device(pdev_data);
+   }
+}
+
+/* ======================== */
+
+static const struct {
+   const char* name;
+   void        (*func)(void);
+} tests[] = {
+   { "success_tasklet",              test_success_tasklet },
+   { "success_workqueue",            test_success_workqueue },
+   { "success_hardirq",              test_success_hardirq },
+   { "success_thread",               test_success_thread },
+   { "success_back_to_back",         test_success_back_to_back },
+   { "timeout_no_echo",              test_timeout_no_echo },
+   { "timeout_open_echo",            test_timeout_open_echo },
+   { "timeout_one_of_two_echoes",    test_timeout_one_of_two_echoes },
+   { "timeout_backoff",              test_timeout_backoff },
+   { "spurious_idle",                test_spurious_idle },
+   { "spurious_before_trigger",      test_spurious_before_trigger },
+   { "spurious_late_fall",           test_spurious_late_fall },
+   { "spurious_stuck_echo",          test_spurious_stuck_echo },
+   { "reset_release_at_every_step",  test_reset_release_at_every_step },
+   { "reset_reconfigure",            test_reset_reconfigure },
+   { "reset_reconfigure_rollback",   test_reset_reconfigure_rollback },
+   { "reset_close_client",           test_reset_close_client },
+   { "external_trigger",             test_external_trigger },
+   { "schedule_two_rates",           test_schedule_two_rates },
+   { "schedule_coalesce_on_demand",  test_schedule_coalesce_on_demand },
+   { "wakeup_batch",                 test_wakeup_batch },
+   { "wakeup_budget",                test_wakeup_budget },
+   { "history_appends",              test_history_appends },
+};
+
+int main(int argc, char* argv[]){
+   unsigned int failed = 0;
+   unsigned int before;
+   unsigned int i;
+   int opt;
+
+   while ((opt = getopt(argc,argv,"vb")) != -1){
+      switch (opt){
+         case 'v':
+            fake_verbose = true;
+            break;
+         case 'b':
+            fake_reset();
+            run_benchmarks(optind < argc ? strtoul(argv[optind],NULL,0) : 10000);
+            return EXIT_SUCCESS;
+         default:
+            fprintf(stderr,"usage: %s [-v] [-b [cycles]]\n",argv[0]);
+            return EXIT_FAILURE;
+      }
+   }
+
+   for (i = 0; i < ARRAY_SIZE(tests); i++){
+      test_name = tests[i].name;
+      before = failures;
+
+      fake_reset();
+      tests[i].func();
+
+      failures += fake_take_violations();
+
+      if (failures != before){
+         failed++;
+      }
+      printf("%s %s\n",failures == before ? "ok  " : "FAIL",test_name);
+   }
+
+   printf("%u of %u tests failed\n",failed,(unsigned int)ARRAY_SIZE(tests));
+
+   return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,2 @@
+/* see fake_kernel.h */
+#include "fake_kernel.h"
@@ -0,0 +1,156 @@
+/*
+ * C++ client library for the HC-SR04 Linux device driver
+ * Copyright (C) 2016  Jeune Prime M. Origines <primeyo2004@yahoo.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * */
+
+/* Compares the batch kernels of the CPU on synthetic samples of a
+ * sensor array, checking each one against the scalar kernel.
+ *    usage: batch_bench [sensors] [cycles] [repeats] */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "hcsr04/batch.hpp"
+
+namespace {
+
+struct result_set {
+   std::vector<float> x;
+   std::vector<float> y;
+   std::vector<float> range;
+
+   explicit result_set(std::size_t n) : x(n), y(n), range(n) {}
+
+   hcsr04::batch::points points() { return {x, y, range}; }
+};
+
+/* a ring of sensors around the robot, as the usual 12 sensor arrays */
+std::vector<hcsr04::batch::sensor_pose> make_poses(std::size_t sensors) {
+   std::vector<hcsr04::batch::sensor_pose> poses(sensors);
+
+   for (std::size_t s = 0; s < sensors; ++s) {
+      float yaw = 2.0f * static_cast<float>(M_PI) * s / sensors;
+      poses[s].x_m = 0.15f * std::cos(yaw);
+      poses[s].y_m = 0.15f * std::sin(yaw);
+      poses[s].yaw_rad = yaw;
+      poses[s].scale = 1.0f + 0.01f * (s % 3);
+      poses[s].offset_m = -0.005f;
+   }
+   return poses;
+}
+
+/* mostly successful echoes, with timeouts and out of range ones */
+std::vector<hcsr04::sample> make_samples(std::size_t sensors, std::size_t cycles) {
+   std::vector<hcsr04::sample> samples(sensors * cycles);
+   std::mt19937 rng(2016);
+   std::uniform_int_distribution<std::uint32_t> echo(50000, 30000000);
+   std::uniform_int_distribution<int> percent(0, 99);
+
+   for (std::size_t i = 0; i < samples.size(); ++i) {
+      hcsr04::sample& s = samples[i];
+
+      s.timestamp_ns = (i / sensors) * 25000000ULL;
+      s.seq = static_cast<std::uint32_t>(i / sensors);
+      s.flags = 0;
+      if (percent(rng) < 5) {
+         s.status = hcsr04::result::timed_out;
+         s.echo_ns = 0;
+      }
+      else {
+         s.status = hcsr04::result::success;
+         s.echo_ns = echo(rng);
+      }
+   }
+   return samples;
+}
+
+bool same(float a, float b) {
+   if (std::isnan(a) || std::isnan(b)) {
+      return std::isnan(a) && std::isnan(b);
+   }
+   return std::fabs(a - b) <= 1e-6f * std::max(1.0f, std::fabs(a));
+}
+
+}
+
+int main(int argc, char* argv[]) {
+   std::size_t sensors = argc > 1 ? std::strtoul(argv[1], nullptr, 0) : 12;
+   std::size_t cycles = argc > 2 ? std::strtoul(argv[2], nullptr, 0) : 40 * 3600;
+   int repeats = argc > 3 ? std::atoi(argv[3]) : 20;
+
+   if (sensors == 0 || cycles == 0 || repeats <= 0) {
+      std::fprintf(stderr, "usage: %s [sensors] [cycles] [repeats]\n", argv[0]);
+      return EXIT_FAILURE;
+   }
+
+   std::vector<hcsr04::batch::sensor_pose> poses = make_poses(sensors);
+   std::vector<hcsr04::sample> samples = make_samples(sensors, cycles);
+   std::size_t n = samples.size();
+
+   result_set reference(n);
+   hcsr04::batch::array_processor(poses, 0.5f, hcsr04::batch::kernel::scalar).process(samples, reference.points());
+
+   std::printf("%zu sensors, %zu cycles, best of %d runs, automatic kernel: %s\n", sensors, cycles, repeats,
+               hcsr04::batch::kernel_name(hcsr04::batch::best_kernel()));
+   std::printf("%-8s %12s %14s %10s %8s\n", "kernel", "ns/cycle", "Msamples/s", "speedup", "check");
+
+   double scalar_ns = 0.0;
+   int status = EXIT_SUCCESS;
+
+   for (hcsr04::batch::kernel k : {hcsr04::batch::kernel::scalar, hcsr04::batch::kernel::sse2,
+                                   hcsr04::batch::kernel::avx2, hcsr04::batch::kernel::neon}) {
+      if (!hcsr04::batch::kernel_supported(k)) {
+         continue;
+      }
+
+      result_set out(n);
+      double best_ns = 0.0;
+
+      for (int r = 0; r < repeats; ++r) {
+         hcsr04::batch::array_processor proc(poses, 0.5f, k);
+
+         auto start = std::chrono::steady_clock::now();
+         proc.process(samples, out.points());
+         auto stop = std::chrono::steady_clock::now();
+
+         double ns = std::chrono::duration<double, std::nano>(stop - start).count();
+         best_ns = (r == 0) ? ns : std::min(best_ns, ns);
+      }
+
+      bool ok = true;
+      for (std::size_t i = 0; i < n && ok; ++i) {
+         ok = same(out.x[i], reference.x[i]) && same(out.y[i], reference.y[i]) &&
+              same(out.range[i], reference.range[i]);
+      }
+      if (!ok) {
+         status = EXIT_FAILURE;
+      }
+
+      if (k == hcsr04::batch::kernel::scalar) {
+         scalar_ns = best_ns;
+      }
+      std::printf("%-8s %12.1f %14.1f %9.2fx %8s\n", hcsr04::batch::kernel_name(k), best_ns / cycles,
+                  n * 1e3 / best_ns, scalar_ns / best_ns, ok ? "ok" : "MISMATCH");
+   }
+
+   return status;
+}
@@ -0,0 +1,102 @@
+/*
+ * C++ client library for the HC-SR04 Linux device driver
+ * Copyright (C) 2016  Jeune Prime M. Origines <primeyo2004@yahoo.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * */
+
+#ifndef HCSR04_BATCH_HPP
+#define HCSR04_BATCH_HPP
+
+#include <cstddef>
+#include <span>
+#include <vector>
+
+#include "hcsr04/client.hpp"
+
+/* Batch post-processing of the samples of a sensor array: the echo
+ * widths are turned into calibrated, range gated and smoothed distances
+ * and into 2D obstacle points of the robot frame by vectorized kernels */
+namespace hcsr04::batch {
+
+enum class kernel {
+   automatic,   /* the best one supported by the CPU */
+   scalar,
+   sse2,
+   avx2,
+   neon
+};
+
+const char* kernel_name(kernel k) noexcept;
+
+/* whether the kernel is built in and supported by the CPU */
+bool kernel_supported(kernel k) noexcept;
+
+kernel best_kernel() noexcept;
+
+/* the mounting pose and calibration of a sensor of the array */
+struct sensor_pose {
+   float x_m      = 0.0f;    /* position in the robot frame */
+   float y_m      = 0.0f;
+   float yaw_rad  = 0.0f;    /* heading of the sensor */
+   float scale    = 1.0f;    /* distance = scale * echo distance + offset_m */
+   float offset_m = 0.0f;
+   float min_m    = 0.02f;   /* valid range, the distances outside are rejected */
+   float max_m    = 4.0f;
+};
+
+/* Output storage of the caller, one entry per input sample. The rejected
+ * and failed samples are NaN in all three */
+struct points {
+   std::span<float> x;
+   std::span<float> y;
+   std::span<float> range;
+};
+
+class array_processor {
+public:
+   /* alpha is the weight of a new distance in the exponential smoothing
+    * of each sensor, 1 for none */
+   explicit array_processor(std::span<const sensor_pose> poses, float alpha = 1.0f,
+                            kernel k = kernel::automatic);
+
+   kernel active_kernel() const noexcept { return kernel_; }
+   std::size_t sensor_count() const noexcept { return state_.size(); }
+
+   /* Processes whole cycles of samples, sample i of a cycle coming from
+    * sensor i, e.g. the latest samples of every sensor. Returns the number
+    * of cycles processed, limited by the sizes of samples and out */
+   std::size_t process(std::span<const sample> samples, const points& out);
+
+   /* forgets the smoothed distances */
+   void reset();
+
+private:
+   kernel             kernel_;
+   float              beta_;
+   std::vector<float> px_;
+   std::vector<float> py_;
+   std::vector<float> cos_;
+   std::vector<float> sin_;
+   std::vector<float> gain_;
+   std::vector<float> offset_;
+   std::vector<float> min_;
+   std::vector<float> max_;
+   std::vector<float> state_;
+};
+
+}
+
+#endif
@@ -0,0 +1,246 @@
+/*
+ * C++ client library for the HC-SR04 Linux device driver
+ * Copyright (C) 2016  Jeune Prime M. Origines <primeyo2004@yahoo.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * */
+
+#ifndef HCSR04_CLIENT_HPP
+#define HCSR04_CLIENT_HPP
+
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <optional>
+#include <span>
+#include <string>
+
+#include "hcsr04_ioctl.h"
+
+namespace hcsr04 {
+
+enum class result : std::uint32_t {
+   success     = HCSR04_RESULT_SUCCESS,
+   in_progress = HCSR04_RESULT_IN_PROGRESS,
+   timed_out   = HCSR04_RESULT_TIMEDOUT,
+   not_started = HCSR04_RESULT_NOT_STARTED,
+   unknown     = HCSR04_RESULT_UNKNOWN
+};
+
+enum class health : std::uint32_t {
+   ok       = HCSR04_HEALTH_OK,
+   degraded = HCSR04_HEALTH_DEGRADED,
+   failed   = HCSR04_HEALTH_FAILED
+};
+
+/* A measurement, laid out exactly like struct hcsr04_sample so that the
+ * binary records of the driver are read straight into it */
+struct sample {
+   std::uint64_t timestamp_ns;  /* CLOCK_MONOTONIC time of the trigger pulse */
+   std::uint32_t seq;           /* a gap in the sequence means dropped samples */
+   std::uint32_t echo_ns;       /* width of the echo pulse, 0 unless successful */
+   result        status;
+   std::uint32_t flags;
+
+   bool ok() const noexcept { return status == result::success; }
+
+   /* the health of the sensor after this measurement */
+   hcsr04::health health() const noexcept {
+      return static_cast<hcsr04::health>(flags & HCSR04_SAMPLE_HEALTH_MASK);
+   }
+
+   /* the echo line of the sensor, the samples of a trigger pulse share seq */
+   unsigned int channel() const noexcept {
+      return (flags & HCSR04_SAMPLE_CHANNEL_MASK) >> HCSR04_SAMPLE_CHANNEL_SHIFT;
+   }
+
+   /* the echo travels the distance twice at ~343 m/s */
+   double distance_m() const noexcept { return echo_ns * 171.5e-9; }
+};
+
+static_assert(sizeof(sample) == sizeof(hcsr04_sample), "sample must match struct hcsr04_sample");
+static_assert(offsetof(sample, timestamp_ns) == offsetof(hcsr04_sample, timestamp_ns));
+static_assert(offsetof(sample, seq) == offsetof(hcsr04_sample, seq));
+static_assert(offsetof(sample, echo_ns) == offsetof(hcsr04_sample, echo_ns));
+static_assert(offsetof(sample, status) == offsetof(hcsr04_sample, result_code));
+static_assert(offsetof(sample, flags) == offsetof(hcsr04_sample, flags));
+
+/* the read() format in use, the binary one is picked when the driver offers it */
+enum class interface { binary, text };
+
+/* Readiness notification of an event loop. Implement it on top of the
+ * loop of the application (e.g. an io_uring IORING_OP_POLL_ADD) or use
+ * epoll_reactor */
+class reactor {
+public:
+   virtual ~reactor() = default;
+
+   /* resumes handle once fd becomes readable */
+   virtual void wait_readable(int fd, std::coroutine_handle<> handle) = 0;
+};
+
+class read_awaitable;
+
+/* An open /dev/hcsr04_driver. The errors are reported as std::system_error */
+class device {
+public:
+   /* nonblocking is required by async_read() */
+   explicit device(const std::string& path = "/dev/hcsr04_driver", bool nonblocking = false);
+   ~device();
+
+   device(device&& other) noexcept;
+   device& operator=(device&& other) noexcept;
+   device(const device&) = delete;
+   device& operator=(const device&) = delete;
+
+   int fd() const noexcept { return fd_; }
+   interface active_interface() const noexcept { return interface_; }
+
+   /* one-shot ranging, the result is read with read() */
+   void start();
+
+   /* Has read() start the one-shot ranging by itself whenever nothing is
+    * queued, a single syscall per measurement without start() */
+   void set_oneshot_read(bool on);
+
+   /* periodic sampling in Hz of this device only, 0 for ranging on demand */
+   void set_rate(unsigned int rate_hz);
+   unsigned int rate() const;
+
+   hcsr04_stats stats() const;
+
+   /* Wakes the reader of this device once batch samples are queued or
+    * usec_budget after the first, trading latency for fewer wakeups */
+   void set_wakeup(unsigned int batch, unsigned int usec_budget = 0);
+   hcsr04_wakeup_stats wakeup_stats() const;
+
+   hcsr04_health health() const;
+
+   /* The context the controller of the driver runs in, HCSR04_EXEC_*,
+    * priority is the SCHED_FIFO priority of HCSR04_EXEC_THREAD. The
+    * dispatch statistics restart with every call */
+   void set_exec(std::uint32_t context, std::uint32_t priority = 0);
+   hcsr04_dispatch_stats dispatch_stats() const;
+
+   /* handler timing, empty unless the driver is built with HCSR04_PROFILE */
+   std::optional<hcsr04_profile> profile(bool reset = false) const;
+
+   /* Reads up to out.size() samples of the history of the driver in
+    * [start_ns, end_ns) oldest first. Returns the count, a full out is
+    * continued with start_ns past the timestamp of its last sample.
+    * oldest_ns is set to the oldest sample held when given */
+   std::size_t history(std::uint64_t start_ns, std::uint64_t end_ns, std::span<sample> out,
+                       std::uint64_t* oldest_ns = nullptr) const;
+
+   /* runtime configuration, applied by the driver between the measurements,
+    * the format field is managed by the library */
+   hcsr04_config config() const;
+   void set_config(const hcsr04_config& config);
+
+   /* Reads up to out.size() queued samples into the storage of the caller,
+    * nothing is allocated. Returns 0 when nothing has been started or when
+    * a non-blocking device has nothing queued yet */
+   std::size_t read(std::span<sample> out);
+
+   /* as read(), but std::nullopt rather than 0 while a non-blocking device
+    * has nothing queued yet and more samples are coming */
+   std::optional<std::size_t> try_read(std::span<sample> out);
+
+   std::optional<sample> read_one();
+
+   /* Switches this device between the samples and the raw edge capture,
+    * while capturing read() returns nothing and read_edges() is used */
+   void capture_edges(bool on);
+
+   /* reads up to out.size() captured edges, 0 as read() */
+   std::size_t read_edges(std::span<hcsr04_edge> out);
+
+   /* co_await dev.async_read(loop, out) yields the result of read(out)
+    * once the device is readable, 0 on a spurious wake up. Nothing is
+    * awaited when no sample is coming, e.g. nothing has been started */
+   read_awaitable async_read(reactor& loop, std::span<sample> out);
+
+private:
+   std::optional<std::size_t> read_text(std::span<sample> out);
+
+   int       fd_;
+   interface interface_;
+   bool      capturing_;
+};
+
+class read_awaitable {
+public:
+   read_awaitable(device& dev, reactor& loop, std::span<sample> out) noexcept
+      : dev_(dev), loop_(loop), out_(out), count_(0), done_(false) {}
+
+   bool await_ready() {
+      std::optional<std::size_t> count = dev_.try_read(out_);
+
+      done_ = count.has_value();
+      count_ = count.value_or(0);
+      return done_;
+   }
+
+   void await_suspend(std::coroutine_handle<> handle) {
+      loop_.wait_readable(dev_.fd(), handle);
+   }
+
+   std::size_t await_resume() {
+      return done_ ? count_ : dev_.read(out_);
+   }
+
+private:
+   device&           dev_;
+   reactor&          loop_;
+   std::span<sample> out_;
+   std::size_t       count_;
+   bool              done_;
+};
+
+/* A reactor driven by epoll, for applications without an event loop */
+class epoll_reactor : public reactor {
+public:
+   epoll_reactor();
+   ~epoll_reactor() override;
+
+   epoll_reactor(const epoll_reactor&) = delete;
+   epoll_reactor& operator=(const epoll_reactor&) = delete;
+
+   void wait_readable(int fd, std::coroutine_handle<> handle) override;
+
+   /* resumes the coroutines of the ready descriptors, timeout_ms as epoll_wait(),
+    * returns the number of resumed coroutines */
+   int run_once(int timeout_ms = -1);
+
+private:
+   int epfd_;
+};
+
+/* Fire and forget coroutine type, e.g.
+ *    hcsr04::task poll_sensor(hcsr04::device& dev, hcsr04::reactor& loop); */
+struct task {
+   struct promise_type {
+      task get_return_object() noexcept { return {}; }
+      std::suspend_never initial_suspend() noexcept { return {}; }
+      std::suspend_never final_suspend() noexcept { return {}; }
+      void return_void() noexcept {}
+      void unhandled_exception() { std::terminate(); }
+   };
+};
+
+}
+
+#endif
@@ -0,0 +1,146 @@
+/*
+ * C++ client library for the HC-SR04 Linux device driver
+ * Copyright (C) 2016  Jeune Prime M. Origines <primeyo2004@yahoo.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * */
+
+#ifndef HCSR04_SHM_HPP
+#define HCSR04_SHM_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+
+#include "hcsr04/client.hpp"
+
+/* The POSIX shared memory segment published by hcsr04d. The daemon is
+ * the only writer, any number of processes map the segment read-only
+ * and read the samples with plain loads, retrying on a concurrent write
+ * as told by the seqlock style versions */
+namespace hcsr04::shm {
+
+inline constexpr const char* default_name = "/hcsr04";
+
+inline constexpr std::uint32_t magic = 0x34305348;   /* "HS04" */
+inline constexpr std::uint32_t layout_version = 1;
+
+inline constexpr std::size_t max_sensors = 8;
+inline constexpr std::size_t history_size = 1024;     /* samples per sensor, a power of 2 */
+
+static_assert((history_size & (history_size - 1)) == 0, "history_size must be a power of 2");
+static_assert(std::atomic<std::uint32_t>::is_always_lock_free &&
+              std::atomic<std::uint64_t>::is_always_lock_free,
+              "the versions are shared between processes");
+
+/* the samples of the last trigger pulse, one per echo */
+struct latest_block {
+   std::atomic<std::uint32_t> version;   /* odd while written */
+   std::uint32_t              count;
+   sample                     samples[HCSR04_MAX_ECHOES];
+};
+
+/* a sample of the history ring, version is 2 * (index + 1) once the
+ * sample of index is complete and odd while written */
+struct history_entry {
+   std::atomic<std::uint64_t> version;
+   sample                     value;
+};
+
+struct alignas(64) sensor {
+   char                       path[64];   /* the device node */
+   std::uint32_t              channels;   /* echoes per trigger pulse */
+   std::uint32_t              reserved;
+   latest_block               latest;
+   std::atomic<std::uint64_t> head;       /* samples written so far */
+   history_entry              history[history_size];
+};
+
+struct segment {
+   std::atomic<std::uint32_t> magic;         /* set last once the segment is ready */
+   std::uint32_t              version;
+   std::uint32_t              sensor_count;
+   std::uint32_t              history_size;
+   std::atomic<std::uint64_t> heartbeat_ns;  /* CLOCK_MONOTONIC, refreshed by the daemon every second */
+   std::atomic<std::uint32_t> pid;           /* of the daemon */
+   std::uint32_t              reserved;
+   sensor                     sensors[max_sensors];
+};
+
+/* The writer side, owned by hcsr04d. The segment is created on
+ * construction, the one of a dead daemon is unlinked and replaced by a
+ * new one so that its readers keep a valid mapping, and it is unlinked
+ * on destruction. It stays locked meanwhile, a second publisher of the
+ * same name fails with EBUSY */
+class publisher {
+public:
+   explicit publisher(const std::string& name = default_name);
+   ~publisher();
+
+   publisher(const publisher&) = delete;
+   publisher& operator=(const publisher&) = delete;
+
+   /* the sensors are added before the first publish() */
+   std::size_t add_sensor(const std::string& path, std::uint32_t channels);
+
+   /* publishes a batch of samples read from the sensor, the samples of
+    * the last complete trigger pulse become the latest ones */
+   void publish(std::size_t index, std::span<const sample> samples);
+
+   void heartbeat();
+
+private:
+   std::string name_;
+   int         fd_;    /* holds the lock */
+   segment*    seg_;
+};
+
+/* The reader side, for the consumers */
+class reader {
+public:
+   explicit reader(const std::string& name = default_name);
+   ~reader();
+
+   reader(const reader&) = delete;
+   reader& operator=(const reader&) = delete;
+
+   std::size_t sensor_count() const noexcept { return seg_->sensor_count; }
+   std::string path(std::size_t index) const { return seg_->sensors[index].path; }
+
+   /* nanoseconds since the last heartbeat of the daemon */
+   std::uint64_t staleness_ns() const;
+
+   /* copies the samples of the last trigger pulse, returns their count */
+   std::size_t latest(std::size_t index, std::span<sample, HCSR04_MAX_ECHOES> out) const;
+
+   /* the index the next sample of the sensor will be written at */
+   std::uint64_t head(std::size_t index) const noexcept {
+      return seg_->sensors[index].head.load(std::memory_order_acquire);
+   }
+
+   /* Copies the samples from index first on, oldest first, up to
+    * out.size(). Returns the count, the samples already overwritten
+    * are skipped and *first is moved past the copied ones */
+   std::size_t history(std::size_t index, std::uint64_t& first, std::span<sample> out) const;
+
+private:
+   const segment* seg_;
+};
+
+}
+
+#endif
@@ -0,0 +1,174 @@
+/*
+ * C++ client library for the HC-SR04 Linux device driver
+ * Copyright (C) 2016  Jeune Prime M. Origines <primeyo2004@yahoo.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * */
+
+#include "hcsr04/batch.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+#include "batch_kernels.hpp"
+
+#if defined(__arm__) && !defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+namespace hcsr04::batch {
+
+namespace detail {
+
+void process_scalar(const kernel_args& a) {
+   for (std::size_t c = 0; c < a.cycles; ++c) {
+      for (std::size_t s = 0; s < a.sensors; ++s) {
+         process_one(a, c, s);
+      }
+   }
+}
+
+}
+
+const char* kernel_name(kernel k) noexcept {
+   switch (k) {
+   case kernel::automatic:
+      return "automatic";
+   case kernel::scalar:
+      return "scalar";
+   case kernel::sse2:
+      return "sse2";
+   case kernel::avx2:
+      return "avx2";
+   case kernel::neon:
+      return "neon";
+   }
+   return "unknown";
+}
+
+bool kernel_supported(kernel k) noexcept {
+   switch (k) {
+   case kernel::automatic:
+   case kernel::scalar:
+      return true;
+#if defined(__x86_64__) || defined(__i386__)
+   case kernel::sse2:
+      return __builtin_cpu_supports("sse2");
+   case kernel::avx2:
+      return __builtin_cpu_supports("avx2");
+#endif
+#if defined(__aarch64__)
+   case kernel::neon:
+      return true;
+#elif defined(__arm__)
+   case kernel::neon:
+      return (::getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#endif
+   default:
+      return false;
+   }
+}
+
+kernel best_kernel() noexcept {
+   for (kernel k : {kernel::avx2, kernel::sse2, kernel::neon}) {
+      if (kernel_supported(k)) {
+         return k;
+      }
+   }
+   return kernel::scalar;
+}
+
+array_processor::array_processor(std::span<const sensor_pose> poses, float alpha, kernel k)
+   : kernel_(k == kernel::automatic ? best_kernel() : k), beta_(1.0f - alpha) {
+   if (poses.empty()) {
+      throw std::invalid_argument("hcsr04: no sensor poses");
+   }
+   if (!(alpha > 0.0f && alpha <= 1.0f)) {
+      throw std::invalid_argument("hcsr04: alpha out of (0, 1]");
+   }
+   if (!kernel_supported(kernel_)) {
+      throw std::invalid_argument("hcsr04: kernel not supported");
+   }
+
+   for (const sensor_pose& pose : poses) {
+      px_.push_back(pose.x_m);
+      py_.push_back(pose.y_m);
+      cos_.push_back(std::cos(pose.yaw_rad));
+      sin_.push_back(std::sin(pose.yaw_rad));
+      gain_.push_back(detail::metres_per_ns * pose.scale);
+      offset_.push_back(pose.offset_m);
+      min_.push_back(pose.min_m);
+      max_.push_back(pose.max_m);
+   }
+   state_.assign(poses.size(), std::numeric_limits<float>::quiet_NaN());
+}
+
+std::size_t array_processor::process(std::span<const sample> samples, const points& out) {
+   std::size_t sensors = state_.size();
+   std::size_t room = std::min({out.x.size(), out.y.size(), out.range.size()});
+   std::size_t cycles = std::min(samples.size(), room) / sensors;
+
+   if (cycles == 0) {
+      return 0;
+   }
+
+   detail::kernel_args a{};
+   a.samples = samples.data();
+   a.cycles = cycles;
+   a.sensors = sensors;
+   a.px = px_.data();
+   a.py = py_.data();
+   a.cos_yaw = cos_.data();
+   a.sin_yaw = sin_.data();
+   a.gain = gain_.data();
+   a.offset = offset_.data();
+   a.min = min_.data();
+   a.max = max_.data();
+   a.state = state_.data();
+   a.beta = beta_;
+   a.x = out.x.data();
+   a.y = out.y.data();
+   a.range = out.range.data();
+
+   switch (kernel_) {
+#if defined(__x86_64__) || defined(__i386__)
+   case kernel::sse2:
+      detail::process_sse2(a);
+      break;
+   case kernel::avx2:
+      detail::process_avx2(a);
+      break;
+#endif
+#if defined(__aarch64__) || defined(__arm__)
+   case kernel::neon:
+      detail::process_neon(a);
+      break;
+#endif
+   default:
+      detail::process_scalar(a);
+      break;
+   }
+
+   return cycles;
+}
+
+void array_processor::reset() {
+   std::fill(state_.begin(), state_.end(), std::numeric_limits<float>::quiet_NaN());
+}
+
+}
@@ -0,0 +1,77 @@
+/*
+ * C++ client library for the HC-SR04 Linux device driver
+ * Copyright (C) 2016  Jeune Prime M. Origines <primeyo2004@yahoo.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * */
+
+#include <immintrin.h>
+
+#include "batch_sse.hpp"
+
+namespace hcsr04::batch::detail {
+
+/* 8 sensors at a time, then 4. The records are read as in the SSE2
+ * kernel, vpgatherdd is slower than the paired loads on most cores */
+void process_avx2(const kernel_args& a) {
+   const __m256 nan = _mm256_set1_ps(std::numeric_limits<float>::quiet_NaN());
+   const __m256 beta = _mm256_set1_ps(a.beta);
+   const __m256i success = _mm256_set1_epi32(static_cast<int>(result::success));
+
+   for (std::size_t c = 0; c < a.cycles; ++c) {
+      std::size_t s = 0;
+
+      for (; s + 8 <= a.sensors; s += 8) {
+         std::size_t i = c * a.sensors + s;
+         __m128i echo_lo, echo_hi;
+         __m128i status_lo, status_hi;
+
+         load4(a.samples + i, echo_lo, status_lo);
+         load4(a.samples + i + 4, echo_hi, status_hi);
+         __m256i echo = _mm256_set_m128i(echo_hi, echo_lo);
+         __m256i status = _mm256_set_m128i(status_hi, status_lo);
+
+         __m256 d = _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(echo), _mm256_loadu_ps(a.gain + s)),
+                                  _mm256_loadu_ps(a.offset + s));
+         __m256 valid = _mm256_and_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(status, success)),
+                                      _mm256_and_ps(_mm256_cmp_ps(d, _mm256_loadu_ps(a.min + s), _CMP_GE_OQ),
+                                                    _mm256_cmp_ps(d, _mm256_loadu_ps(a.max + s), _CMP_LE_OQ)));
+
+         __m256 st = _mm256_loadu_ps(a.state + s);
+         __m256 filtered = _mm256_blendv_ps(_mm256_add_ps(d, _mm256_mul_ps(beta, _mm256_sub_ps(st, d))), d,
+                                            _mm256_cmp_ps(st, st, _CMP_UNORD_Q));
+         __m256 range = _mm256_blendv_ps(nan, filtered, valid);
+
+         _mm256_storeu_ps(a.state + s, _mm256_blendv_ps(st, filtered, valid));
+         _mm256_storeu_ps(a.range + i, range);
+         _mm256_storeu_ps(a.x + i, _mm256_add_ps(_mm256_loadu_ps(a.px + s),
+                                                 _mm256_mul_ps(range, _mm256_loadu_ps(a.cos_yaw + s))));
+         _mm256_storeu_ps(a.y + i, _mm256_add_ps(_mm256_loadu_ps(a.py + s),
+                                                 _mm256_mul_ps(range, _mm256_loadu_ps(a.sin_yaw + s))));
+      }
+
+      /* e.g. the last 4 of 12 sensors */
+      if (s + 4 <= a.sensors) {
+         step4(a, c, s);
+         s += 4;
+      }
+
+      for (; s < a.sensors; ++s) {
+         process_one(a, c, s);
+      }
+   }
+}
+
+}
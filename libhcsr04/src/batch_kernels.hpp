@@ -0,0 +1,104 @@
+/*
+ * C++ client library for the HC-SR04 Linux device driver
+ * Copyright (C) 2016  Jeune Prime M. Origines <primeyo2004@yahoo.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * */
+
+#ifndef HCSR04_BATCH_KERNELS_HPP
+#define HCSR04_BATCH_KERNELS_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+#include "hcsr04/client.hpp"
+
+/* the kernels of hcsr04::batch, each built with the flags of its
+ * instruction set and selected at run time */
+namespace hcsr04::batch::detail {
+
+/* metres of distance per nanosecond of echo, as sample::distance_m() */
+inline constexpr float metres_per_ns = 171.5e-9f;
+
+/* the records are read as 32 bit words, echo_ns and status */
+inline constexpr std::size_t sample_words = sizeof(sample) / sizeof(std::uint32_t);
+inline constexpr std::size_t echo_word    = offsetof(sample, echo_ns) / sizeof(std::uint32_t);
+inline constexpr std::size_t status_word  = offsetof(sample, status) / sizeof(std::uint32_t);
+
+static_assert(status_word == echo_word + 1, "the kernels load echo_ns and status as a pair");
+
+struct kernel_args {
+   const sample* samples;     /* cycles * sensors */
+   std::size_t   cycles;
+   std::size_t   sensors;
+
+   /* per sensor */
+   const float* px;
+   const float* py;
+   const float* cos_yaw;
+   const float* sin_yaw;
+   const float* gain;         /* metres_per_ns * scale */
+   const float* offset;
+   const float* min;
+   const float* max;
+   float*       state;        /* smoothed distance, NaN until the first one */
+
+   float beta;                /* 1 - alpha */
+
+   float* x;                  /* cycles * sensors */
+   float* y;
+   float* range;
+};
+
+/* The helpers of the kernels are local to each translation unit, one
+ * built for AVX2 must not be linked into the others */
+namespace {
+
+/* the reference every kernel has to match, also used for the sensors
+ * left over by the vector width */
+inline void process_one(const kernel_args& a, std::size_t c, std::size_t s) {
+   std::size_t i = c * a.sensors + s;
+   const sample& in = a.samples[i];
+   float nan = std::numeric_limits<float>::quiet_NaN();
+
+   float d = static_cast<float>(static_cast<std::int32_t>(in.echo_ns)) * a.gain[s] + a.offset[s];
+   bool valid = (in.status == result::success) & (d >= a.min[s]) & (d <= a.max[s]);
+   float st = a.state[s];
+   float filtered = (st != st) ? d : d + a.beta * (st - d);
+   float range = valid ? filtered : nan;
+
+   a.state[s] = valid ? filtered : st;
+   a.range[i] = range;
+   a.x[i] = a.px[s] + range * a.cos_yaw[s];
+   a.y[i] = a.py[s] + range * a.sin_yaw[s];
+}
+
+}
+
+void process_scalar(const kernel_args& a);
+
+#if defined(__x86_64__) || defined(__i386__)
+void process_sse2(const kernel_args& a);
+void process_avx2(const kernel_args& a);
+#endif
+
+#if defined(__aarch64__) || defined(__arm__)
+void process_neon(const kernel_args& a);
+#endif
+
+}
+
+#endif
@@ -0,0 +1,68 @@
+/*
+ * C++ client library for the HC-SR04 Linux device driver
+ * Copyright (C) 2016  Jeune Prime M. Origines <primeyo2004@yahoo.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * */
+
+#include <arm_neon.h>
+
+#include "batch_kernels.hpp"
+
+namespace hcsr04::batch::detail {
+
+/* 4 sensors at a time */
+void process_neon(const kernel_args& a) {
+   const float32x4_t nan = vdupq_n_f32(std::numeric_limits<float>::quiet_NaN());
+   const float32x4_t beta = vdupq_n_f32(a.beta);
+   const uint32x4_t success = vdupq_n_u32(static_cast<std::uint32_t>(result::success));
+
+   for (std::size_t c = 0; c < a.cycles; ++c) {
+      std::size_t s = 0;
+
+      for (; s + 4 <= a.sensors; s += 4) {
+         std::size_t i = c * a.sensors + s;
+         const std::uint32_t* w = reinterpret_cast<const std::uint32_t*>(a.samples + i) + echo_word;
+
+         /* echo_ns and status of a record are loaded as a pair and deinterleaved */
+         uint32x4x2_t pairs = vuzpq_u32(vcombine_u32(vld1_u32(w), vld1_u32(w + sample_words)),
+                                        vcombine_u32(vld1_u32(w + 2 * sample_words), vld1_u32(w + 3 * sample_words)));
+         uint32x4_t echo = pairs.val[0];
+         uint32x4_t status = pairs.val[1];
+
+         float32x4_t d = vaddq_f32(vmulq_f32(vcvtq_f32_s32(vreinterpretq_s32_u32(echo)), vld1q_f32(a.gain + s)),
+                                   vld1q_f32(a.offset + s));
+         uint32x4_t valid = vandq_u32(vceqq_u32(status, success),
+                                      vandq_u32(vcgeq_f32(d, vld1q_f32(a.min + s)),
+                                                vcleq_f32(d, vld1q_f32(a.max + s))));
+
+         float32x4_t st = vld1q_f32(a.state + s);
+         uint32x4_t first = vmvnq_u32(vceqq_f32(st, st));
+         float32x4_t filtered = vbslq_f32(first, d, vaddq_f32(d, vmulq_f32(beta, vsubq_f32(st, d))));
+         float32x4_t range = vbslq_f32(valid, filtered, nan);
+
+         vst1q_f32(a.state + s, vbslq_f32(valid, filtered, st));
+         vst1q_f32(a.range + i, range);
+         vst1q_f32(a.x + i, vaddq_f32(vld1q_f32(a.px + s), vmulq_f32(range, vld1q_f32(a.cos_yaw + s))));
+         vst1q_f32(a.y + i, vaddq_f32(vld1q_f32(a.py + s), vmulq_f32(range, vld1q_f32(a.sin_yaw + s))));
+      }
+
+      for (; s < a.sensors; ++s) {
+         process_one(a, c, s);
+      }
+   }
+}
+
+}
@@ -0,0 +1,79 @@
+/*
+ * C++ client library for the HC-SR04 Linux device driver
+ * Copyright (C) 2016  Jeune Prime M. Origines <primeyo2004@yahoo.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * */
+
+#ifndef HCSR04_BATCH_SSE_HPP
+#define HCSR04_BATCH_SSE_HPP
+
+#include <emmintrin.h>
+
+#include "batch_kernels.hpp"
+
+/* the 4 sensor step of the SSE2 kernel, also the tail of the AVX2 one */
+namespace hcsr04::batch::detail {
+
+namespace {
+
+/* a ? b : c */
+inline __m128 select4(__m128 a, __m128 b, __m128 c) {
+   return _mm_or_ps(_mm_and_ps(a, b), _mm_andnot_ps(a, c));
+}
+
+/* echo_ns and status of 4 records are loaded as pairs and deinterleaved,
+ * a lot cheaper than inserting the words one by one */
+inline void load4(const sample* in, __m128i& echo, __m128i& status) {
+   const std::uint32_t* w = reinterpret_cast<const std::uint32_t*>(in) + echo_word;
+
+   __m128i p01 = _mm_unpacklo_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(w)),
+                                    _mm_loadl_epi64(reinterpret_cast<const __m128i*>(w + sample_words)));
+   __m128i p23 = _mm_unpacklo_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(w + 2 * sample_words)),
+                                    _mm_loadl_epi64(reinterpret_cast<const __m128i*>(w + 3 * sample_words)));
+   echo = _mm_unpacklo_epi64(p01, p23);
+   status = _mm_unpackhi_epi64(p01, p23);
+}
+
+inline void step4(const kernel_args& a, std::size_t c, std::size_t s) {
+   const __m128 nan = _mm_set1_ps(std::numeric_limits<float>::quiet_NaN());
+   std::size_t i = c * a.sensors + s;
+   __m128i echo;
+   __m128i status;
+
+   load4(a.samples + i, echo, status);
+
+   __m128 d = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(echo), _mm_loadu_ps(a.gain + s)),
+                         _mm_loadu_ps(a.offset + s));
+   __m128 valid = _mm_and_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(status, _mm_set1_epi32(static_cast<int>(result::success)))),
+                             _mm_and_ps(_mm_cmpge_ps(d, _mm_loadu_ps(a.min + s)),
+                                        _mm_cmple_ps(d, _mm_loadu_ps(a.max + s))));
+
+   __m128 st = _mm_loadu_ps(a.state + s);
+   __m128 filtered = select4(_mm_cmpunord_ps(st, st), d,
+                             _mm_add_ps(d, _mm_mul_ps(_mm_set1_ps(a.beta), _mm_sub_ps(st, d))));
+   __m128 range = select4(valid, filtered, nan);
+
+   _mm_storeu_ps(a.state + s, select4(valid, filtered, st));
+   _mm_storeu_ps(a.range + i, range);
+   _mm_storeu_ps(a.x + i, _mm_add_ps(_mm_loadu_ps(a.px + s), _mm_mul_ps(range, _mm_loadu_ps(a.cos_yaw + s))));
+   _mm_storeu_ps(a.y + i, _mm_add_ps(_mm_loadu_ps(a.py + s), _mm_mul_ps(range, _mm_loadu_ps(a.sin_yaw + s))));
+}
+
+}
+
+}
+
+#endif
@@ -0,0 +1,39 @@
+/*
+ * C++ client library for the HC-SR04 Linux device driver
+ * Copyright (C) 2016  Jeune Prime M. Origines <primeyo2004@yahoo.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * */
+
+#include "batch_sse.hpp"
+
+namespace hcsr04::batch::detail {
+
+/* 4 sensors at a time */
+void process_sse2(const kernel_args& a) {
+   for (std::size_t c = 0; c < a.cycles; ++c) {
+      std::size_t s = 0;
+
+      for (; s + 4 <= a.sensors; s += 4) {
+         step4(a, c, s);
+      }
+
+      for (; s < a.sensors; ++s) {
+         process_one(a, c, s);
+      }
+   }
+}
+
+}
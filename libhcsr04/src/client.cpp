@@ -0,0 +1,376 @@
+/*
+ * C++ client library for the HC-SR04 Linux device driver
+ * Copyright (C) 2016  Jeune Prime M. Origines <primeyo2004@yahoo.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * */
+
+#include "hcsr04/client.hpp"
+
+#include <cerrno>
+#include <charconv>
+#include <system_error>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+namespace hcsr04 {
+
+namespace {
+
+[[noreturn]] void throw_errno(const char* what) {
+   throw std::system_error(errno, std::generic_category(), what);
+}
+
+/* parses "<result code>,<sec>:<nsec>,<distance in cm * 100>[,<echo index>]\n" */
+bool parse_text_sample(const char* first, const char* last, sample& out) {
+   long code = 0;
+   long sec = 0;
+   long nsec = 0;
+   long distance = 0;
+   unsigned int channel = 0;
+
+   auto r = std::from_chars(first, last, code);
+   if (r.ec != std::errc() || r.ptr == last || *r.ptr != ',') {
+      return false;
+   }
+
+   r = std::from_chars(r.ptr + 1, last, sec);
+   if (r.ec != std::errc() || r.ptr == last || *r.ptr != ':') {
+      return false;
+   }
+
+   r = std::from_chars(r.ptr + 1, last, nsec);
+   if (r.ec != std::errc()) {
+      return false;
+   }
+
+   /* the echo index is only there with several echoes per trigger */
+   if (r.ptr != last && *r.ptr == ',') {
+      r = std::from_chars(r.ptr + 1, last, distance);
+      if (r.ec == std::errc() && r.ptr != last && *r.ptr == ',') {
+         std::from_chars(r.ptr + 1, last, channel);
+      }
+   }
+
+   out = sample{};
+   out.status = static_cast<result>(code);
+   out.echo_ns = static_cast<std::uint32_t>(sec * 1000000000L + nsec);
+   out.flags = (channel << HCSR04_SAMPLE_CHANNEL_SHIFT) & HCSR04_SAMPLE_CHANNEL_MASK;
+   return true;
+}
+
+}
+
+device::device(const std::string& path, bool nonblocking)
+   : fd_(-1), interface_(interface::text), capturing_(false) {
+
+   fd_ = ::open(path.c_str(), O_RDWR | O_CLOEXEC | (nonblocking ? O_NONBLOCK : 0));
+   if (fd_ < 0) {
+      throw_errno("hcsr04: open");
+   }
+
+   /* older drivers only speak the text format */
+   __u32 format = HCSR04_FORMAT_BINARY;
+   if (::ioctl(fd_, HCSR04_IOC_SET_FORMAT, &format) == 0) {
+      interface_ = interface::binary;
+   }
+}
+
+device::~device() {
+   if (fd_ >= 0) {
+      ::close(fd_);
+   }
+}
+
+device::device(device&& other) noexcept
+   : fd_(std::exchange(other.fd_, -1)), interface_(other.interface_), capturing_(other.capturing_) {}
+
+device& device::operator=(device&& other) noexcept {
+   if (this != &other) {
+      if (fd_ >= 0) {
+         ::close(fd_);
+      }
+      fd_ = std::exchange(other.fd_, -1);
+      interface_ = other.interface_;
+      capturing_ = other.capturing_;
+   }
+   return *this;
+}
+
+void device::start() {
+   static const char cmd[] = "start\n";
+
+   if (::write(fd_, cmd, sizeof(cmd) - 1) < 0) {
+      throw_errno("hcsr04: start");
+   }
+}
+
+void device::set_oneshot_read(bool on) {
+   __u32 value = on ? 1 : 0;
+
+   if (::ioctl(fd_, HCSR04_IOC_SET_ONESHOT_READ, &value) < 0) {
+      throw_errno("hcsr04: set_oneshot_read");
+   }
+}
+
+void device::set_rate(unsigned int rate_hz) {
+   __u32 rate = rate_hz;
+
+   if (::ioctl(fd_, HCSR04_IOC_SET_RATE, &rate) < 0) {
+      throw_errno("hcsr04: set_rate");
+   }
+}
+
+unsigned int device::rate() const {
+   __u32 rate = 0;
+
+   if (::ioctl(fd_, HCSR04_IOC_GET_RATE, &rate) < 0) {
+      throw_errno("hcsr04: rate");
+   }
+   return rate;
+}
+
+hcsr04_stats device::stats() const {
+   hcsr04_stats stats{};
+
+   if (::ioctl(fd_, HCSR04_IOC_GET_STATS, &stats) < 0) {
+      throw_errno("hcsr04: stats");
+   }
+   return stats;
+}
+
+void device::set_wakeup(unsigned int batch, unsigned int usec_budget) {
+   hcsr04_wakeup wakeup{};
+
+   wakeup.batch = batch;
+   wakeup.usec_budget = usec_budget;
+   if (::ioctl(fd_, HCSR04_IOC_SET_WAKEUP, &wakeup) < 0) {
+      throw_errno("hcsr04: set_wakeup");
+   }
+}
+
+hcsr04_wakeup_stats device::wakeup_stats() const {
+   hcsr04_wakeup_stats stats{};
+
+   if (::ioctl(fd_, HCSR04_IOC_GET_WAKEUP_STATS, &stats) < 0) {
+      throw_errno("hcsr04: wakeup_stats");
+   }
+   return stats;
+}
+
+hcsr04_health device::health() const {
+   hcsr04_health health{};
+
+   if (::ioctl(fd_, HCSR04_IOC_GET_HEALTH, &health) < 0) {
+      throw_errno("hcsr04: health");
+   }
+   return health;
+}
+
+void device::set_exec(std::uint32_t context, std::uint32_t priority) {
+   hcsr04_exec exec{};
+
+   exec.context = context;
+   exec.priority = priority;
+   if (::ioctl(fd_, HCSR04_IOC_SET_EXEC, &exec) < 0) {
+      throw_errno("hcsr04: set_exec");
+   }
+}
+
+hcsr04_dispatch_stats device::dispatch_stats() const {
+   hcsr04_dispatch_stats stats{};
+
+   if (::ioctl(fd_, HCSR04_IOC_GET_DISPATCH_STATS, &stats) < 0) {
+      throw_errno("hcsr04: dispatch_stats");
+   }
+   return stats;
+}
+
+std::optional<hcsr04_profile> device::profile(bool reset) const {
+   hcsr04_profile profile{};
+
+   if (::ioctl(fd_, reset ? HCSR04_IOC_GET_RESET_PROFILE : HCSR04_IOC_GET_PROFILE, &profile) < 0) {
+      if (errno == ENOTTY) {
+         return std::nullopt;
+      }
+      throw_errno("hcsr04: profile");
+   }
+   return profile;
+}
+
+std::size_t device::history(std::uint64_t start_ns, std::uint64_t end_ns, std::span<sample> out,
+                            std::uint64_t* oldest_ns) const {
+   hcsr04_history_query query{};
+
+   query.start_ns = start_ns;
+   query.end_ns = end_ns;
+   query.samples = reinterpret_cast<std::uintptr_t>(out.data());
+   query.max_count = static_cast<__u32>(out.size());
+
+   if (::ioctl(fd_, HCSR04_IOC_GET_HISTORY, &query) < 0) {
+      throw_errno("hcsr04: history");
+   }
+
+   if (oldest_ns != nullptr) {
+      *oldest_ns = query.oldest_ns;
+   }
+   return query.count;
+}
+
+hcsr04_config device::config() const {
+   hcsr04_config config{};
+
+   if (::ioctl(fd_, HCSR04_IOC_GET_CONFIG, &config) < 0) {
+      throw_errno("hcsr04: config");
+   }
+   return config;
+}
+
+void device::set_config(const hcsr04_config& config) {
+   hcsr04_config request = config;
+
+   request.format = (interface_ == interface::binary ? HCSR04_FORMAT_BINARY : HCSR04_FORMAT_TEXT);
+   if (::ioctl(fd_, HCSR04_IOC_SET_CONFIG, &request) < 0) {
+      throw_errno("hcsr04: set_config");
+   }
+}
+
+std::size_t device::read(std::span<sample> out) {
+   return try_read(out).value_or(0);
+}
+
+std::optional<std::size_t> device::try_read(std::span<sample> out) {
+   if (out.empty() || capturing_) {
+      return 0;
+   }
+
+   if (interface_ == interface::text) {
+      return read_text(out);
+   }
+
+   ssize_t n = ::read(fd_, out.data(), out.size_bytes());
+   if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+         return std::nullopt;
+      }
+      throw_errno("hcsr04: read");
+   }
+   return static_cast<std::size_t>(n) / sizeof(sample);
+}
+
+std::optional<std::size_t> device::read_text(std::span<sample> out) {
+   char line[100];
+
+   /* the text format returns a single sample per read */
+   ssize_t n = ::read(fd_, line, sizeof(line));
+   if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+         return std::nullopt;
+      }
+      throw_errno("hcsr04: read");
+   }
+
+   if (n == 0 || !parse_text_sample(line, line + n, out[0])) {
+      return 0;
+   }
+   return 1;
+}
+
+std::optional<sample> device::read_one() {
+   sample s;
+
+   if (read(std::span<sample>(&s, 1)) == 0) {
+      return std::nullopt;
+   }
+   return s;
+}
+
+void device::capture_edges(bool on) {
+   __u32 format = HCSR04_FORMAT_EDGES;
+
+   if (!on) {
+      format = (interface_ == interface::binary ? HCSR04_FORMAT_BINARY : HCSR04_FORMAT_TEXT);
+   }
+
+   if (::ioctl(fd_, HCSR04_IOC_SET_FORMAT, &format) < 0) {
+      throw_errno("hcsr04: capture_edges");
+   }
+   capturing_ = on;
+}
+
+std::size_t device::read_edges(std::span<hcsr04_edge> out) {
+   if (out.empty() || !capturing_) {
+      return 0;
+   }
+
+   ssize_t n = ::read(fd_, out.data(), out.size_bytes());
+   if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+         return 0;
+      }
+      throw_errno("hcsr04: read_edges");
+   }
+   return static_cast<std::size_t>(n) / sizeof(hcsr04_edge);
+}
+
+read_awaitable device::async_read(reactor& loop, std::span<sample> out) {
+   return read_awaitable(*this, loop, out);
+}
+
+epoll_reactor::epoll_reactor() : epfd_(::epoll_create1(EPOLL_CLOEXEC)) {
+   if (epfd_ < 0) {
+      throw_errno("hcsr04: epoll_create1");
+   }
+}
+
+epoll_reactor::~epoll_reactor() {
+   ::close(epfd_);
+}
+
+void epoll_reactor::wait_readable(int fd, std::coroutine_handle<> handle) {
+   epoll_event ev{};
+   ev.events = EPOLLIN | EPOLLONESHOT;
+   ev.data.ptr = handle.address();
+
+   /* one shot registrations are re-armed with EPOLL_CTL_MOD */
+   if (::epoll_ctl(epfd_, EPOLL_CTL_MOD, fd, &ev) < 0) {
+      if (errno != ENOENT || ::epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+         throw_errno("hcsr04: epoll_ctl");
+      }
+   }
+}
+
+int epoll_reactor::run_once(int timeout_ms) {
+   epoll_event events[16];
+
+   int n = ::epoll_wait(epfd_, events, 16, timeout_ms);
+   if (n < 0) {
+      if (errno == EINTR) {
+         return 0;
+      }
+      throw_errno("hcsr04: epoll_wait");
+   }
+
+   for (int i = 0; i < n; ++i) {
+      std::coroutine_handle<>::from_address(events[i].data.ptr).resume();
+   }
+   return n;
+}
+
+}
@@ -0,0 +1,325 @@
+/*
+ * C++ client library for the HC-SR04 Linux device driver
+ * Copyright (C) 2016  Jeune Prime M. Origines <primeyo2004@yahoo.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * */
+
+#include "hcsr04/shm.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace hcsr04::shm {
+
+namespace {
+
+[[noreturn]] void throw_errno(const char* what) {
+   throw std::system_error(errno, std::generic_category(), what);
+}
+
+std::uint64_t monotonic_ns() {
+   timespec ts{};
+
+   ::clock_gettime(CLOCK_MONOTONIC, &ts);
+   return static_cast<std::uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+/* the seqlock write side, the data stores may not move above the odd
+ * version nor below the even one */
+void begin_write(std::atomic<std::uint32_t>& version) {
+   version.store(version.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+   std::atomic_thread_fence(std::memory_order_release);
+}
+
+void end_write(std::atomic<std::uint32_t>& version) {
+   version.store(version.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+/* the segment left behind names a daemon that is still running, e.g.
+ * one of a build that did not lock it */
+bool owner_alive(int fd) {
+   struct stat st{};
+
+   if (::fstat(fd, &st) < 0 || static_cast<std::size_t>(st.st_size) < sizeof(segment)) {
+      return false;
+   }
+
+   void* addr = ::mmap(nullptr, sizeof(segment), PROT_READ, MAP_SHARED, fd, 0);
+   if (addr == MAP_FAILED) {
+      return false;
+   }
+
+   const segment* seg = static_cast<const segment*>(addr);
+   pid_t pid = 0;
+   if (seg->magic.load(std::memory_order_acquire) == magic) {
+      pid = static_cast<pid_t>(seg->pid.load(std::memory_order_relaxed));
+   }
+   ::munmap(addr, sizeof(segment));
+
+   return pid > 0 && pid != ::getpid() && (::kill(pid, 0) == 0 || errno == EPERM);
+}
+
+}
+
+publisher::publisher(const std::string& name) : name_(name), fd_(-1), seg_(nullptr) {
+   /* a takeover starts over on a fresh object, one more round when
+    * another daemon replaced the name meanwhile */
+   for (int attempt = 0; ; ++attempt) {
+      fd_ = ::shm_open(name_.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+      if (fd_ < 0) {
+         throw_errno("hcsr04d: shm_open");
+      }
+
+      /* the segment of a running daemon is left alone */
+      if (::flock(fd_, LOCK_EX | LOCK_NB) < 0) {
+         int err = (errno == EWOULDBLOCK) ? EBUSY : errno;
+         ::close(fd_);
+         throw std::system_error(err, std::generic_category(), "hcsr04d: flock " + name_);
+      }
+      if (owner_alive(fd_)) {
+         ::close(fd_);
+         throw std::system_error(EBUSY, std::generic_category(), "hcsr04d: " + name_ + " is in use");
+      }
+
+      struct stat st{};
+      if (::fstat(fd_, &st) < 0) {
+         int err = errno;
+         ::close(fd_);
+         throw std::system_error(err, std::generic_category(), "hcsr04d: fstat");
+      }
+
+      /* a new object, the readers do not map one of size 0 */
+      if (st.st_nlink > 0 && st.st_size == 0) {
+         break;
+      }
+
+      ::close(fd_);
+      fd_ = -1;
+      if (attempt == 2) {
+         throw std::system_error(EBUSY, std::generic_category(), "hcsr04d: " + name_ + " keeps changing");
+      }
+
+      /* a segment left behind by a dead daemon may still be mapped by
+       * readers, resizing it would fault them, so its name is given to
+       * a new object and the old one goes with its last reader. One
+       * already unlinked by its daemon is simply not used */
+      if (st.st_nlink > 0) {
+         ::shm_unlink(name_.c_str());
+      }
+   }
+
+   if (::ftruncate(fd_, sizeof(segment)) < 0) {
+      int err = errno;
+      ::shm_unlink(name_.c_str());
+      ::close(fd_);
+      throw std::system_error(err, std::generic_category(), "hcsr04d: ftruncate");
+   }
+
+   void* addr = ::mmap(nullptr, sizeof(segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+   if (addr == MAP_FAILED) {
+      int err = errno;
+      ::shm_unlink(name_.c_str());
+      ::close(fd_);
+      throw std::system_error(err, std::generic_category(), "hcsr04d: mmap");
+   }
+
+   /* the zero filled segment is a valid empty one */
+   seg_ = static_cast<segment*>(addr);
+   seg_->version = layout_version;
+   seg_->history_size = history_size;
+   seg_->sensor_count = 0;
+   seg_->pid.store(static_cast<std::uint32_t>(::getpid()), std::memory_order_relaxed);
+   seg_->heartbeat_ns.store(monotonic_ns(), std::memory_order_relaxed);
+   seg_->magic.store(magic, std::memory_order_release);
+}
+
+publisher::~publisher() {
+   if (seg_ != nullptr) {
+      seg_->magic.store(0, std::memory_order_release);
+      ::munmap(seg_, sizeof(segment));
+      ::shm_unlink(name_.c_str());
+      ::close(fd_);
+   }
+}
+
+std::size_t publisher::add_sensor(const std::string& path, std::uint32_t channels) {
+   if (seg_->sensor_count >= max_sensors) {
+      throw std::length_error("hcsr04d: too many sensors");
+   }
+
+   std::size_t index = seg_->sensor_count;
+   sensor& s = seg_->sensors[index];
+
+   std::strncpy(s.path, path.c_str(), sizeof(s.path) - 1);
+   s.channels = channels;
+
+   std::atomic_thread_fence(std::memory_order_release);
+   seg_->sensor_count = static_cast<std::uint32_t>(index + 1);
+   return index;
+}
+
+void publisher::publish(std::size_t index, std::span<const sample> samples) {
+   sensor& s = seg_->sensors[index];
+   std::uint64_t head = s.head.load(std::memory_order_relaxed);
+
+   for (const sample& value : samples) {
+      history_entry& entry = s.history[head & (history_size - 1)];
+
+      entry.version.store(2 * head + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      entry.value = value;
+      entry.version.store(2 * (head + 1), std::memory_order_release);
+      ++head;
+   }
+   s.head.store(head, std::memory_order_release);
+
+   if (samples.empty()) {
+      return;
+   }
+
+   /* the samples of a trigger pulse share seq, the last pulse of the
+    * batch may still be incomplete when it spans two reads */
+   std::uint32_t seq = samples.back().seq;
+   std::size_t first = samples.size();
+   while (first > 0 && samples[first - 1].seq == seq) {
+      --first;
+   }
+   std::size_t count = std::min<std::size_t>(samples.size() - first, HCSR04_MAX_ECHOES);
+
+   begin_write(s.latest.version);
+   if (s.latest.count > 0 && s.latest.samples[0].seq == seq && first == 0) {
+      /* the rest of a pulse whose first samples came with the previous read */
+      std::size_t have = std::min<std::size_t>(s.latest.count, HCSR04_MAX_ECHOES - count);
+      std::copy_n(samples.begin(), count, s.latest.samples + have);
+      s.latest.count = static_cast<std::uint32_t>(have + count);
+   }
+   else {
+      std::copy_n(samples.begin() + first, count, s.latest.samples);
+      s.latest.count = static_cast<std::uint32_t>(count);
+   }
+   end_write(s.latest.version);
+}
+
+void publisher::heartbeat() {
+   seg_->heartbeat_ns.store(monotonic_ns(), std::memory_order_release);
+}
+
+reader::reader(const std::string& name) : seg_(nullptr) {
+   int fd = ::shm_open(name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+   if (fd < 0) {
+      throw_errno("hcsr04: shm_open");
+   }
+
+   /* a segment still being set up, or not one of hcsr04d at all, would
+    * fault on the first access beyond its end */
+   struct stat st{};
+   if (::fstat(fd, &st) < 0) {
+      int err = errno;
+      ::close(fd);
+      throw std::system_error(err, std::generic_category(), "hcsr04: fstat");
+   }
+   if (static_cast<std::size_t>(st.st_size) < sizeof(segment)) {
+      ::close(fd);
+      throw std::runtime_error("hcsr04: no hcsr04d segment of this layout");
+   }
+
+   void* addr = ::mmap(nullptr, sizeof(segment), PROT_READ, MAP_SHARED, fd, 0);
+   ::close(fd);
+   if (addr == MAP_FAILED) {
+      throw_errno("hcsr04: mmap");
+   }
+
+   seg_ = static_cast<const segment*>(addr);
+   if (seg_->magic.load(std::memory_order_acquire) != magic || seg_->version != layout_version) {
+      ::munmap(const_cast<segment*>(seg_), sizeof(segment));
+      throw std::runtime_error("hcsr04: no hcsr04d segment of this layout");
+   }
+}
+
+reader::~reader() {
+   ::munmap(const_cast<segment*>(seg_), sizeof(segment));
+}
+
+std::uint64_t reader::staleness_ns() const {
+   std::uint64_t now = monotonic_ns();
+   std::uint64_t beat = seg_->heartbeat_ns.load(std::memory_order_acquire);
+
+   return now > beat ? now - beat : 0;
+}
+
+std::size_t reader::latest(std::size_t index, std::span<sample, HCSR04_MAX_ECHOES> out) const {
+   const latest_block& block = seg_->sensors[index].latest;
+   std::uint32_t before;
+   std::uint32_t count;
+
+   do {
+      before = block.version.load(std::memory_order_acquire);
+      count = std::min<std::uint32_t>(block.count, HCSR04_MAX_ECHOES);
+      std::copy_n(block.samples, count, out.begin());
+      std::atomic_thread_fence(std::memory_order_acquire);
+   } while ((before & 1) != 0 || block.version.load(std::memory_order_relaxed) != before);
+
+   return count;
+}
+
+std::size_t reader::history(std::size_t index, std::uint64_t& first, std::span<sample> out) const {
+   const sensor& s = seg_->sensors[index];
+   std::uint64_t head = s.head.load(std::memory_order_acquire);
+   std::size_t count = 0;
+
+   if (head > history_size && first < head - history_size) {
+      first = head - history_size;
+   }
+
+   while (first < head && count < out.size()) {
+      const history_entry& entry = s.history[first & (history_size - 1)];
+      std::uint64_t expected = 2 * (first + 1);
+
+      if (entry.version.load(std::memory_order_acquire) != expected) {
+         /* overwritten meanwhile, catch up with the writer */
+         head = s.head.load(std::memory_order_acquire);
+         if (head > history_size && first < head - history_size) {
+            first = head - history_size;
+            continue;
+         }
+         ++first;
+         continue;
+      }
+
+      out[count] = entry.value;
+      std::atomic_thread_fence(std::memory_order_acquire);
+
+      if (entry.version.load(std::memory_order_relaxed) == expected) {
+         ++count;
+      }
+      ++first;
+   }
+
+   return count;
+}
+
+}